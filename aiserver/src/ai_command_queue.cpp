@@ -0,0 +1,152 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "ai_command_queue.h"
+#include "logger/log.h"
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "AICommandQueue"
+
+namespace rockchip {
+namespace aiserver {
+
+static int64_t getNowUs() {
+    struct timespec now = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+AICommandQueue::AICommandQueue(const char *name) {
+    mName = name;
+    mThread = nullptr;
+    mRunning = false;
+    memset(&mStats, 0, sizeof(mStats));
+}
+
+AICommandQueue::~AICommandQueue() {
+    stop();
+}
+
+int32_t AICommandQueue::start() {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mThread != nullptr) {
+        return 0;
+    }
+    mRunning = true;
+    mThread = new std::thread(&AICommandQueue::threadLoop, this);
+    return 0;
+}
+
+int32_t AICommandQueue::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mThread == nullptr) {
+            return 0;
+        }
+        mRunning = false;
+        mCond.notify_all();
+    }
+    mThread->join();
+    delete mThread;
+    mThread = nullptr;
+    return 0;
+}
+
+AICommandToken AICommandQueue::post(const std::string &key, AICommandFunc func, int64_t delayMs) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mStats.posted++;
+
+    AICommand command;
+    command.key   = key;
+    command.func  = func;
+    command.dueUs = delayMs > 0 ? getNowUs() + delayMs * 1000 : 0;
+    command.promise = std::make_shared<std::promise<int32_t>>();
+    command.token   = command.promise->get_future().share();
+
+    if (!mRunning) {
+        // not started, or stop() has begun and the worker may be past the
+        // last drain, nobody would ever run it
+        LOG_ERROR("%s: drop command(%s), queue not running\n", mName.c_str(), key.c_str());
+        command.promise->set_value(-1);
+        return command.token;
+    }
+
+    if (!key.empty()) {
+        for (auto it = mQueue.begin(); it != mQueue.end(); ++it) {
+            if (it->key == key) {
+                it->func  = func;
+                it->dueUs = command.dueUs;
+                mStats.coalesced++;
+                mCond.notify_one();
+                return it->token;
+            }
+        }
+    }
+
+    mQueue.push_back(command);
+    mCond.notify_one();
+    return command.token;
+}
+
+void AICommandQueue::getStats(AICommandStats *stats) {
+    std::lock_guard<std::mutex> lock(mLock);
+    *stats = mStats;
+    stats->pending = (int64_t)mQueue.size();
+}
+
+void AICommandQueue::threadLoop() {
+    prctl(PR_SET_NAME, mName.c_str());
+    std::unique_lock<std::mutex> lock(mLock);
+    while (true) {
+        mCond.wait(lock, [this] { return !mRunning || !mQueue.empty(); });
+        if (mQueue.empty()) {
+            break;
+        }
+
+        // first command that is due, delayed ones keep their place
+        int64_t nowUs = getNowUs();
+        int64_t nextDueUs = INT64_MAX;
+        auto it = mQueue.begin();
+        for (; it != mQueue.end(); ++it) {
+            if (it->dueUs <= nowUs || !mRunning) {
+                break;
+            }
+            nextDueUs = std::min(nextDueUs, it->dueUs);
+        }
+        if (it == mQueue.end()) {
+            mCond.wait_for(lock, std::chrono::microseconds(nextDueUs - nowUs));
+            continue;
+        }
+
+        AICommand command = *it;
+        mQueue.erase(it);
+        lock.unlock();
+
+        int64_t startUs = getNowUs();
+        int32_t ret = command.func();
+        int64_t execUs = getNowUs() - startUs;
+        if (ret != 0) {
+            LOG_ERROR("%s: command(%s) failed(%d)\n", mName.c_str(), command.key.c_str(), ret);
+        }
+        command.promise->set_value(ret);
+
+        lock.lock();
+        mStats.executed++;
+        if (execUs > mStats.maxExecUs) {
+            mStats.maxExecUs = execUs;
+        }
+    }
+}
+
+} // namespace aiserver
+} // namespace rockchip
@@ -0,0 +1,79 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef _RK_AI_COMMAND_QUEUE_H_
+#define _RK_AI_COMMAND_QUEUE_H_
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace rockchip {
+namespace aiserver {
+
+typedef std::function<int32_t()>  AICommandFunc;
+typedef std::shared_future<int32_t> AICommandToken;
+
+typedef struct _AICommandStats {
+    int64_t posted;
+    int64_t coalesced;  // dropped in favour of a later command with the same key
+    int64_t executed;
+    int64_t pending;
+    int64_t maxExecUs;
+} AICommandStats;
+
+/*
+ * graph control commands run one by one on a worker thread, so callers
+ * (dbus, uvc control loop) return at once instead of waiting out a graph
+ * rebuild. a command posted with a key replaces the one still queued under
+ * that key in its place, so it still runs ahead of what was posted after
+ * the first one, and both callers share the same token. delayed commands
+ * wait in the queue without holding up the ones behind. a command that
+ * returns non-zero is logged with its key.
+ */
+class AICommandQueue {
+ public:
+    explicit AICommandQueue(const char *name);
+    ~AICommandQueue();
+
+    int32_t start();
+    // runs what is still queued, then joins the worker
+    int32_t stop();
+
+    // empty key never coalesces
+    AICommandToken post(const std::string &key, AICommandFunc func, int64_t delayMs = 0);
+    void    getStats(AICommandStats *stats);
+
+ private:
+    typedef struct _AICommand {
+        std::string   key;
+        AICommandFunc func;
+        int64_t       dueUs;  // CLOCK_MONOTONIC, 0 runs as soon as possible
+        std::shared_ptr<std::promise<int32_t>> promise;
+        AICommandToken token;
+    } AICommand;
+
+    void    threadLoop();
+
+ private:
+    std::string             mName;
+    std::mutex              mLock;
+    std::condition_variable mCond;
+    std::list<AICommand>    mQueue;
+    std::thread            *mThread;
+    bool                    mRunning;
+    AICommandStats          mStats;
+};
+
+} // namespace aiserver
+} // namespace rockchip
+
+#endif // _RK_AI_COMMAND_QUEUE_H_
@@ -0,0 +1,79 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+
+#include <chrono>
+
+#include "ai_feature_pool.h"
+
+namespace rockchip {
+namespace aiserver {
+
+AIFeaturePool::AIFeaturePool(int32_t depth) {
+    mDepth = depth;
+    mClosed = true;
+}
+
+AIFeaturePool::~AIFeaturePool() {
+    std::map<void *, int32_t>::iterator it;
+    for (it = mImages.begin(); it != mImages.end(); it++) {
+        free(it->first);
+    }
+    mImages.clear();
+    mFreeImages.clear();
+}
+
+void *AIFeaturePool::acquire(int32_t size, int32_t waitMs) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (mFreeImages.empty() && (int32_t)mImages.size() < mDepth) {
+        void *image = malloc(size);
+        if (image != nullptr) {
+            mImages[image] = size;
+        }
+        return image;
+    }
+
+    // all images are at the npu, wait for one to come back
+    if (!mCond.wait_for(lock, std::chrono::milliseconds(waitMs),
+                        [this] { return !mFreeImages.empty() || mClosed; })
+            || mFreeImages.empty()) {
+        return nullptr;
+    }
+    void *image = mFreeImages.back();
+    mFreeImages.pop_back();
+    if (mImages[image] < size) {
+        mImages.erase(image);
+        free(image);
+        image = malloc(size);
+        if (image == nullptr) {
+            return nullptr;
+        }
+        mImages[image] = size;
+    }
+    return image;
+}
+
+void AIFeaturePool::release(void *image) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (image == nullptr || mImages.find(image) == mImages.end()) {
+        return;
+    }
+    mFreeImages.push_back(image);
+    mCond.notify_one();
+}
+
+void AIFeaturePool::open() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mClosed = false;
+}
+
+void AIFeaturePool::close() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mClosed = true;
+    mCond.notify_all();
+}
+
+} // namespace aiserver
+} // namespace rockchip
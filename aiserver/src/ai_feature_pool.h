@@ -0,0 +1,48 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef _RK_AI_FEATURE_POOL_H_
+#define _RK_AI_FEATURE_POOL_H_
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace rockchip {
+namespace aiserver {
+
+/*
+ * image copies handed to the recognizer, reused across feature jobs. at
+ * most depth of them exist, acquire() waits for one to come back once
+ * they are all in flight. an image grows to the largest size asked for.
+ */
+class AIFeaturePool {
+ public:
+    explicit AIFeaturePool(int32_t depth);
+    ~AIFeaturePool();
+
+    // nullptr after waitMs without a free image, or once closed
+    void   *acquire(int32_t size, int32_t waitMs);
+    // images that are not from the pool are ignored
+    void    release(void *image);
+    // close() wakes the waiters, open() lets acquire() wait again
+    void    open();
+    void    close();
+
+ private:
+    std::mutex     mMutex;
+    std::condition_variable mCond;
+    int32_t        mDepth;
+    bool           mClosed;
+    std::map<void *, int32_t> mImages;   // image -> allocated size
+    std::vector<void *> mFreeImages;
+};
+
+} // namespace aiserver
+} // namespace rockchip
+
+#endif // _RK_AI_FEATURE_POOL_H_
@@ -2,6 +2,10 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+
 #include "ai_feature_retriver.h"
 #include "logger/log.h"
 #include "nn_data.pb.h"
@@ -9,26 +13,38 @@
 #include "RTMediaBuffer.h"
 #include "RTMediaMetaKeys.h"
 
+// a free pool image is waited for this long before a one off copy is made
+#define FEATURE_POOL_WAIT_MS     5000
+
 namespace rockchip {
 namespace aiserver {
 
 // send NN data to SmartDisplayService
 RT_RET AIFeatureRetriver::ai_feature_output_callback(RTMediaBuffer *buffer) {
     int32_t ret = 0;
+    void   *data = buffer->getData();
 
     ret = mAITaskManager->processAIFeature(buffer);
     if (ret < 0) {
         mAIGraph->recognize(buffer);
+    } else {
+        // the handler released the buffer, the image goes back to the pool
+        mPool.release(data);
     }
 
     return RT_OK;
 }
 
-AIFeatureRetriver::AIFeatureRetriver() {
+AIFeatureRetriver::AIFeatureRetriver()
+        : mPool(FEATURE_POOL_DEPTH) {
     mAIGraph = RT_NULL;
+    mAITaskManager = RT_NULL;
+    mIngestThread = nullptr;
+    mIngestRunning = false;
 }
 
 AIFeatureRetriver::~AIFeatureRetriver() {
+    stopIngest();
     if (mAIGraph != nullptr) {
         delete mAIGraph;
         mAIGraph = nullptr;
@@ -68,11 +84,19 @@ INT32 AIFeatureRetriver::start() {
         mAIGraph->start();
     }
 
+    std::lock_guard<std::mutex> jobLock(mJobMutex);
+    if (mIngestThread == nullptr) {
+        mIngestRunning = true;
+        mPool.open();
+        mIngestThread = new std::thread(ingestLoop, reinterpret_cast<void *>(this));
+    }
+
     return 0;
 }
 
 INT32 AIFeatureRetriver::stop() {
     LOG_INFO("stop ai graph(%p)\n", mAIGraph);
+    stopIngest();
     std::lock_guard<std::mutex> lock(mOpMutex);
     if (mAIGraph != NULL) {
         mAIGraph->stop();
@@ -84,10 +108,107 @@ INT32 AIFeatureRetriver::stop() {
 
 #define USE_SHM_DATA   1
 
-INT32 AIFeatureRetriver::runTaskOnce(void *params) {
-    RTImage         imgQueue;
-    std::string     imgRaw;
+void AIFeatureRetriver::stopIngest() {
+    std::thread *thread = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mJobMutex);
+        mIngestRunning = false;
+        thread = mIngestThread;
+        mIngestThread = nullptr;
+    }
+    mJobCond.notify_all();
+    mPool.close();
+    if (thread != nullptr) {
+        thread->join();
+        delete thread;
+    }
+
+    std::lock_guard<std::mutex> lock(mJobMutex);
+    while (!mJobs.empty()) {
+        delete mJobs.front();
+        mJobs.pop_front();
+    }
+}
+
+void AIFeatureRetriver::ingestLoop(void *arg) {
+    AIFeatureRetriver *retriver = reinterpret_cast<AIFeatureRetriver *>(arg);
+    prctl(PR_SET_NAME, "aiFeatureIngest");
+    std::chrono::steady_clock::time_point expireAt = std::chrono::steady_clock::now();
+    while (true) {
+        AIFeatureJob *job = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(retriver->mJobMutex);
+            retriver->mJobCond.wait_for(lock, std::chrono::milliseconds(FEATURE_EXPIRE_PERIOD_MS), [retriver] {
+                return !retriver->mIngestRunning || !retriver->mJobs.empty();
+            });
+            if (!retriver->mIngestRunning) {
+                break;
+            }
+            if (!retriver->mJobs.empty()) {
+                job = retriver->mJobs.front();
+                retriver->mJobs.pop_front();
+            }
+        }
+        // also when idle, a batch that lost an image is still answered in time
+        if (std::chrono::steady_clock::now() >= expireAt) {
+            retriver->mAITaskManager->expireFeatureRequests();
+            expireAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(FEATURE_EXPIRE_PERIOD_MS);
+        }
+        if (job != nullptr) {
+            retriver->ingestJob(job);
+            delete job;
+        }
+    }
+}
+
+/*
+ * one job is one RTImage batch. the images are copied into pool images
+ * while the npu works on the ones before, at most FEATURE_POOL_DEPTH of
+ * them are in flight. the handler answers the whole batch with one message
+ * once every image of it came back (batch_size).
+ */
+void AIFeatureRetriver::ingestJob(AIFeatureJob *job) {
+    RTImage imgQueue;
+    if (job->raw.length() > 0) {
+        imgQueue.ParseFromString(job->raw);
+    }
+    LOG_INFO("feature job %s parsed image_queue((%dx%d)x%d)\n", job->uuid.c_str(),
+             imgQueue.width(), imgQueue.height(), imgQueue.data_size());
+
+    if (imgQueue.data_size() <= 0) {
+        RTMediaBuffer *buffer = new RTMediaBuffer(RT_NULL, 0);
+        buffer->getMetaData()->setCString("stream_uuid", job->uuid.c_str());
+        mAITaskManager->processAIFeature(buffer);
+        LOG_INFO("reply empty nn data with empty input data, uuid %s\n", job->uuid.c_str());
+        return;
+    }
+
+    for (INT32 idx = 0; idx < imgQueue.data_size(); idx++) {
+        INT32 imgSize = imgQueue.data(idx).length();
+        RTMediaBuffer *buffer = RT_NULL;
+        void *image = mPool.acquire(imgSize, FEATURE_POOL_WAIT_MS);
+        if (image != nullptr) {
+            buffer = new RTMediaBuffer(image, imgSize);
+        } else {
+            LOG_ERROR("no pool image in %dms, copy image %d alone\n", FEATURE_POOL_WAIT_MS, idx);
+            buffer = new RTMediaBuffer(imgSize);
+        }
+        UINT8 *imgData = (UINT8 *)buffer->getData();
+        memcpy(imgData, imgQueue.data(idx).c_str(), imgSize);
+
+        buffer->getMetaData()->setInt32("opt_width",  imgQueue.width());
+        buffer->getMetaData()->setInt32("opt_height", imgQueue.height());
+        buffer->getMetaData()->setCString("stream_fmt_in", "image:nv21");
+        buffer->getMetaData()->setCString("stream_uuid", job->uuid.c_str());
+        buffer->getMetaData()->setInt32("detect_type", job->detectType);
+        buffer->getMetaData()->setInt32("batch_size", imgQueue.data_size());
+        buffer->getMetaData()->setInt32("batch_index", idx);
+        LOG_DEBUG("ready to recognize image(buf=%p,data=%p,size=%d)\n", buffer, imgData, imgSize);
+        mAIGraph->recognize(buffer);
+    }
+}
 
+INT32 AIFeatureRetriver::runTaskOnce(void *params) {
     if (mAIGraph == NULL) {
         LOG_ERROR("failed to get ai graph\n");
         return -1;
@@ -101,37 +222,25 @@ INT32 AIFeatureRetriver::runTaskOnce(void *params) {
     LOG_INFO("runTaskOnce name: %s, type %s, uuid %s\n", name, type, uuid);
 
 #if USE_SHM_DATA
-    shm_queue_recv_buffer(&imgRaw);
-    if (imgRaw.length() > 0) {
-        imgQueue.ParseFromString(imgRaw);
-    }
-
-    LOG_INFO("nanlyse_ipc_client received_image(%p) size=%zu\n", imgRaw, imgRaw.length());
-    LOG_INFO("nanlyse_ipc_client parsed image_queue((%dx%d)x%d)\n", \
-                                    imgQueue.width(), imgQueue.height(), \
-                                    imgQueue.data_size());
-
-    if (imgQueue.data_size() > 0) {
-        for (INT32 idx = 0; idx < imgQueue.data_size(); idx++) {
-            INT32 imgSize = imgQueue.data(idx).length();
-            RTMediaBuffer *buffer = new RTMediaBuffer(imgSize);
-            UINT8 *imgData = (UINT8 *)buffer->getData();
-            memcpy(imgData, imgQueue.data(idx).c_str(), imgSize);
-
-            buffer->getMetaData()->setInt32("opt_width",  imgQueue.width());
-            buffer->getMetaData()->setInt32("opt_height", imgQueue.height());
-            buffer->getMetaData()->setCString("stream_fmt_in", "image:nv21");
-            buffer->getMetaData()->setCString("stream_uuid", uuid);
-            buffer->getMetaData()->setInt32("detect_type", mAITaskManager->convertDetectType(atoi(type)));
-            LOG_INFO("ready to recognize image(buf=%p,data=%p,size=%d)\n", buffer, imgData, imgSize);
-            mAIGraph->recognize(buffer);
-        }
-    } else {
-        RTMediaBuffer *buffer = new RTMediaBuffer(RT_NULL, 0);
-        buffer->getMetaData()->setCString("stream_uuid", uuid);
-        mAITaskManager->processAIFeature(buffer);
-        LOG_INFO("reply empty nn data with empty input data, uuid %s\n", uuid);
+    // only take the request off the channel here, the ingest thread does the rest
+    AIFeatureJob *job = new AIFeatureJob();
+    if (shm_feature_recv_request(uuid, &job->raw, SHM_FEATURE_RECV_TIMEOUT_MS) < 0) {
+        LOG_ERROR("feature request %s has no images\n", uuid);
+    }
+    job->detectType = mAITaskManager->convertDetectType(atoi(type));
+    job->uuid = uuid;
+    LOG_INFO("nanlyse_ipc_client received_image size=%zu\n", job->raw.length());
+
+    std::unique_lock<std::mutex> lock(mJobMutex);
+    if (!mIngestRunning) {
+        lock.unlock();
+        ingestJob(job);
+        delete job;
+        return 0;
     }
+    mJobs.push_back(job);
+    lock.unlock();
+    mJobCond.notify_one();
 #else
     UINT32 imgSize = 1280 * 720 * 3 / 2;
     RTMediaBuffer *buffer = new RTMediaBuffer(imgSize);
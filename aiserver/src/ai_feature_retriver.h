@@ -5,16 +5,33 @@
 #ifndef _RK_AI_FEATURE_RETRIVER_H_
 #define _RK_AI_FEATURE_RETRIVER_H_
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <mutex>
+#include <string>
+#include <thread>
+#include "ai_feature_pool.h"
 #include "ai_task_manager.h"
 #include "RTAIGraph.h"
 
 #define PRELOAD_HANDLE_FEATURE   1
 #define PRELOAD_HANDLE_AI        1
 
+// image copies in flight to the npu, more only queue up in the graph
+#define FEATURE_POOL_DEPTH       4
+// the ingest thread looks for unanswered feature batches this often
+#define FEATURE_EXPIRE_PERIOD_MS 1000
+
 namespace rockchip {
 namespace aiserver {
 
+typedef struct _AIFeatureJob {
+    std::string raw;         // serialized RTImage
+    int32_t     detectType;
+    std::string uuid;
+} AIFeatureJob;
+
 class AIFeatureRetriver {
  public:
     AIFeatureRetriver();
@@ -30,10 +47,24 @@ class AIFeatureRetriver {
     INT32  preload();
     RT_RET ai_feature_output_callback(RTMediaBuffer *buffer);
 
+    // runs the queued jobs, so the caller of runTaskOnce() never waits for the npu
+    static void ingestLoop(void *arg);
+    void   ingestJob(AIFeatureJob *job);
+    void   stopIngest();
+
  private:
     std::mutex     mOpMutex;
     RTAIGraph     *mAIGraph;
     AITaskManager *mAITaskManager;
+
+    std::mutex     mJobMutex;
+    std::condition_variable   mJobCond;
+    std::deque<AIFeatureJob *> mJobs;
+    std::thread   *mIngestThread;
+    bool           mIngestRunning;
+
+    // image copies handed to the graph, reused across jobs
+    AIFeaturePool  mPool;
 };
 
 } // namespace aiserver
@@ -2,6 +2,9 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "ai_scene_director.h"
 #include "logger/log.h"
 
@@ -14,6 +17,8 @@
 #define LOG_TAG "AISceneDirector"
 
 #define ZOOM_NODE_ID                3
+#define FACE_GALLERY_ENV            "AI_FACE_GALLERY"
+#define FACE_GALLERY_DEFAULT_PATH   "/userdata/aiserver_face_gallery.bin"
 
 namespace rockchip {
 namespace aiserver {
@@ -21,7 +26,7 @@ namespace aiserver {
 // send NN data to SDS
 RT_RET AISceneDirector::nn_data_output_callback(RTMediaBuffer *buffer) {
 #if UVC_DYNAMIC_DEBUG
-    if (!access(UVC_DYNAMIC_DEBUG_IPC_BUFFER_CHECK, 0)) {
+    if (FrameTracer::isEnabled(FRAME_TRACE_IPC_LOG)) {
         LOG_ERROR("send nn data buffer %p\n", buffer);
     }
 #endif
@@ -46,6 +51,13 @@ RT_RET AISceneDirector::uvc_data_output_callback(RTMediaBuffer *buffer) {
 AISceneDirector::AISceneDirector() {
     mAITaskManager = new AITaskManager();
     mAIFeatureRetriver = new AIFeatureRetriver();
+    mFaceGallery = new AIFaceGallery();
+    const char *galleryPath = getenv(FACE_GALLERY_ENV);
+    mFaceGallery->open(galleryPath != nullptr ? galleryPath : FACE_GALLERY_DEFAULT_PATH);
+    mAITaskManager->setFaceGallery(mFaceGallery);
+    // before the uvc control loop starts posting to it
+    mCommandQueue = new AICommandQueue("aiCmdQueue");
+    mCommandQueue->start();
     mUVCController = new ShmUVCController();
     mUVCController->setControlListener(this);
     mUVCController->startRecvMessage();
@@ -54,13 +66,23 @@ AISceneDirector::AISceneDirector() {
 }
 
 AISceneDirector::~AISceneDirector() {
+    mGovernNNRate = false;
+    // nothing posts commands once the uvc control loop is gone
+    if (mUVCController != nullptr) {
+        mUVCController->stopRecvMessage();
+    }
+
+    // a stopped queue drops later posts, the object outlives the graph
+    if (mCommandQueue != nullptr) {
+        mCommandQueue->stop();
+    }
+
     if (nullptr != mUVCGraph) {
         delete mUVCGraph;
         mUVCGraph = nullptr;
     }
 
     if (mUVCController != nullptr) {
-        mUVCController->stopRecvMessage();
         delete mUVCController;
         mUVCController = nullptr;
     }
@@ -75,6 +97,16 @@ AISceneDirector::~AISceneDirector() {
         delete mAITaskManager;
         mAITaskManager = nullptr;
     }
+
+    if (mFaceGallery != nullptr) {
+        delete mFaceGallery;
+        mFaceGallery = nullptr;
+    }
+
+    if (mCommandQueue != nullptr) {
+        delete mCommandQueue;
+        mCommandQueue = nullptr;
+    }
 }
 
 int32_t AISceneDirector::setup() {
@@ -104,6 +136,8 @@ int32_t AISceneDirector::prepareUVCGraph() {
         mUVCGraph->observeMattingOutputStream(std::bind(&AISceneDirector::ai_matting_output_callback, this, std::placeholders::_1));
         mUVCGraph->prepare();
         mUVCGraph->start();
+        mGovernNNRate = true;
+        scheduleNNGovernor();
     }
 
     return 0;
@@ -111,6 +145,9 @@ int32_t AISceneDirector::prepareUVCGraph() {
 
 int32_t AISceneDirector::interrupt() {
     LOG_INFO("interrupt uvc graph(ref=%d)\n", mUVCGraphRef);
+    // let the stop commands posted before us finish first
+    mGovernNNRate = false;
+    mCommandQueue->stop();
     std::lock_guard<std::mutex> lock(mOpMutex);
     if (nullptr != mUVCGraph && mUVCGraphRef == 0) {
         LOG_INFO("stop uvc graph(ref=%d)\n", mUVCGraphRef);
@@ -118,6 +155,8 @@ int32_t AISceneDirector::interrupt() {
         LOG_INFO("release uvc graph\n");
         delete mUVCGraph;
         mUVCGraph = nullptr;
+        std::lock_guard<std::mutex> rateLock(mRateMutex);
+        mHasNNRate = false;
     }
 
     if (nullptr != mAIFeatureRetriver) {
@@ -137,11 +176,18 @@ int32_t AISceneDirector::waitUntilDone() {
 
 int32_t AISceneDirector::start(const std::string &appName) {
     LOG_INFO("start app(%s)\n", appName.c_str());
+    return postCommand("", [this, appName]() { return doStart(appName); });
+}
+
+int32_t AISceneDirector::doStart(const std::string &appName) {
     std::lock_guard<std::mutex> lock(mOpMutex);
     if (appName == RT_APP_UVC) {
         if (!mEnableUVC) {
             LOG_INFO("start app -> open uvc in\n");
-            mUVCGraph->openUVC();
+            if (nullptr == mUVCGraph || mUVCGraph->openUVC() != RT_OK) {
+                LOG_ERROR("start app -> open uvc failed\n");
+                return -1;
+            }
             LOG_INFO("start app -> open uvc ok\n");
             mUVCGraphRef++;
             mEnableUVC = 1;
@@ -154,6 +200,7 @@ int32_t AISceneDirector::start(const std::string &appName) {
         }
     } else {
         LOG_ERROR("start for unknown app(%s)\n", appName.c_str());
+        return -1;
     }
 
     return 0;
@@ -161,6 +208,10 @@ int32_t AISceneDirector::start(const std::string &appName) {
 
 int32_t AISceneDirector::stop(const std::string &appName) {
     LOG_INFO("stop app(%s)\n", appName.c_str());
+    return postCommand("", [this, appName]() { return doStop(appName); });
+}
+
+int32_t AISceneDirector::doStop(const std::string &appName) {
     std::lock_guard<std::mutex> lock(mOpMutex);
     if (appName == RT_APP_UVC) {
         if (mEnableUVC) {
@@ -178,6 +229,7 @@ int32_t AISceneDirector::stop(const std::string &appName) {
         }
     } else {
         LOG_ERROR("stop for unknown app(%s)\n", appName.c_str());
+        return -1;
     }
     // interrupt();
 
@@ -190,75 +242,107 @@ int32_t AISceneDirector::observeGraphOutput(const std::string &appName, const in
 
 int32_t AISceneDirector::setEPTZ(const AI_UVC_EPTZ_MODE &mode, const int32_t &val) {
     LOG_INFO("seteptz mode:(%d) val:(%d)\n", mode, val);
-    if (nullptr != mUVCGraph) {
-        if(mode == AI_UVC_EPTZ_AUTO){
-            mUVCGraph->setEptz(mode, val);
-            LOG_INFO("seteptz ok\n");
-            return 0;
+    std::string key = "eptz:" + std::to_string(mode);
+    return postCommand(key, [this, mode, val]() {
+        std::lock_guard<std::mutex> lock(mOpMutex);
+        if (nullptr == mUVCGraph) {
+            return -1;
+        }
+        RT_RET ret = mUVCGraph->setEptz(mode, val);
+        if (mode == AI_UVC_EPTZ_AUTO) {
+            LOG_INFO("seteptz ret(%d)\n", ret);
+            return (int32_t)ret;
         }
-        mUVCGraph->setEptz(mode, val);
         RtMetaData meta;
         meta.setInt32(kKeyTaskNodeId, ZOOM_NODE_ID);
-        if(mode == AI_UVC_EPTZ_PAN)
+        if (mode == AI_UVC_EPTZ_PAN)
             meta.setCString(kKeyPipeInvokeCmd, "set_pan");
-        if(mode == AI_UVC_EPTZ_TILT)
+        if (mode == AI_UVC_EPTZ_TILT)
             meta.setCString(kKeyPipeInvokeCmd, "set_tilt");
-        if(mode == AI_UVC_BYPASS_LINK)
+        if (mode == AI_UVC_BYPASS_LINK)
             meta.setCString(kKeyPipeInvokeCmd, "set_bypass");
         meta.setInt32("value", val);
-        mUVCGraph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &meta);
-        LOG_INFO("set ptz ok\n");
-    }
-    return 0;
+        if (ret == RT_OK) {
+            ret = mUVCGraph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &meta);
+        }
+        LOG_INFO("set ptz ret(%d)\n", ret);
+        return (int32_t)ret;
+    });
 }
 
 int32_t AISceneDirector::setZoom(const double &val) {
     LOG_INFO("setZoom(%f)\n", val);
     float zoomVal = (float)val;
-    if (nullptr != mUVCGraph) {
-        mUVCGraph->setZoom(zoomVal);
-        RtMetaData meta;
-        meta.setInt32(kKeyTaskNodeId, ZOOM_NODE_ID);
-        meta.setCString(kKeyPipeInvokeCmd, "set_zoom");
-        meta.setFloat("value", zoomVal);
-        mUVCGraph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &meta);
-    }
-    LOG_INFO("setZoom ok\n");
-    return 0;
+    return postCommand("zoom", [this, zoomVal]() {
+        std::lock_guard<std::mutex> lock(mOpMutex);
+        if (nullptr == mUVCGraph) {
+            return -1;
+        }
+        RT_RET ret = mUVCGraph->setZoom(zoomVal);
+        if (ret == RT_OK) {
+            RtMetaData meta;
+            meta.setInt32(kKeyTaskNodeId, ZOOM_NODE_ID);
+            meta.setCString(kKeyPipeInvokeCmd, "set_zoom");
+            meta.setFloat("value", zoomVal);
+            ret = mUVCGraph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &meta);
+        }
+        LOG_INFO("setZoom(%f) ret(%d)\n", zoomVal, ret);
+        return (int32_t)ret;
+    });
 }
+
 int32_t AISceneDirector::setFaceAE(const int32_t &enabled) {
     LOG_INFO("setFaceAE enabled:(%d)\n", enabled);
-    if (nullptr != mUVCGraph) {
-        mUVCGraph->setFaceAE(enabled);
-    }
-    LOG_INFO("setFaceAE ok\n");
-    return 0;
+    postCommand("face_ae", [this, enabled]() {
+        std::lock_guard<std::mutex> lock(mOpMutex);
+        if (nullptr == mUVCGraph) {
+            return -1;
+        }
+        RT_RET ret = mUVCGraph->setFaceAE(enabled);
+        LOG_INFO("setFaceAE ret(%d)\n", ret);
+        return (int32_t)ret;
+    });
 }
+
 int32_t AISceneDirector::setFaceLine(const int32_t &enabled) {
     LOG_INFO("setFaceLine enabled:(%d)\n", enabled);
-    if (nullptr != mUVCGraph) {
-        mUVCGraph->setFaceLine(enabled);
-    }
-    LOG_INFO("setFaceLine ok\n");
-    return 0;
+    postCommand("face_line", [this, enabled]() {
+        std::lock_guard<std::mutex> lock(mOpMutex);
+        if (nullptr == mUVCGraph) {
+            return -1;
+        }
+        RT_RET ret = mUVCGraph->setFaceLine(enabled);
+        LOG_INFO("setFaceLine ret(%d)\n", ret);
+        return (int32_t)ret;
+    });
 }
 
 int32_t AISceneDirector::enableAIAlgorithm(const std::string &type) {
     LOG_INFO("enableAIAlgorithm(%s)\n", type.c_str());
-    if (nullptr != mUVCGraph) {
-        mUVCGraph->enableAIAlgorithm(type);
-    }
-    LOG_INFO("enableAIAlgorithm ok\n");
-    return 0;
+    // enable and disable of one type collapse to the last one
+    postCommand("ai:" + type, [this, type]() {
+        std::lock_guard<std::mutex> lock(mOpMutex);
+        if (nullptr == mUVCGraph) {
+            return -1;
+        }
+        RT_RET ret = mUVCGraph->enableAIAlgorithm(type);
+        LOG_INFO("enableAIAlgorithm(%s) ret(%d)\n", type.c_str(), ret);
+        return (int32_t)ret;
+    });
 }
 
 int32_t AISceneDirector::disableAIAlgorithm(const std::string &type) {
     LOG_INFO("disableAIAlgorithm(%s)\n", type.c_str());
-    if (nullptr != mUVCGraph) {
-        mUVCGraph->disableAIAlgorithm(type);
-    }
-    LOG_INFO("disableAIAlgorithm ok\n");
-    return 0;
+    postCommand("ai:" + type, [this, type]() {
+        std::lock_guard<std::mutex> lock(mOpMutex);
+        if (nullptr == mUVCGraph) {
+            return -1;
+        }
+        RT_RET ret = mUVCGraph->disableAIAlgorithm(type);
+        LOG_INFO("disableAIAlgorithm(%s) ret(%d)\n", type.c_str(), ret);
+        scheduleSubgraphRelease();
+        return (int32_t)ret;
+    });
 }
 
 int32_t AISceneDirector::updateAIAlgorithmParams(const std::string &params) {
@@ -267,33 +351,46 @@ int32_t AISceneDirector::updateAIAlgorithmParams(const std::string &params) {
     std::string params_name = params.substr(0, pos);
     float params_value = atof(params.substr(pos + 1, params.size() - 1).c_str());
     LOG_INFO("updateAIAlgorithmParams name(%s) value(%.2f) \n", params_name.c_str(), params_value);
-    RtMetaData meta;
-    meta.setCString(kKeyPipeInvokeCmd, "set_nn_params");
-    meta.setCString("st_param_type", params_name.c_str());
-    meta.setFloat("st_param_value", params_value);
-    if (nullptr != mUVCGraph) {
-        mUVCGraph->updateNNParams(&meta);
-    }
-    LOG_INFO("updateAIAlgorithmParams ok\n");
-    return 0;
+    postCommand("nn_params:" + params_name, [this, params_name, params_value]() {
+        std::lock_guard<std::mutex> lock(mOpMutex);
+        if (nullptr == mUVCGraph) {
+            return -1;
+        }
+        RtMetaData meta;
+        meta.setCString(kKeyPipeInvokeCmd, "set_nn_params");
+        meta.setCString("st_param_type", params_name.c_str());
+        meta.setFloat("st_param_value", params_value);
+        RT_RET ret = mUVCGraph->updateNNParams(&meta);
+        LOG_INFO("updateAIAlgorithmParams ret(%d)\n", ret);
+        return (int32_t)ret;
+    });
 }
 
 int32_t AISceneDirector::openAIMatting() {
     LOG_INFO("openAIMatting in\n");
-    if (nullptr != mUVCGraph) {
-        mUVCGraph->openAIMatting();
-    }
-    LOG_INFO("openAIMatting ok\n");
-    return 0;
+    return postCommand("matting", [this]() {
+        std::lock_guard<std::mutex> lock(mOpMutex);
+        if (nullptr == mUVCGraph) {
+            return -1;
+        }
+        RT_RET ret = mUVCGraph->openAIMatting();
+        LOG_INFO("openAIMatting ret(%d)\n", ret);
+        return (int32_t)ret;
+    });
 }
 
 int32_t AISceneDirector::closeAIMatting() {
     LOG_INFO("closeAIMatting in\n");
-    if (nullptr != mUVCGraph) {
-        mUVCGraph->closeAIMatting();
-    }
-    LOG_INFO("closeAIMatting ok\n");
-    return 0;
+    return postCommand("matting", [this]() {
+        std::lock_guard<std::mutex> lock(mOpMutex);
+        if (nullptr == mUVCGraph) {
+            return -1;
+        }
+        RT_RET ret = mUVCGraph->closeAIMatting();
+        LOG_INFO("closeAIMatting ret(%d)\n", ret);
+        scheduleSubgraphRelease();
+        return (int32_t)ret;
+    });
 }
 
 
@@ -329,28 +426,146 @@ int32_t AISceneDirector::invokeFeature(const std::string &actionName, void *para
 }
 
 int32_t AISceneDirector::invokeUVC(const std::string &actionName, void *params) {
-    prepareUVCGraph();
-
-    std::lock_guard<std::mutex> lock(mOpMutex);
-    if (nullptr == mUVCGraph) {
-        LOG_ERROR("uvc graph not existed\n");
-        return -1;
-    }
-
     if (actionName == RT_ACTION_CONFIG_CAMERA) {
+        // params belong to the caller, keep what the graph needs
         RtMetaData *cameraParams = reinterpret_cast<RtMetaData *>(params);
-        mUVCGraph->updateCameraParams(cameraParams);
-        LOG_INFO("updateCameraParams ok\n");
-        return 0;
+        AICameraConfig config;
+        memset(&config, 0, sizeof(config));
+        cameraParams->findInt32("opt_width",        &config.width);
+        cameraParams->findInt32("opt_height",       &config.height);
+        cameraParams->findInt32("opt_vir_width",    &config.virWidth);
+        cameraParams->findInt32("opt_vir_height",   &config.virHeight);
+        cameraParams->findInt32("node_buff_size",   &config.bufSize);
+        cameraParams->findInt32("opt_quantization", &config.quant);
+        return postCommand("camera", [this, config]() { return doUpdateCamera(config); });
     }
 
     LOG_ERROR("unsupport action(%s)\n", actionName.c_str());
     return -1;
 }
 
+int32_t AISceneDirector::doUpdateCamera(const AICameraConfig &config) {
+    prepareUVCGraph();
+
+    {
+        std::lock_guard<std::mutex> lock(mOpMutex);
+        if (nullptr == mUVCGraph) {
+            LOG_ERROR("uvc graph not existed\n");
+            return -1;
+        }
+
+        RtMetaData cameraParams;
+        cameraParams.setInt32("opt_width",        config.width);
+        cameraParams.setInt32("opt_height",       config.height);
+        cameraParams.setInt32("opt_vir_width",    config.virWidth);
+        cameraParams.setInt32("opt_vir_height",   config.virHeight);
+        cameraParams.setInt32("node_buff_size",   config.bufSize);
+        cameraParams.setInt32("opt_quantization", config.quant);
+        if (mUVCGraph->updateCameraParams(&cameraParams) != RT_OK) {
+            LOG_ERROR("updateCameraParams(%dx%d) failed\n", config.width, config.height);
+            return -1;
+        }
+        LOG_INFO("updateCameraParams(%dx%d) ok\n", config.width, config.height);
+    }
+    mUVCController->onCameraConfigured();
+    return 0;
+}
+
+int32_t AISceneDirector::postCommand(const std::string &key, AICommandFunc func, int64_t delayMs) {
+    AICommandToken token = mCommandQueue->post(key, func, delayMs);
+    // a refused command is answered before post() returns
+    if (token.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+        return token.get();
+    }
+    return 0;
+}
+
+// on the command queue with mOpMutex held, a later disable pushes it back
+void AISceneDirector::scheduleSubgraphRelease() {
+    int32_t idleMs = mUVCGraph->getSubgraphIdleMs();
+    if (idleMs <= 0) {
+        return;
+    }
+    postCommand("subgraph_idle", [this]() {
+        std::lock_guard<std::mutex> lock(mOpMutex);
+        if (nullptr == mUVCGraph) {
+            return -1;
+        }
+        mUVCGraph->releaseIdleSubgraphs();
+        return 0;
+    }, idleMs);
+}
+
+// reposts itself every governor period until the graph goes away
+void AISceneDirector::scheduleNNGovernor() {
+    postCommand("nn_governor", [this]() {
+        std::lock_guard<std::mutex> lock(mOpMutex);
+        if (!mGovernNNRate || nullptr == mUVCGraph) {
+            return 0;
+        }
+        mUVCGraph->governNNRate();
+        AINNRateInfo rate;
+        if (mUVCGraph->getNNRate(&rate) == RT_OK) {
+            std::lock_guard<std::mutex> rateLock(mRateMutex);
+            mNNRate = rate;
+            mHasNNRate = true;
+        }
+        scheduleNNGovernor();
+        return 0;
+    }, mUVCGraph->getNNGovernorPeriodMs());
+}
+
 int32_t AISceneDirector::ctrlSubGraph(const char* nnName, int32_t enable) {
     return 0;
 }
 
+int32_t AISceneDirector::getUVCStats(std::map<std::string, int64_t> *stats) {
+    if (mUVCController == nullptr || stats == nullptr) {
+        return -1;
+    }
+    mUVCController->getStats(stats);
+
+    AICommandStats cmdStats;
+    mCommandQueue->getStats(&cmdStats);
+    (*stats)["cmd_posted"]      = cmdStats.posted;
+    (*stats)["cmd_coalesced"]   = cmdStats.coalesced;
+    (*stats)["cmd_executed"]    = cmdStats.executed;
+    (*stats)["cmd_pending"]     = cmdStats.pending;
+    (*stats)["cmd_max_exec_us"] = cmdStats.maxExecUs;
+
+    {
+        std::lock_guard<std::mutex> lock(mRateMutex);
+        if (mHasNNRate) {
+            (*stats)["nn_fps_min"]      = mNNRate.minFps;
+            (*stats)["nn_fps_max"]      = mNNRate.maxFps;
+            (*stats)["nn_fps_target"]   = mNNRate.targetFps;
+            (*stats)["nn_fps_out"]      = mNNRate.outputFps;
+            (*stats)["nn_npu_cost_us"]  = mNNRate.npuCostUs;
+            (*stats)["nn_cpu_load"]     = mNNRate.cpuLoad;
+            (*stats)["nn_motion"]       = mNNRate.motion;
+        }
+    }
+    (*stats)["face_gallery_count"] = mFaceGallery->count();
+    if (mAITaskManager != nullptr) {
+        mAITaskManager->getStats(stats);
+    }
+    return 0;
+}
+
+int32_t AISceneDirector::enrollFace(const std::string &id, const std::vector<uint8_t> &feature) {
+    LOG_INFO("enroll face %s, feature %zu bytes\n", id.c_str(), feature.size());
+    return mFaceGallery->enroll(id, feature.data(), feature.size());
+}
+
+int32_t AISceneDirector::removeFace(const std::string &id) {
+    LOG_INFO("remove face %s\n", id.c_str());
+    return mFaceGallery->remove(id);
+}
+
+int32_t AISceneDirector::searchFace(const std::vector<uint8_t> &feature, int32_t topK,
+                                    std::vector<AIFaceMatch> *matches) {
+    return mFaceGallery->search(feature.data(), feature.size(), topK, -1.0f, matches);
+}
+
 } // namespace aiserver
 } // namespace rockchip
@@ -5,7 +5,11 @@
 #ifndef _RK_AI_SCENE_DIRECTOR_H_
 #define _RK_AI_SCENE_DIRECTOR_H_
 
+#include <atomic>
+
 #include "dbus_graph_control.h"
+#include "ai_command_queue.h"
+#include "ai_face_gallery.h"
 #include "ai_feature_retriver.h"
 #include "ai_task_manager.h"
 #include "shmc/shm_control_uvc.h"
@@ -20,10 +24,20 @@ typedef enum _RockxTaskMode {
     ROCKX_TASK_MODE_MAX,
 } RockxTaskMode;
 
+typedef struct _AICameraConfig {
+    int32_t width;
+    int32_t height;
+    int32_t virWidth;
+    int32_t virHeight;
+    int32_t bufSize;
+    int32_t quant;
+} AICameraConfig;
+
 /*
  * 1. run task graph for generic ai scene.
  * 2. output NN vision result to SHMC(ipc)
  * 3. provide a minimalist interface to aiserver
+ * 4. run graph controls on a command queue, callers never wait for them
  */
 class AISceneDirector : public RTGraphListener {
  public:
@@ -56,11 +70,26 @@ class AISceneDirector : public RTGraphListener {
 
     virtual int32_t invoke(const std::string &appName, const std::string &actionName, void *params);
     virtual int32_t ctrlSubGraph(const char* nnName, int32_t enable);
+    virtual int32_t getUVCStats(std::map<std::string, int64_t> *stats);
+
+    virtual int32_t enrollFace(const std::string &id, const std::vector<uint8_t> &feature);
+    virtual int32_t removeFace(const std::string &id);
+    virtual int32_t searchFace(const std::vector<uint8_t> &feature, int32_t topK,
+                               std::vector<AIFaceMatch> *matches);
 
  private:
     int32_t invokeFeature(const std::string &actionName, void *params);
     int32_t invokeUVC(const std::string &actionName, void *params);
 
+    // run on the command queue
+    int32_t doStart(const std::string &appName);
+    int32_t doStop(const std::string &appName);
+    int32_t doUpdateCamera(const AICameraConfig &config);
+    // -1 if the queue refused the command, else 0, the command result is logged
+    int32_t postCommand(const std::string &key, AICommandFunc func, int64_t delayMs = 0);
+    void    scheduleSubgraphRelease();
+    void    scheduleNNGovernor();
+
     RT_RET  nn_data_output_callback(RTMediaBuffer *buffer);
     RT_RET  ai_matting_output_callback(RTMediaBuffer *buffer);
     RT_RET  uvc_data_output_callback(RTMediaBuffer *buffer);
@@ -73,6 +102,13 @@ class AISceneDirector : public RTGraphListener {
     std::mutex   mOpMutex;
     AIUVCGraph  *mUVCGraph;
     AIFeatureRetriver *mAIFeatureRetriver;
+    AIFaceGallery *mFaceGallery;
+    AICommandQueue *mCommandQueue;
+    std::atomic<bool> mGovernNNRate{false};
+    // taken by the governor, the stats query never waits on mOpMutex
+    std::mutex   mRateMutex;
+    AINNRateInfo mNNRate;
+    bool         mHasNNRate           = false;
     int32_t      mUVCGraphRef         = 0;
     int32_t      mEnableUVC           = 0;
     int32_t      mEnableNN            = 0;
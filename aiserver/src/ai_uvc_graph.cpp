@@ -29,8 +29,13 @@
 #define DEBUG_FLAG              0x0
 
 #include <math.h>
+#include <algorithm>
+#include <fstream>
 #include <thread>
+#include <time.h>
 #include <sys/prctl.h>
+#include <sys/stat.h>
+#include <nlohmann/json.hpp>
 
 #include "ai_uvc_graph.h"
 #include "RTTaskGraph.h"
@@ -74,6 +79,8 @@
 #define RT_FEATURE_NN_MASK          0x000000f0
 #define RT_FEATURE_AIMATTING_MASK   0x00000f00
 #define RT_FEATURE_FACEAE_MASK      0x0000f000
+// branches that can stay linked while off, their nodes are told to idle
+#define RT_FEATURE_PARKABLE_MASK    (RT_FEATURE_NN_MASK | RT_FEATURE_FACEAE_MASK)
 
 #define RT_FEATURE_UVC              0x00000001
 #define RT_FEATURE_EPTZ             0x00000002
@@ -92,6 +99,29 @@
 #define ST_ASTERIA_HEIGHT           720
 #define ISP_BYPASS_WIDTH            2560
 #define ISP_BYPASS_HEIGHT           1440
+// bypass sizes tried from small to large, as a fraction of the max size
+#define ISP_BYPASS_LEVELS           4
+// a smaller size is only taken once the crop fits it with this much spare,
+// so a zoom wobbling around a level boundary does not resize on every step
+#define ISP_BYPASS_HYSTERESIS       0.85f
+// 0 always captures the max bypass size
+#define ISP_BYPASS_ADAPTIVE_ENV     "AI_ISP_BYPASS_ADAPTIVE"
+
+// nn rate governor, 0 in AI_NN_GOVERNOR leaves the nn nodes unthrottled
+#define NN_GOVERNOR_ENV             "AI_NN_GOVERNOR"
+#define NN_FPS_MIN_ENV              "AI_NN_FPS_MIN"
+#define NN_FPS_MAX_ENV              "AI_NN_FPS_MAX"
+#define NN_FPS_MIN_DEFAULT          2
+#define NN_FPS_MAX_DEFAULT          30
+#define NN_GOVERNOR_PERIOD_MS       1000
+#define NN_FPS_STEP_UP              5     // per period, stepping down is immediate
+#define NN_NPU_BUDGET_PERCENT       60    // share of npu time the nn branch may take
+#define NN_CPU_HIGH_PERCENT         85
+#define NN_CPU_CRITICAL_PERCENT     95
+#define NN_MOTION_HIGH              40    // permille of frame width per nn frame
+// filled in by the nn nodes on their output buffers
+#define NN_META_COST_US             "nn_cost_us"
+#define NN_META_MOTION              "nn_motion"
 
 #define RT_EPTZ_MANUAL_MAX          3
 #define RT_EPTZ_PAN_MAX             10.0
@@ -106,6 +136,32 @@
 #define ST_ASTERIA_SCENE_PIC        "scene_pic"
 #define ST_ASTERIA_SCENE_EPTZ       "scene_eptz"
 
+// 0 rebuilds the uvc graph on every camera change instead of resizing in place
+#define UVC_INPLACE_RESIZE_ENV      "AI_UVC_INPLACE_RESIZE"
+// keep one graph built ahead of the next request, 0 disables it
+#define UVC_GRAPH_STANDBY_ENV       "AI_UVC_GRAPH_STANDBY"
+// nn models are dropped after this long disabled, 0 keeps them
+#define SUBGRAPH_IDLE_ENV           "AI_SUBGRAPH_IDLE_MS"
+#define SUBGRAPH_IDLE_DEFAULT_MS    30000
+// only the rockx nodes take load_resource/release_resource. with sensetime
+// the nn nodes are st_asteria nodes and matting is a sensetime node, they
+// ignore both and keep their models for the life of the graph
+#if defined(HAVE_ROCKX) && !defined(HAVE_STASTERIA)
+#define SUBGRAPH_RELEASE_SUPPORTED  1
+#else
+#define SUBGRAPH_RELEASE_SUPPORTED  0
+#endif
+
+// what a standby graph was built and configured from
+typedef struct __AI_UVC_GRAPH_KEY {
+    INT64       mConfigMtime;
+    INT64       mConfigSize;
+    INT32       mWidth;
+    INT32       mHeight;
+    INT32       mFeature;
+    INT32       mBypassWidth;
+} AIUVCGraphKey;
+
 typedef struct __AI_UVC_GRAPH_CTX {
     float       mZoom;
     INT32       mWidth;
@@ -123,6 +179,38 @@ typedef struct __AI_UVC_GRAPH_CTX {
     INT32        mDetection;
     AI_UVC_EPTZ_MODE  mEptzMode;
     INT32         mEptzVal[RT_EPTZ_MANUAL_MAX];
+    INT64         mLastSwitchUs;  // last camera resolution switch time
+    INT64         mMaxSwitchUs;
+    // node_buff_size the uvc pools were prepared with, in place resizes stay within them
+    RT_BOOL       mInPlaceResize;
+    INT32         mPreparedScaleSize;
+    INT32         mPreparedRgaSize;
+    INT32         mLinkedFeature;  // feature the links were selected for, -1 unknown
+    INT32         mParkedFeature;  // linked but off, written under mRateMutex too
+    // built and configured, not prepared, swapped in by the next setup.
+    // at most one, only touched on the graph thread
+    RTTaskGraph  *mStandbyGraph;
+    AIUVCGraphKey mStandbyKey;
+    RT_BOOL       mStandbyEnabled;
+    // models of the rockx nn branch, loaded on enable
+    RT_BOOL       mNNLoaded;
+    INT64         mNNIdleSinceUs;
+    INT32         mSubgraphIdleMs;  // 0 never releases
+    // isp bypass capture size, picked from the uvc size and the zoom
+    INT32         mBypassMaxWidth;
+    INT32         mBypassMaxHeight;
+    INT32         mBypassWidth;
+    INT32         mBypassHeight;
+    RT_BOOL       mBypassAdaptive;
+    // nn rate governor, samples are taken on the nn output thread
+    RtMutex      *mRateMutex;
+    RT_BOOL       mRateEnabled;
+    AINNRateInfo  mRate;
+    INT32         mAppliedFps;  // last rate sent to the nn nodes, 0 none
+    INT32         mNNOutputs;   // since mRateSinceUs
+    INT64         mRateSinceUs;
+    INT64         mCpuBusy;     // last /proc/stat sample
+    INT64         mCpuTotal;
 } AIUVCGraphCtx;
 
 static INT32 gCameraWidth  = 1280;
@@ -132,6 +220,38 @@ AIUVCGraphCtx* getUVCGraphCtx(void* ctx) {
     return reinterpret_cast<AIUVCGraphCtx *>(ctx);
 }
 
+// pool sizes setCameraParams gives isp scale0 and the eptz rga
+static INT32 getScaleBuffSize(AIUVCGraphCtx *ctx) {
+    if (ctx->mWidth > RT_FORCE_USE_RGA_MIN_WIDTH) {
+        return RT_ALIGN(ctx->mWidth, 16) * RT_ALIGN(ctx->mHeight, 16) * 3 / 2;
+    }
+    return RT_ALIGN(ctx->mBypassMaxWidth, 16) * RT_ALIGN(ctx->mBypassMaxHeight, 16) * 3 / 2;
+}
+
+static INT32 getRgaBuffSize(AIUVCGraphCtx *ctx) {
+    return RT_ALIGN(ctx->mVirWidth, 16) * RT_ALIGN(ctx->mVirHeight, 16) * 3 / 2;
+}
+
+// config identity and camera state a graph built now is configured for
+static void getGraphKey(AIUVCGraphCtx *ctx, AIUVCGraphKey *key) {
+    struct stat config;
+    rt_memset(key, 0, sizeof(*key));
+    if (stat(UVC_GRAPH_CONFIG_FILE, &config) == 0) {
+        key->mConfigMtime = (INT64)config.st_mtime;
+        key->mConfigSize  = (INT64)config.st_size;
+    }
+    key->mWidth       = ctx->mWidth;
+    key->mHeight      = ctx->mHeight;
+    key->mFeature     = ctx->mFeature;
+    key->mBypassWidth = ctx->mBypassWidth;
+}
+
+static INT64 getNowUs() {
+    struct timespec now = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
 AIUVCGraph::AIUVCGraph(const char* tagName)
         : mCtx(RT_NULL) {
     AIUVCGraphCtx* ctx = rt_malloc(AIUVCGraphCtx);
@@ -145,6 +265,77 @@ AIUVCGraph::AIUVCGraph(const char* tagName)
     ctx->mRequest = RT_FALSE;
     ctx->mDetection = 0;
     ctx->mFeature = 0;
+    ctx->mLastSwitchUs = 0;
+    ctx->mMaxSwitchUs = 0;
+    ctx->mPreparedScaleSize = 0;
+    ctx->mPreparedRgaSize = 0;
+    ctx->mInPlaceResize = RT_TRUE;
+    char *inPlaceEnv = getenv(UVC_INPLACE_RESIZE_ENV);
+    if (inPlaceEnv && strlen(inPlaceEnv) > 0) {
+        ctx->mInPlaceResize = atoi(inPlaceEnv) ? RT_TRUE : RT_FALSE;
+    }
+    ctx->mLinkedFeature = -1;
+    ctx->mParkedFeature = 0;
+    ctx->mStandbyGraph = RT_NULL;
+    rt_memset(&ctx->mStandbyKey, 0, sizeof(ctx->mStandbyKey));
+    ctx->mStandbyEnabled = RT_TRUE;
+    char *standbyEnv = getenv(UVC_GRAPH_STANDBY_ENV);
+    if (standbyEnv && strlen(standbyEnv) > 0) {
+        ctx->mStandbyEnabled = atoi(standbyEnv) ? RT_TRUE : RT_FALSE;
+    }
+    ctx->mNNLoaded = RT_FALSE;
+    ctx->mNNIdleSinceUs = 0;
+    ctx->mSubgraphIdleMs = SUBGRAPH_RELEASE_SUPPORTED ? SUBGRAPH_IDLE_DEFAULT_MS : 0;
+    char *idleEnv = getenv(SUBGRAPH_IDLE_ENV);
+    if (SUBGRAPH_RELEASE_SUPPORTED && idleEnv && strlen(idleEnv) > 0) {
+        ctx->mSubgraphIdleMs = atoi(idleEnv);
+    }
+    ctx->mBypassMaxWidth = ISP_BYPASS_WIDTH;
+    ctx->mBypassMaxHeight = ISP_BYPASS_HEIGHT;
+    char* enableBypassWidth = getenv("CAMERA_MAX_WIDTH");
+    char* enableBypassHeight = getenv("CAMERA_MAX_HEIGHT");
+    if (enableBypassWidth && strlen(enableBypassWidth) > 0) {
+        RT_LOGD_IF(DEBUG_FLAG, "bypass width %s setting", enableBypassWidth);
+        ctx->mBypassMaxWidth = atoi(enableBypassWidth);
+    } else {
+        RT_LOGE("Cannot get max width from getenv, use default(%d)", ctx->mBypassMaxWidth);
+    }
+    if (enableBypassHeight && strlen(enableBypassHeight) > 0) {
+        RT_LOGD_IF(DEBUG_FLAG, "bypass height %s setting", enableBypassHeight);
+        ctx->mBypassMaxHeight = atoi(enableBypassHeight);
+    } else {
+        RT_LOGE("Cannot get max height from getenv, use default(%d)", ctx->mBypassMaxHeight);
+    }
+    ctx->mBypassWidth = ctx->mBypassMaxWidth;
+    ctx->mBypassHeight = ctx->mBypassMaxHeight;
+    ctx->mBypassAdaptive = RT_TRUE;
+    char *adaptiveEnv = getenv(ISP_BYPASS_ADAPTIVE_ENV);
+    if (adaptiveEnv && strlen(adaptiveEnv) > 0) {
+        ctx->mBypassAdaptive = atoi(adaptiveEnv) ? RT_TRUE : RT_FALSE;
+    }
+    rt_memset(&ctx->mRate, 0, sizeof(ctx->mRate));
+    ctx->mRate.minFps = NN_FPS_MIN_DEFAULT;
+    ctx->mRate.maxFps = NN_FPS_MAX_DEFAULT;
+    char *minFpsEnv = getenv(NN_FPS_MIN_ENV);
+    if (minFpsEnv && strlen(minFpsEnv) > 0) {
+        ctx->mRate.minFps = atoi(minFpsEnv);
+    }
+    char *maxFpsEnv = getenv(NN_FPS_MAX_ENV);
+    if (maxFpsEnv && strlen(maxFpsEnv) > 0) {
+        ctx->mRate.maxFps = atoi(maxFpsEnv);
+    }
+    ctx->mRate.targetFps = ctx->mRate.maxFps;
+    ctx->mRateEnabled = RT_TRUE;
+    char *governorEnv = getenv(NN_GOVERNOR_ENV);
+    if (governorEnv && strlen(governorEnv) > 0) {
+        ctx->mRateEnabled = atoi(governorEnv) ? RT_TRUE : RT_FALSE;
+    }
+    ctx->mAppliedFps = 0;
+    ctx->mNNOutputs = 0;
+    ctx->mRateSinceUs = getNowUs();
+    ctx->mCpuBusy = 0;
+    ctx->mCpuTotal = 0;
+    ctx->mRateMutex = new RtMutex();
     ctx->mStateMutex = new RtMutex();
     ctx->mStateCondition = new RtCondition();
     mMattingCallback = nullptr;
@@ -153,6 +344,7 @@ AIUVCGraph::AIUVCGraph(const char* tagName)
     rt_memset(ctx->mEptzVal, 0, sizeof(ctx->mEptzVal));
 
     mCtx = reinterpret_cast<void *>(ctx);
+    buildLinkTable();
     initialize();
 }
 
@@ -188,6 +380,7 @@ RT_RET AIUVCGraph::deinitialize() {
 
     rt_safe_delete(ctx->mStateMutex);
     rt_safe_delete(ctx->mStateCondition);
+    rt_safe_delete(ctx->mRateMutex);
     rt_safe_free(ctx);
     return RT_OK;
 }
@@ -252,6 +445,7 @@ void* AIUVCGraph::threadLoop(void* arg) {
         ctx->mTaskGraph->release();
         rt_safe_delete(ctx->mTaskGraph);
     }
+    uvcGraph->releaseStandbyGraph();
 
     return NULL;
 }
@@ -262,16 +456,48 @@ RT_RET AIUVCGraph::setupGraphAndWaitDone() {
     std::vector<std::string> linkModes;
     AIUVCGraphCtx * ctx = getUVCGraphCtx(mCtx);
 
+    RT_BOOL fromStandby = RT_FALSE;
+    RT_BOOL paramsReady = RT_FALSE;
+    AIUVCGraphKey key;
+    INT64 startUs = getNowUs();
+
     RT_ASSERT(ctx->mTaskGraph == RT_NULL);
-    ctx->mTaskGraph = new RTTaskGraph("uvc");
-    ret = ctx->mTaskGraph->autoBuild(UVC_GRAPH_CONFIG_FILE);
-    CHECK_EQ(ret, RT_OK);
-    ret = setCameraParams();
-    CHECK_EQ(ret, RT_OK);
+    getGraphKey(ctx, &key);
+    if (ctx->mStandbyGraph != RT_NULL
+            && (ctx->mStandbyKey.mConfigMtime != key.mConfigMtime
+                || ctx->mStandbyKey.mConfigSize != key.mConfigSize)) {
+        RT_LOGD("%s changed, drop the standby graph", UVC_GRAPH_CONFIG_FILE);
+        releaseStandbyGraph();
+    }
+    if (ctx->mStandbyGraph != RT_NULL) {
+        // params only need to be pushed again if the camera changed since
+        ctx->mTaskGraph = ctx->mStandbyGraph;
+        ctx->mStandbyGraph = RT_NULL;
+        paramsReady = (ctx->mStandbyKey.mWidth == key.mWidth
+                        && ctx->mStandbyKey.mHeight == key.mHeight
+                        && ctx->mStandbyKey.mFeature == key.mFeature
+                        && ctx->mStandbyKey.mBypassWidth == key.mBypassWidth);
+        fromStandby = RT_TRUE;
+    } else {
+        ctx->mTaskGraph = new RTTaskGraph("uvc");
+        ret = ctx->mTaskGraph->autoBuild(UVC_GRAPH_CONFIG_FILE);
+        CHECK_EQ(ret, RT_OK);
+    }
+    if (!paramsReady) {
+        ret = setCameraParams();
+        CHECK_EQ(ret, RT_OK);
+    }
     ret = ctx->mTaskGraph->invoke(GRAPH_CMD_PREPARE, RT_NULL);
     CHECK_EQ(ret, RT_OK);
+    ctx->mPreparedScaleSize = getScaleBuffSize(ctx);
+    ctx->mPreparedRgaSize = getRgaBuffSize(ctx);
     ret = ctx->mTaskGraph->invoke(GRAPH_CMD_START, RT_NULL);
     CHECK_EQ(ret, RT_OK);
+    ctx->mLinkedFeature = -1;
+    ctx->mParkedFeature = 0;
+    // fresh nodes, models load on the first enable or frame
+    ctx->mNNLoaded = RT_FALSE;
+    ctx->mAppliedFps = 0;
 
     if (mUVCCallback != nullptr) {
         ctx->mTaskGraph->observeOutputStream("link output",
@@ -281,7 +507,7 @@ RT_RET AIUVCGraph::setupGraphAndWaitDone() {
     if (mNNCallback != nullptr) {
         ctx->mTaskGraph->observeOutputStream("nn link output",
                                              NN_LINK_OUTPUT_NODE_ID << 16,
-                                             mNNCallback);
+                                             std::bind(&AIUVCGraph::onNNOutput, this, std::placeholders::_1));
     }
     if (mMattingCallback != nullptr) {
         ctx->mTaskGraph->observeOutputStream("matting link output",
@@ -289,12 +515,16 @@ RT_RET AIUVCGraph::setupGraphAndWaitDone() {
                                              mMattingCallback);
     }
     updateAIAlgorithm();
+    RT_LOGE("uvc graph %dx%d feature 0x%x ready in %lld ms(%s%s)",
+            ctx->mWidth, ctx->mHeight, ctx->mFeature, (getNowUs() - startUs) / 1000,
+            fromStandby ? "standby" : "cold", paramsReady ? ", cached params" : "");
     ctx->mStateMutex->unlock();
     {
         RtMutex::RtAutolock autoLock(ctx->mStateMutex);
         ctx->mStateCondition->broadcast();
     }
 
+    buildStandbyGraph();
     ctx->mTaskGraph->waitUntilDone();
     return RT_OK;
 __FAILED:
@@ -312,6 +542,11 @@ RT_RET AIUVCGraph::openUVC() {
         return ret;
     }
 
+    // uvc is not linked yet, nothing streams while the size changes
+    ret = updateBypassSize();
+    if (ret != RT_OK) {
+        return ret;
+    }
     ctx->mFeature &= ~RT_FEATURE_UVC_MASK;
     if (ctx->mHeight <= RT_FORCE_USE_RGA_MIN_HEIGHT) {
         ctx->mFeature |= RT_FEATURE_UVC_ZOOM;
@@ -339,58 +574,206 @@ RT_RET AIUVCGraph::closeUVC() {
     return ret;
 }
 
+/*
+ * link modes for one feature mask, in the order they are selected. this is
+ * the table selectLinkMode works from, computed once for every mask.
+ */
+static void getLinkModes(INT32 feature, std::vector<std::string> *modes) {
+    INT32 uvcMask = feature & RT_FEATURE_UVC_MASK;
+    switch (uvcMask) {
+      case 0:
+        break;
+      case RT_FEATURE_UVC:
+        modes->push_back("uvc");
+        break;
+      case RT_FEATURE_EPTZ:
+        modes->push_back("eptz");
+        break;
+      case RT_FEATURE_UVC_BYPASS:
+        modes->push_back("uvc_bypass");
+        break;
+      case RT_FEATURE_UVC_ZOOM:
+        modes->push_back("uvc_zoom");
+        break;
+      case RT_FEATURE_FACE_LINE:
+        modes->push_back("face_line");
+        break;
+      default:
+        RT_LOGE("unsupport uvc mask 0x%x", uvcMask);
+        break;
+    }
+
+    if ((feature & RT_FEATURE_NN_MASK) != 0) {
+        modes->push_back((uvcMask == 0 || uvcMask == RT_FEATURE_UVC) ? "nn_isp" : "nn_linkout");
+    }
+    if ((feature & RT_FEATURE_AIMATTING_MASK) != 0) {
+        modes->push_back("aimatting");
+    }
+    if ((feature & RT_FEATURE_FACEAE_MASK) != 0) {
+        modes->push_back("uvc_faceae");
+    }
+}
+
+/*
+ * "link_ship" is a list of node chains, "1,3,6,7-6,10" links 1->3->6->7
+ * and 6->10. modes missing from the config keep no edges and are always
+ * applied with a full relink.
+ */
+void AIUVCGraph::buildLinkTable() {
+    static const INT32 uvcMasks[] = { 0, RT_FEATURE_UVC, RT_FEATURE_EPTZ, RT_FEATURE_UVC_BYPASS,
+                                      RT_FEATURE_UVC_ZOOM, RT_FEATURE_FACE_LINE };
+    for (INT32 i = 0; i < sizeof(uvcMasks) / sizeof(uvcMasks[0]); i++) {
+        for (INT32 extra = 0; extra < 8; extra++) {
+            INT32 feature = uvcMasks[i];
+            feature |= (extra & 0x1) ? RT_FEATURE_NN : 0;
+            feature |= (extra & 0x2) ? RT_FEATURE_AIMATTING : 0;
+            feature |= (extra & 0x4) ? RT_FEATURE_FACEAE : 0;
+            getLinkModes(feature, &mLinkTable[feature]);
+        }
+    }
+
+    std::ifstream file(UVC_GRAPH_CONFIG_FILE);
+    if (!file.is_open()) {
+        RT_LOGE("no %s, link modes always relink", UVC_GRAPH_CONFIG_FILE);
+        return;
+    }
+    nlohmann::json config = nlohmann::json::parse(file, nullptr, false);
+    if (config.is_discarded() || !config.is_object()) {
+        RT_LOGE("failed to parse %s", UVC_GRAPH_CONFIG_FILE);
+        return;
+    }
+    for (auto &pipe : config.items()) {
+        if (!pipe.value().is_object()) {
+            continue;
+        }
+        for (auto &item : pipe.value().items()) {
+            const nlohmann::json &link = item.value();
+            if (item.key().compare(0, 5, "link_") != 0 || !link.is_object()
+                    || link.count("link_name") == 0 || !link["link_name"].is_string()
+                    || link.count("link_ship") == 0 || !link["link_ship"].is_string()) {
+                continue;
+            }
+            AIUVCLinkEdges &edges = mLinkEdges[link["link_name"].get<std::string>()];
+            std::string ship = link["link_ship"].get<std::string>();
+            size_t chainStart = 0;
+            while (chainStart <= ship.size()) {
+                size_t chainEnd = ship.find('-', chainStart);
+                if (chainEnd == std::string::npos) {
+                    chainEnd = ship.size();
+                }
+                std::string chain = ship.substr(chainStart, chainEnd - chainStart);
+                INT32 prev = -1;
+                size_t pos = 0;
+                while (pos < chain.size()) {
+                    size_t next = chain.find(',', pos);
+                    if (next == std::string::npos) {
+                        next = chain.size();
+                    }
+                    INT32 node = atoi(chain.substr(pos, next - pos).c_str());
+                    if (prev >= 0) {
+                        edges.insert(std::make_pair(prev, node));
+                    }
+                    prev = node;
+                    pos = next + 1;
+                }
+                chainStart = chainEnd + 1;
+            }
+        }
+    }
+}
+
+/*
+ * rockit only adds links per mode or clears all of them. a transition that
+ * keeps every linked mode and adds modes whose edges are known and disjoint
+ * from what is linked is applied in place, the running chains are not
+ * touched. nn and face ae turned off while the uvc mode stays are parked:
+ * they stay linked with their nodes idle, and turning them on again is
+ * free. anything else that drops a mode needs clearLinkShips and a relink,
+ * there is no call to unlink one mode. that is eptz, face line and zoom,
+ * which swap the uvc mode, and matting; a relink also drops what is parked.
+ */
 RT_RET AIUVCGraph::selectLinkMode() {
     RT_RET ret = RT_OK;
     AIUVCGraphCtx * ctx = getUVCGraphCtx(mCtx);
     RT_ASSERT(ctx->mTaskGraph != RT_NULL);
-    ctx->mTaskGraph->clearLinkShips();
+    INT32 feature = ctx->mFeature & (RT_FEATURE_UVC_MASK | RT_FEATURE_NN_MASK
+                                     | RT_FEATURE_AIMATTING_MASK | RT_FEATURE_FACEAE_MASK);
     RT_LOGD("ctx->mFeature = 0x%x &uvc= 0x%x,faceae=0x%x", ctx->mFeature, ctx->mFeature & RT_FEATURE_UVC_MASK
                                                                        ,(ctx->mFeature & RT_FEATURE_FACEAE_MASK));
-    if ((ctx->mFeature & RT_FEATURE_UVC_MASK) == 0) {
-        ctx->mTaskGraph->selectLinkMode((ctx->mFeature & RT_FEATURE_NN_MASK) != 0
-                                            ? "nn_isp" : "none",
-                                         (ctx->mFeature & RT_FEATURE_AIMATTING_MASK) != 0
-                                            ? "aimatting" : "none",
-                                         (ctx->mFeature & RT_FEATURE_FACEAE_MASK) != 0
-                                            ? "uvc_faceae" : "none");
-    } else {
-        INT32 uvcMask = ctx->mFeature & RT_FEATURE_UVC_MASK;
-        switch (uvcMask) {
-          case RT_FEATURE_UVC:
-            ctx->mTaskGraph->selectLinkMode("uvc");
-            break;
-          case RT_FEATURE_EPTZ:
-            ctx->mTaskGraph->selectLinkMode("eptz");
-            break;
-          case RT_FEATURE_UVC_BYPASS:
-            ctx->mTaskGraph->selectLinkMode("uvc_bypass");
-            break;
-          case RT_FEATURE_UVC_ZOOM:
-            ctx->mTaskGraph->selectLinkMode("uvc_zoom");
-            break;
-          case RT_FEATURE_FACE_LINE:
-            ctx->mTaskGraph->selectLinkMode("face_line");
-            break;
-          default:
-            RT_LOGE("unsupport uvc mask 0x%x", uvcMask);
-            break;
-        }
+    INT32 linkFeature = feature;
+    if (ctx->mLinkedFeature >= 0
+            && (ctx->mLinkedFeature & RT_FEATURE_UVC_MASK) == (feature & RT_FEATURE_UVC_MASK)
+            && (ctx->mLinkedFeature & ~feature & ~RT_FEATURE_PARKABLE_MASK) == 0) {
+        linkFeature |= ctx->mLinkedFeature & RT_FEATURE_PARKABLE_MASK;
+    }
+    {
+        RtMutex::RtAutolock rateLock(ctx->mRateMutex);
+        ctx->mParkedFeature = linkFeature & ~feature;
+    }
+    if (linkFeature == ctx->mLinkedFeature) {
+        return ret;
+    }
 
-        const char* nnlink = "none";
-        if ((ctx->mFeature & RT_FEATURE_NN_MASK) != 0) {
-            if (uvcMask == RT_FEATURE_UVC) {
-                nnlink = "nn_isp";
-            } else {
-                nnlink = "nn_linkout";
+    std::map<INT32, std::vector<std::string>>::iterator it = mLinkTable.find(linkFeature);
+    if (it == mLinkTable.end()) {
+        getLinkModes(linkFeature, &mLinkTable[linkFeature]);
+        it = mLinkTable.find(linkFeature);
+    }
+    const std::vector<std::string> &modes = it->second;
+
+    std::vector<std::string> added;
+    const char *dropped = "";
+    RT_BOOL inPlace = RT_FALSE;
+    if (ctx->mLinkedFeature >= 0) {
+        const std::vector<std::string> &linked = mLinkTable[ctx->mLinkedFeature];
+        AIUVCLinkEdges linkedEdges;
+        inPlace = RT_TRUE;
+        for (const std::string &mode : linked) {
+            if (std::find(modes.begin(), modes.end(), mode) == modes.end()) {
+                dropped = mode.c_str();
+                inPlace = RT_FALSE;
+                break;
+            }
+            const AIUVCLinkEdges &edges = mLinkEdges[mode];
+            linkedEdges.insert(edges.begin(), edges.end());
+        }
+        for (INT32 i = 0; inPlace && i < modes.size(); i++) {
+            if (std::find(linked.begin(), linked.end(), modes[i]) != linked.end()) {
+                continue;
+            }
+            std::map<std::string, AIUVCLinkEdges>::iterator edges = mLinkEdges.find(modes[i]);
+            if (edges == mLinkEdges.end() || edges->second.empty()) {
+                inPlace = RT_FALSE;
+                break;
             }
+            for (const std::pair<INT32, INT32> &edge : edges->second) {
+                if (linkedEdges.count(edge) != 0) {
+                    inPlace = RT_FALSE;
+                    break;
+                }
+            }
+            linkedEdges.insert(edges->second.begin(), edges->second.end());
+            added.push_back(modes[i]);
         }
+    }
 
-        ctx->mTaskGraph->selectLinkMode(nnlink,
-                                         (ctx->mFeature & RT_FEATURE_AIMATTING_MASK) != 0
-                                            ? "aimatting" : "none",
-                                         (ctx->mFeature & RT_FEATURE_FACEAE_MASK) != 0
-                                            ? "uvc_faceae" : "none");
+    if (inPlace) {
+        for (const std::string &mode : added) {
+            ctx->mTaskGraph->selectLinkMode(mode.c_str());
+        }
+    } else {
+        ctx->mTaskGraph->clearLinkShips();
+        if (modes.empty()) {
+            ctx->mTaskGraph->selectLinkMode("none");
+        }
+        for (const std::string &mode : modes) {
+            ctx->mTaskGraph->selectLinkMode(mode.c_str());
+        }
     }
+    RT_LOGD("link feature 0x%x -> 0x%x, %s(%d modes)%s%s, parked 0x%x", ctx->mLinkedFeature, linkFeature,
+            inPlace ? "added" : "relinked", (INT32)(inPlace ? added.size() : modes.size()),
+            dropped[0] != '\0' ? ", drops " : "", dropped, linkFeature & ~feature);
+    ctx->mLinkedFeature = linkFeature;
     return ret;
 }
 
@@ -413,7 +796,7 @@ RT_RET AIUVCGraph::observeNNOutputStream(
     if (mNNCallback != nullptr && ctx->mTaskGraph != RT_NULL) {
         ctx->mTaskGraph->observeOutputStream("nn link output",
                                              NN_LINK_OUTPUT_NODE_ID << 16,
-                                             mNNCallback);
+                                             std::bind(&AIUVCGraph::onNNOutput, this, std::placeholders::_1));
     }
     return RT_OK;
 }
@@ -440,15 +823,24 @@ RT_RET AIUVCGraph::updateCameraParams(RtMetaData *params) {
     params->findInt32("opt_vir_height",   &(ctx->mVirHeight));
     params->findInt32("opt_quantization", &(ctx->mQuant));
     if (gCameraWidth != ctx->mWidth || gCameraHeight != ctx->mHeight) {
+        INT64 startUs = getNowUs();
+        RT_BOOL rebuilt = RT_FALSE;
         {
             RtMutex::RtAutolock autoLock(ctx->mStateMutex);
-            if (ctx->mTaskGraph != RT_NULL) {
-                ctx->mTaskGraph->invoke(GRAPH_CMD_STOP, RT_NULL);
+            pickBypassSize();
+            if (ctx->mTaskGraph == RT_NULL || reconfigureResolution() != RT_OK) {
+                rebuildLocked();
+                rebuilt = RT_TRUE;
             }
-            ctx->mRequest = RT_TRUE;
-            ctx->mStateCondition->broadcast();
-            ctx->mStateCondition->wait(ctx->mStateMutex);
         }
+        ctx->mLastSwitchUs = getNowUs() - startUs;
+        if (ctx->mLastSwitchUs > ctx->mMaxSwitchUs) {
+            ctx->mMaxSwitchUs = ctx->mLastSwitchUs;
+        }
+        RT_LOGE("camera %dx%d -> %dx%d %s in %lld ms(max %lld ms)",
+                gCameraWidth, gCameraHeight, ctx->mWidth, ctx->mHeight,
+                rebuilt ? "rebuilt" : "reconfigured",
+                ctx->mLastSwitchUs / 1000, ctx->mMaxSwitchUs / 1000);
         gCameraWidth = ctx->mWidth;
         gCameraHeight = ctx->mHeight;
     }
@@ -456,27 +848,197 @@ __FAILED:
     return ret;
 }
 
-RT_RET AIUVCGraph::setCameraParams() {
+/*
+ * smallest bypass size whose crop at the current zoom still has as many
+ * pixels as the uvc output. while streaming a larger size is taken at once,
+ * a smaller one only with ISP_BYPASS_HYSTERESIS spare. eptz picks its crop per frame, so
+ * it keeps the max size. returns RT_TRUE if the size changed.
+ */
+RT_BOOL AIUVCGraph::pickBypassSize() {
+    static const INT32 levelNum[ISP_BYPASS_LEVELS] = { 1, 2, 3, 1 };
+    static const INT32 levelDen[ISP_BYPASS_LEVELS] = { 2, 3, 4, 1 };
+    AIUVCGraphCtx * ctx = getUVCGraphCtx(mCtx);
+    INT32 width  = ctx->mBypassMaxWidth;
+    INT32 height = ctx->mBypassMaxHeight;
+
+    if (ctx->mBypassAdaptive
+            && (ctx->mFeature & RT_FEATURE_UVC_MASK) != RT_FEATURE_EPTZ) {
+        float needWidth  = ctx->mWidth * ctx->mZoom;
+        float needHeight = ctx->mHeight * ctx->mZoom;
+        // a stream start picks fresh, nothing is shown at the old size yet
+        RT_BOOL streaming = (ctx->mFeature & RT_FEATURE_UVC_MASK) != 0;
+        for (INT32 i = 0; i < ISP_BYPASS_LEVELS; i++) {
+            INT32 levelWidth  = RT_ALIGN(ctx->mBypassMaxWidth * levelNum[i] / levelDen[i], 16);
+            INT32 levelHeight = RT_ALIGN(ctx->mBypassMaxHeight * levelNum[i] / levelDen[i], 16);
+            if (levelWidth > ctx->mBypassMaxWidth) {
+                levelWidth = ctx->mBypassMaxWidth;
+            }
+            if (levelHeight > ctx->mBypassMaxHeight) {
+                levelHeight = ctx->mBypassMaxHeight;
+            }
+            float fit = (streaming && levelWidth < ctx->mBypassWidth) ? ISP_BYPASS_HYSTERESIS : 1.0f;
+            if (needWidth <= levelWidth * fit && needHeight <= levelHeight * fit) {
+                width  = levelWidth;
+                height = levelHeight;
+                break;
+            }
+        }
+    }
+
+    if (width == ctx->mBypassWidth && height == ctx->mBypassHeight) {
+        return RT_FALSE;
+    }
+    RT_LOGD("isp bypass %dx%d -> %dx%d(uvc %dx%d zoom %.2f)",
+            ctx->mBypassWidth, ctx->mBypassHeight, width, height,
+            ctx->mWidth, ctx->mHeight, ctx->mZoom);
+    ctx->mBypassWidth  = width;
+    ctx->mBypassHeight = height;
+    return RT_TRUE;
+}
+
+/*
+ * runs on the graph thread while the live graph streams. autoBuild is the
+ * slow part and needs no lock, the params are applied under mStateMutex
+ * with whatever the camera is set to now. the graph is not prepared, so it
+ * holds no isp device or buffer pool until it is swapped in.
+ */
+void AIUVCGraph::buildStandbyGraph() {
+    AIUVCGraphCtx * ctx = getUVCGraphCtx(mCtx);
+    if (!ctx->mStandbyEnabled || ctx->mStandbyGraph != RT_NULL) {
+        return;
+    }
+
+    RTTaskGraph *graph = new RTTaskGraph("uvc");
+    if (graph->autoBuild(UVC_GRAPH_CONFIG_FILE) != RT_OK) {
+        RT_LOGE("failed to build standby uvc graph");
+        rt_safe_delete(graph);
+        return;
+    }
+
+    RtMutex::RtAutolock autoLock(ctx->mStateMutex);
+    if (setCameraParams(graph, RT_FALSE) != RT_OK) {
+        graph->release();
+        rt_safe_delete(graph);
+        return;
+    }
+    getGraphKey(ctx, &ctx->mStandbyKey);
+    ctx->mStandbyGraph = graph;
+}
+
+// graph thread only, the standby is never prepared so release() is all it needs
+void AIUVCGraph::releaseStandbyGraph() {
+    AIUVCGraphCtx * ctx = getUVCGraphCtx(mCtx);
+    if (ctx->mStandbyGraph != RT_NULL) {
+        ctx->mStandbyGraph->release();
+        rt_safe_delete(ctx->mStandbyGraph);
+    }
+}
+
+// called with mStateMutex held, returns once the graph thread set up the new graph
+void AIUVCGraph::rebuildLocked() {
+    AIUVCGraphCtx * ctx = getUVCGraphCtx(mCtx);
+    if (ctx->mTaskGraph != RT_NULL) {
+        ctx->mTaskGraph->invoke(GRAPH_CMD_STOP, RT_NULL);
+    }
+    ctx->mRequest = RT_TRUE;
+    ctx->mStateCondition->broadcast();
+    ctx->mStateCondition->wait(ctx->mStateMutex);
+    if (ctx->mTaskGraph == RT_NULL) {
+        RT_LOGE("uvc graph rebuild failed, feature 0x%x", ctx->mFeature);
+        return;
+    }
+    // the new graph comes up unlinked
+    selectLinkMode();
+}
+
+/*
+ * picks the bypass size again at stream start, when eptz takes the max size
+ * and on every zoom change, so zooming in never upscales a small bypass.
+ * in place if the nodes allow it, else rebuilt. called with mStateMutex held.
+ */
+RT_RET AIUVCGraph::updateBypassSize() {
+    AIUVCGraphCtx * ctx = getUVCGraphCtx(mCtx);
+    if (!pickBypassSize() || ctx->mTaskGraph == RT_NULL) {
+        return RT_OK;
+    }
+    if (reconfigureResolution() == RT_OK) {
+        return RT_OK;
+    }
+    rebuildLocked();
+    return (ctx->mTaskGraph != RT_NULL) ? RT_OK : RT_ERR_UNKNOWN;
+}
+
+/*
+ * resize only the uvc side: isp scale0, rga, eptz, face line and zoom.
+ * the uvc links are dropped while the nodes take the new size and picked
+ * again afterwards, nn/matting links and their loaded models stay up.
+ * the nodes keep the pools they were prepared with, so only sizes that fit
+ * them are done here, AI_UVC_INPLACE_RESIZE=0 turns it off. anything
+ * else returns RT_ERR_UNSUPPORT before touching the graph.
+ * called with mStateMutex held, on failure the caller rebuilds the graph.
+ */
+RT_RET AIUVCGraph::reconfigureResolution() {
     RT_RET ret = RT_OK;
     AIUVCGraphCtx * ctx = getUVCGraphCtx(mCtx);
-    RtMetaData params;
-    INT32 bypassWidth = ISP_BYPASS_WIDTH;
-    INT32 bypassHeight = ISP_BYPASS_HEIGHT;
-    char* enableBypassWidth = getenv("CAMERA_MAX_WIDTH");
-    char* enableBypassHeight = getenv("CAMERA_MAX_HEIGHT");
-    if (enableBypassWidth && strlen(enableBypassWidth) > 0) {
-        RT_LOGD_IF(DEBUG_FLAG, "bypass width %s setting", enableBypassWidth);
-        bypassWidth = atoi(enableBypassWidth);
-    } else {
-        RT_LOGE("Cannot get max width from getenv, use default(%d)", bypassWidth);
+    INT32 feature = ctx->mFeature;
+    INT32 uvcMask = feature & RT_FEATURE_UVC_MASK;
+
+    if (!ctx->mInPlaceResize) {
+        return RT_ERR_UNSUPPORT;
     }
-    if (enableBypassHeight && strlen(enableBypassHeight) > 0) {
-        RT_LOGD_IF(DEBUG_FLAG, "bypass height %s setting", enableBypassHeight);
-        bypassHeight = atoi(enableBypassHeight);
-    } else {
-        RT_LOGE("Cannot get max height from getenv, use default(%d)", bypassHeight);
+    if (getScaleBuffSize(ctx) > ctx->mPreparedScaleSize
+            || getRgaBuffSize(ctx) > ctx->mPreparedRgaSize) {
+        RT_LOGD("%dx%d outgrows the prepared pools(%d/%d), rebuild",
+                ctx->mWidth, ctx->mHeight, ctx->mPreparedScaleSize, ctx->mPreparedRgaSize);
+        return RT_ERR_UNSUPPORT;
     }
 
+    if (uvcMask != 0) {
+        ctx->mFeature = feature & ~RT_FEATURE_UVC_MASK;
+        ret = selectLinkMode();
+        CHECK_EQ(ret, RT_OK);
+    }
+
+    ret = setCameraParams(ctx->mTaskGraph, RT_TRUE);
+    CHECK_EQ(ret, RT_OK);
+
+    // small sizes go through rga, same rule as openUVC
+    if (ctx->mZoom == 1.0f
+            && (uvcMask == RT_FEATURE_UVC || uvcMask == RT_FEATURE_UVC_ZOOM)) {
+        uvcMask = (ctx->mHeight <= RT_FORCE_USE_RGA_MIN_HEIGHT)
+                      ? RT_FEATURE_UVC_ZOOM : RT_FEATURE_UVC;
+    }
+    ctx->mFeature = (feature & ~RT_FEATURE_UVC_MASK) | uvcMask;
+    if (uvcMask != 0) {
+        ret = selectLinkMode();
+        CHECK_EQ(ret, RT_OK);
+    }
+    return ret;
+
+__FAILED:
+    ctx->mFeature = feature;
+    RT_LOGE("reconfigure %dx%d failed(%d), fall back to rebuild",
+            ctx->mWidth, ctx->mHeight, ret);
+    return ret;
+}
+
+RT_RET AIUVCGraph::setCameraParams() {
+    AIUVCGraphCtx * ctx = getUVCGraphCtx(mCtx);
+    return setCameraParams(ctx->mTaskGraph, RT_FALSE);
+}
+
+/*
+ * before prepare a node that rejects its params is left with its config
+ * defaults, so only the isp and rga results count. a running node has to
+ * take every one of them, strict checks them all.
+ */
+RT_RET AIUVCGraph::setCameraParams(RTTaskGraph *graph, RT_BOOL strict) {
+    RT_RET ret = RT_OK;
+    AIUVCGraphCtx * ctx = getUVCGraphCtx(mCtx);
+    RtMetaData params;
+    INT32 bypassWidth = ctx->mBypassWidth;
+    INT32 bypassHeight = ctx->mBypassHeight;
+
     // stride align to 16 for all node
     ctx->mVirWidth = RT_ALIGN(ctx->mVirWidth, 16);
     ctx->mVirHeight = RT_ALIGN(ctx->mVirHeight, 16);
@@ -487,11 +1049,11 @@ RT_RET AIUVCGraph::setCameraParams() {
         params.setInt32("opt_height",        ctx->mHeight);
         params.setInt32("opt_vir_width",     ctx->mVirWidth);
         params.setInt32("opt_vir_height",    ctx->mVirHeight);
-        params.setInt32("node_buff_size",    RT_ALIGN(ctx->mWidth, 16) * RT_ALIGN(ctx->mHeight, 16) * 3 / 2);
+        params.setInt32("node_buff_size",    getScaleBuffSize(ctx));
         params.setInt32("opt_quantization",  ctx->mQuant);
         params.setInt32(kKeyTaskNodeId,      ISP_SCALE0_NODE_ID);
         params.setCString(kKeyPipeInvokeCmd, "update-params");
-        ret = ctx->mTaskGraph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
+        ret = graph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
         CHECK_EQ(ret, RT_OK);
     } else {
 #ifdef RK356X
@@ -502,9 +1064,9 @@ RT_RET AIUVCGraph::setCameraParams() {
         params.setInt32("opt_height",         bypassHeight);
         params.setInt32("opt_vir_width",      bypassWidth);
         params.setInt32("opt_vir_height",     bypassHeight);
-        params.setInt32("node_buff_size",     RT_ALIGN(bypassWidth, 16) * RT_ALIGN(bypassHeight, 16) * 3 / 2);
+        params.setInt32("node_buff_size",     getScaleBuffSize(ctx));
         params.setInt32("opt_quantization",   ctx->mQuant);
-        ret = ctx->mTaskGraph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
+        ret = graph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
         CHECK_EQ(ret, RT_OK);
 #endif
     }
@@ -517,16 +1079,17 @@ RT_RET AIUVCGraph::setCameraParams() {
     params.setInt32("opt_height",         bypassHeight);
     params.setInt32("opt_vir_width",      bypassWidth);
     params.setInt32("opt_vir_height",     bypassHeight);
-    params.setInt32("node_buff_size",     RT_ALIGN(bypassWidth, 16) * RT_ALIGN(bypassHeight, 16) * 3 / 2);
+    // sized for the max level, a smaller bypass level never needs a new pool
+    params.setInt32("node_buff_size",     RT_ALIGN(ctx->mBypassMaxWidth, 16) * RT_ALIGN(ctx->mBypassMaxHeight, 16) * 3 / 2);
     params.setInt32("opt_quantization",   ctx->mQuant);
-    ret = ctx->mTaskGraph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
+    ret = graph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
     CHECK_EQ(ret, RT_OK);
 
     params.clear();
-    params.setInt32("node_buff_size",    ctx->mVirWidth * ctx->mVirHeight * 3 / 2);
+    params.setInt32("node_buff_size",    getRgaBuffSize(ctx));
     params.setInt32(kKeyTaskNodeId,      EPTZ_RGA_NODE_ID);
     params.setCString(kKeyPipeInvokeCmd, "update-params");
-    ret = ctx->mTaskGraph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
+    ret = graph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
     CHECK_EQ(ret, RT_OK);
     params.setCString(kKeyPipeInvokeCmd, "set_config");
     params.setInt32("role",              RT_RGA_ROLE_DST);
@@ -536,7 +1099,7 @@ RT_RET AIUVCGraph::setCameraParams() {
     params.setInt32("height",            ctx->mHeight);
     params.setInt32("horizontal stride", ctx->mWidth);
     params.setInt32("vertical stride",   ctx->mHeight);
-    ret = ctx->mTaskGraph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
+    ret = graph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
     CHECK_EQ(ret, RT_OK);
 
     params.clear();
@@ -546,7 +1109,10 @@ RT_RET AIUVCGraph::setCameraParams() {
     params.setInt32("opt_height",        bypassHeight);
     params.setInt32("opt_clip_width",    ctx->mWidth);
     params.setInt32("opt_clip_height",   ctx->mHeight);
-    ret = ctx->mTaskGraph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
+    ret = graph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
+    if (strict) {
+        CHECK_EQ(ret, RT_OK);
+    }
 
     params.clear();
     params.setCString(kKeyPipeInvokeCmd, "update-params");
@@ -555,7 +1121,10 @@ RT_RET AIUVCGraph::setCameraParams() {
     params.setInt32("opt_height",        bypassHeight);
     params.setInt32("opt_clip_width",    ctx->mWidth);
     params.setInt32("opt_clip_height",   ctx->mHeight);
-    ret = ctx->mTaskGraph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
+    ret = graph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
+    if (strict) {
+        CHECK_EQ(ret, RT_OK);
+    }
 
     params.clear();
     params.setCString(kKeyPipeInvokeCmd, "update-params");
@@ -570,7 +1139,10 @@ RT_RET AIUVCGraph::setCameraParams() {
 #endif
     params.setInt32("opt_clip_width",    ctx->mWidth);
     params.setInt32("opt_clip_height",   ctx->mHeight);
-    ret = ctx->mTaskGraph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
+    ret = graph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
+    if (strict) {
+        CHECK_EQ(ret, RT_OK);
+    }
 
     params.clear();
     params.setCString(kKeyPipeInvokeCmd, "set_config");
@@ -582,7 +1154,10 @@ RT_RET AIUVCGraph::setCameraParams() {
     params.setInt32("height",            ctx->mHeight);
     params.setInt32("horizontal stride", ctx->mVirWidth);
     params.setInt32("vertical stride",   ctx->mVirHeight);
-    ret = ctx->mTaskGraph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
+    ret = graph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
+    if (strict) {
+        CHECK_EQ(ret, RT_OK);
+    }
     params.setInt32("role",              RT_RGA_ROLE_DST);
     params.setInt32("x offset",          0);
     params.setInt32("y offset",          0);
@@ -590,7 +1165,7 @@ RT_RET AIUVCGraph::setCameraParams() {
     params.setInt32("height",            ST_ASTERIA_HEIGHT);
     params.setInt32("horizontal stride", ST_ASTERIA_WIDTH);
     params.setInt32("vertical stride",   ST_ASTERIA_HEIGHT);
-    ret = ctx->mTaskGraph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
+    ret = graph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
 
     CHECK_EQ(ret, RT_OK);
 
@@ -663,6 +1238,7 @@ RT_RET AIUVCGraph::openAI() {
 
     ctx->mFeature &= ~RT_FEATURE_NN_MASK;
     ctx->mFeature |= RT_FEATURE_NN;
+    attachSubgraph(RT_FEATURE_NN);
     selectLinkMode();
 
 __FAILED:
@@ -680,6 +1256,9 @@ RT_RET AIUVCGraph::closeAI() {
     }
 
     ctx->mFeature &= ~RT_FEATURE_NN_MASK;
+    ctx->mNNIdleSinceUs = getNowUs();
+    // every detection is off now, the nn nodes skip frames if parked
+    updateAIAlgorithm();
     selectLinkMode();
 
 __FAILED:
@@ -955,6 +1534,23 @@ RT_RET AIUVCGraph::linkBYPASS(RT_BOOL enable) {
     return ret;
 }
 
+/*
+ * the nn branch stays in the graph, only its rockx nodes drop and recreate
+ * the npu handles. a node that gets a frame while released loads again on
+ * its own, load_resource here just moves that off the first frame.
+ */
+static const INT32 sNNSubgraphNodes[] = { ST_NN_NODE0_ID, ST_NN_NODE1_ID, ST_NN_NODE2_ID };
+
+static void invokeSubgraphNodes(RTTaskGraph *graph, const INT32 *nodeIds,
+                                INT32 count, const char *command) {
+    for (INT32 i = 0; i < count; i++) {
+        RtMetaData params;
+        params.setInt32(kKeyTaskNodeId, nodeIds[i]);
+        params.setCString(kKeyPipeInvokeCmd, command);
+        graph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
+    }
+}
+
 RT_RET AIUVCGraph::enableEPTZ(RT_BOOL enableEPTZ) {
     AIUVCGraphCtx * ctx = getUVCGraphCtx(mCtx);
     RtMutex::RtAutolock autoLock(ctx->mStateMutex);
@@ -972,6 +1568,11 @@ RT_RET AIUVCGraph::enableEPTZ(RT_BOOL enableEPTZ) {
         return ret;
     }
     RT_LOGD("zoom %f enable eptz %d isEptz %d", ctx->mZoom, enableEPTZ, isEPTZ);
+    if (enableEPTZ && SUBGRAPH_RELEASE_SUPPORTED) {
+        // rockx loads its models lazily, keep that off the first eptz frame
+        static const INT32 faceNode[] = { ST_ASTERIA_FACE_NODE_ID };
+        invokeSubgraphNodes(ctx->mTaskGraph, faceNode, 1, "load_resource");
+    }
     ctx->mFeature &= ~RT_FEATURE_UVC_MASK;
     if (ctx->mZoom != 1.0f) {
         if (enableEPTZ) {
@@ -991,7 +1592,17 @@ RT_RET AIUVCGraph::enableEPTZ(RT_BOOL enableEPTZ) {
         }
     }
 
-    selectLinkMode();
+    // eptz crops around faces, give it the full bypass size back. turning
+    // it off keeps the size until the stream restarts
+    if (enableEPTZ) {
+        ret = updateBypassSize();
+        if (ret != RT_OK) {
+            return ret;
+        }
+    }
+    if (selectLinkMode() != RT_OK) {
+        rebuildLocked();
+    }
     return ret;
 }
 
@@ -1028,6 +1639,7 @@ RT_RET AIUVCGraph::setZoom(float val) {
 
     if (ctx->mTaskGraph == RT_NULL || (ctx->mFeature & RT_FEATURE_UVC_MASK) == 0) {
         ctx->mZoom = val;
+        pickBypassSize();
         return ret;
     }
     if (ctx->mZoom == val) {
@@ -1058,11 +1670,220 @@ RT_RET AIUVCGraph::setZoom(float val) {
         selectLinkMode();
     }
 
+    // a tighter crop needs more bypass pixels, resize before it upscales
     ctx->mZoom = val;
+    ret = updateBypassSize();
 __FAILED:
     return ret;
 }
 
+RT_RET AIUVCGraph::attachSubgraph(INT32 feature) {
+    AIUVCGraphCtx * ctx = getUVCGraphCtx(mCtx);
+    if (ctx->mTaskGraph == RT_NULL) {
+        return RT_ERR_NULL_PTR;
+    }
+
+    INT64 startUs = getNowUs();
+    if (SUBGRAPH_RELEASE_SUPPORTED && feature == RT_FEATURE_NN && !ctx->mNNLoaded) {
+        invokeSubgraphNodes(ctx->mTaskGraph, sNNSubgraphNodes,
+                            sizeof(sNNSubgraphNodes) / sizeof(sNNSubgraphNodes[0]), "load_resource");
+        ctx->mNNLoaded = RT_TRUE;
+    } else {
+        return RT_OK;
+    }
+    RT_LOGD("subgraph 0x%x attached in %lld ms", feature, (getNowUs() - startUs) / 1000);
+    return RT_OK;
+}
+
+INT32 AIUVCGraph::getSubgraphIdleMs() {
+    AIUVCGraphCtx * ctx = getUVCGraphCtx(mCtx);
+    return ctx->mSubgraphIdleMs;
+}
+
+RT_RET AIUVCGraph::releaseIdleSubgraphs() {
+    AIUVCGraphCtx * ctx = getUVCGraphCtx(mCtx);
+    RtMutex::RtAutolock autoLock(ctx->mStateMutex);
+    if (ctx->mTaskGraph == RT_NULL || ctx->mSubgraphIdleMs <= 0) {
+        return RT_OK;
+    }
+
+    INT64 idleUs = (INT64)ctx->mSubgraphIdleMs * 1000;
+    INT64 nowUs = getNowUs();
+    if (ctx->mNNLoaded && (ctx->mFeature & RT_FEATURE_NN_MASK) == 0
+            && nowUs - ctx->mNNIdleSinceUs >= idleUs) {
+        invokeSubgraphNodes(ctx->mTaskGraph, sNNSubgraphNodes,
+                            sizeof(sNNSubgraphNodes) / sizeof(sNNSubgraphNodes[0]), "release_resource");
+        ctx->mNNLoaded = RT_FALSE;
+        RT_LOGD("nn subgraph released after %lld ms idle", (nowUs - ctx->mNNIdleSinceUs) / 1000);
+    }
+    return RT_OK;
+}
+
+/*
+ * nn consumers and the rate they want for a still and a moving scene.
+ * eptz and face ae only follow slow framing changes, face line and the
+ * dbus nn clients draw every result.
+ */
+typedef struct _AINNConsumer {
+    INT32 mask;
+    INT32 feature;  // 0 matches any bit of mask
+    INT32 stillFps;
+    INT32 movingFps;
+} AINNConsumer;
+
+static const AINNConsumer sNNConsumers[] = {
+    { RT_FEATURE_UVC_MASK,     RT_FEATURE_EPTZ,       5,  10 },
+    { RT_FEATURE_UVC_MASK,     RT_FEATURE_EPTZ_ZOOM,  5,  10 },
+    { RT_FEATURE_UVC_MASK,     RT_FEATURE_FACE_LINE,  10, 20 },
+    { RT_FEATURE_FACEAE_MASK,  0,                     3,  8  },
+    { RT_FEATURE_NN_MASK,      RT_FEATURE_NN,         10, 30 },
+};
+
+static const INT32 sNNRateNodes[] = { ST_ASTERIA_FACE_NODE_ID, ST_NN_NODE0_ID,
+                                      ST_NN_NODE1_ID, ST_NN_NODE2_ID };
+
+// runs on the graph output thread, keep it to a few counters
+RT_RET AIUVCGraph::onNNOutput(RTMediaBuffer *buffer) {
+    AIUVCGraphCtx * ctx = getUVCGraphCtx(mCtx);
+    {
+        RtMutex::RtAutolock autoLock(ctx->mRateMutex);
+        if ((ctx->mParkedFeature & RT_FEATURE_NN_MASK) != 0) {
+            return RT_OK;
+        }
+    }
+    if (buffer != RT_NULL && buffer->getMetaData() != RT_NULL) {
+        INT32 costUs = 0;
+        INT32 motion = 0;
+        RtMutex::RtAutolock autoLock(ctx->mRateMutex);
+        ctx->mNNOutputs++;
+        if (buffer->getMetaData()->findInt32(NN_META_COST_US, &costUs) && costUs > 0) {
+            ctx->mRate.npuCostUs = ctx->mRate.npuCostUs == 0
+                                       ? costUs : (ctx->mRate.npuCostUs * 7 + costUs) / 8;
+        }
+        if (buffer->getMetaData()->findInt32(NN_META_MOTION, &motion)) {
+            ctx->mRate.motion = (ctx->mRate.motion * 3 + motion) / 4;
+        }
+    }
+    if (mNNCallback != nullptr) {
+        return mNNCallback(buffer);
+    }
+    return RT_OK;
+}
+
+// busy percent of all cpus since the last call, -1 if unknown
+INT32 AIUVCGraph::sampleCpuLoad() {
+    AIUVCGraphCtx * ctx = getUVCGraphCtx(mCtx);
+    INT64 user = 0, nice = 0, system = 0, idle = 0, iowait = 0, irq = 0, softirq = 0;
+    FILE *fp = fopen("/proc/stat", "r");
+    if (fp == RT_NULL) {
+        return -1;
+    }
+    INT32 num = fscanf(fp, "cpu %lld %lld %lld %lld %lld %lld %lld",
+                       &user, &nice, &system, &idle, &iowait, &irq, &softirq);
+    fclose(fp);
+    if (num != 7) {
+        return -1;
+    }
+
+    INT64 busy  = user + nice + system + irq + softirq;
+    INT64 total = busy + idle + iowait;
+    INT32 load  = -1;
+    if (ctx->mCpuTotal != 0 && total > ctx->mCpuTotal) {
+        load = (INT32)((busy - ctx->mCpuBusy) * 100 / (total - ctx->mCpuTotal));
+    }
+    ctx->mCpuBusy  = busy;
+    ctx->mCpuTotal = total;
+    return load;
+}
+
+/*
+ * called about every NN_GOVERNOR_PERIOD_MS. the target starts from what
+ * the active consumers want at the current scene motion, is capped by the
+ * npu budget at the measured per frame cost and backs off under cpu
+ * pressure. only a changed target is pushed to the nn nodes.
+ */
+RT_RET AIUVCGraph::governNNRate() {
+    AIUVCGraphCtx * ctx = getUVCGraphCtx(mCtx);
+    RtMutex::RtAutolock autoLock(ctx->mStateMutex);
+    INT32 cpuLoad = sampleCpuLoad();
+    INT32 demandFps = 0;
+    INT32 targetFps = 0;
+    {
+        RtMutex::RtAutolock rateLock(ctx->mRateMutex);
+        INT64 nowUs = getNowUs();
+        if (nowUs > ctx->mRateSinceUs) {
+            ctx->mRate.outputFps = (INT32)((INT64)ctx->mNNOutputs * 1000000 / (nowUs - ctx->mRateSinceUs));
+        }
+        ctx->mNNOutputs = 0;
+        ctx->mRateSinceUs = nowUs;
+        ctx->mRate.cpuLoad = cpuLoad;
+
+        INT32 motion = ctx->mRate.motion < NN_MOTION_HIGH ? ctx->mRate.motion : NN_MOTION_HIGH;
+        for (INT32 i = 0; i < sizeof(sNNConsumers) / sizeof(sNNConsumers[0]); i++) {
+            const AINNConsumer *consumer = &sNNConsumers[i];
+            INT32 bits = ctx->mFeature & consumer->mask;
+            if (consumer->feature != 0 ? bits != consumer->feature : bits == 0) {
+                continue;
+            }
+            INT32 fps = consumer->stillFps
+                        + (consumer->movingFps - consumer->stillFps) * motion / NN_MOTION_HIGH;
+            demandFps = fps > demandFps ? fps : demandFps;
+        }
+
+        targetFps = demandFps;
+        if (ctx->mRate.npuCostUs > 0) {
+            INT32 budgetFps = NN_NPU_BUDGET_PERCENT * 10000 / ctx->mRate.npuCostUs;
+            targetFps = budgetFps < targetFps ? budgetFps : targetFps;
+        }
+        if (cpuLoad >= NN_CPU_CRITICAL_PERCENT) {
+            targetFps = targetFps / 2;
+        } else if (cpuLoad >= NN_CPU_HIGH_PERCENT) {
+            targetFps = targetFps * 3 / 4;
+        }
+        if (!ctx->mRateEnabled) {
+            targetFps = ctx->mRate.maxFps;
+        }
+        targetFps = targetFps < ctx->mRate.minFps ? ctx->mRate.minFps : targetFps;
+        targetFps = targetFps > ctx->mRate.maxFps ? ctx->mRate.maxFps : targetFps;
+        if (ctx->mAppliedFps > 0 && targetFps > ctx->mAppliedFps + NN_FPS_STEP_UP) {
+            targetFps = ctx->mAppliedFps + NN_FPS_STEP_UP;
+        }
+        ctx->mRate.targetFps = targetFps;
+    }
+
+    // nothing reads the nn branch, leave the nodes where they are
+    if (ctx->mTaskGraph == RT_NULL || demandFps == 0 || targetFps == ctx->mAppliedFps) {
+        return RT_OK;
+    }
+
+    for (INT32 i = 0; i < sizeof(sNNRateNodes) / sizeof(sNNRateNodes[0]); i++) {
+        RtMetaData params;
+        params.setInt32(kKeyTaskNodeId, sNNRateNodes[i]);
+        params.setCString(kKeyPipeInvokeCmd, "set_max_fps");
+        params.setInt32("nn_max_fps", targetFps);
+        ctx->mTaskGraph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
+    }
+    RT_LOGD("nn fps %d -> %d(demand %d, npu %d us, cpu %d%%, motion %d)",
+            ctx->mAppliedFps, targetFps, demandFps, ctx->mRate.npuCostUs,
+            cpuLoad, ctx->mRate.motion);
+    ctx->mAppliedFps = targetFps;
+    return RT_OK;
+}
+
+RT_RET AIUVCGraph::getNNRate(AINNRateInfo *info) {
+    AIUVCGraphCtx * ctx = getUVCGraphCtx(mCtx);
+    if (info == RT_NULL) {
+        return RT_ERR_NULL_PTR;
+    }
+    RtMutex::RtAutolock autoLock(ctx->mRateMutex);
+    *info = ctx->mRate;
+    return RT_OK;
+}
+
+INT32 AIUVCGraph::getNNGovernorPeriodMs() {
+    return NN_GOVERNOR_PERIOD_MS;
+}
+
 RT_RET AIUVCGraph::waitUntilDone() {
     AIUVCGraphCtx * ctx = getUVCGraphCtx(mCtx);
     if (ctx->mTaskGraph != RT_NULL) {
@@ -1183,16 +2004,19 @@ RT_RET AIUVCGraph::setFaceAE(int enable) {
         RT_LOGE("link mode(uvc_faceae) unsupport");
         return RT_ERR_UNSUPPORT;
     }
+    // the node stays linked while off, enable tells it to run again
+    params.setInt32(kKeyTaskNodeId, 25);
+    params.setCString(kKeyPipeInvokeCmd, "set_faceae_config");
+    params.setInt32("enable", enable ? 1 : 0);
     if ((enable)){
         ctx->mFeature |= RT_FEATURE_FACEAE_MASK;
+        selectLinkMode();
+        ret = ctx->mTaskGraph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
     } else {
         ctx->mFeature &= ~RT_FEATURE_FACEAE_MASK;
-        params.setInt32(kKeyTaskNodeId, 25);
-        params.setCString(kKeyPipeInvokeCmd, "set_faceae_config");
-        params.setInt32("enable", 0);
         ret = ctx->mTaskGraph->invoke(GRAPH_CMD_TASK_NODE_PRIVATE_CMD, &params);
+        selectLinkMode();
     }
-    selectLinkMode();
 __FAILED:
     return ret;
 }
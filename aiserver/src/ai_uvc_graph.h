@@ -21,6 +21,8 @@
 #ifndef _RK_AI_UVC_GRAPH_H_
 #define _RK_AI_UVC_GRAPH_H_
 
+#include <set>
+
 #include "rt_header.h"
 #include "RTTaskGraph.h"
 
@@ -57,6 +59,16 @@ enum RTRgaRole {
     RT_RGA_ROLE_MAX,
 };
 
+typedef struct _AINNRateInfo {
+    INT32 minFps;
+    INT32 maxFps;
+    INT32 targetFps;
+    INT32 outputFps;  // nn results delivered over the last period
+    INT32 npuCostUs;  // smoothed per frame cost reported by the nn nodes
+    INT32 cpuLoad;    // percent, -1 unknown
+    INT32 motion;     // permille of frame width per nn frame
+} AINNRateInfo;
+
 class AIUVCGraph {
  public:
     explicit AIUVCGraph(const char* tagName);
@@ -87,6 +99,13 @@ class AIUVCGraph {
 
     RT_RET openAIMatting();
     RT_RET closeAIMatting();
+    // drops the rockx nn models once disabled for the idle period, 0 ms means never
+    RT_RET releaseIdleSubgraphs();
+    INT32  getSubgraphIdleMs();
+    // nn input rate, re-evaluated by governNNRate() every period
+    RT_RET governNNRate();
+    INT32  getNNGovernorPeriodMs();
+    RT_RET getNNRate(AINNRateInfo *info);
 
     RT_RET setFaceAE(int enable);
     RT_RET setFaceLine(int enable);
@@ -106,6 +125,17 @@ class AIUVCGraph {
     RT_RET closeAI();
 
     RT_RET setupGraphAndWaitDone();
+    RT_RET reconfigureResolution();
+    RT_RET setCameraParams(RTTaskGraph *graph, RT_BOOL strict);
+    void   rebuildLocked();
+    void   buildStandbyGraph();
+    void   releaseStandbyGraph();
+    void   buildLinkTable();
+    RT_RET attachSubgraph(INT32 feature);
+    RT_BOOL pickBypassSize();
+    RT_RET updateBypassSize();
+    RT_RET onNNOutput(RTMediaBuffer *buffer);
+    INT32  sampleCpuLoad();
     INT32  getDetectionByType(std::string type);
     std::string getAIAlgorithmType(std::string type);
     RT_RET updateAIAlgorithm();
@@ -119,6 +149,12 @@ class AIUVCGraph {
     std::function<RT_RET(RTMediaBuffer *)> mUVCCallback;
     std::function<RT_RET(RTMediaBuffer *)> mMattingCallback;
     std::map<std::string, RT_BOOL>         mVendorDetections;
+
+    typedef std::set<std::pair<INT32, INT32>> AIUVCLinkEdges;
+    // link mode -> node edges, parsed from the graph config
+    std::map<std::string, AIUVCLinkEdges>  mLinkEdges;
+    // feature mask -> link modes
+    std::map<INT32, std::vector<std::string>> mLinkTable;
 };
 
 #endif  // _RK_AI_UVC_GRAPH_H_
@@ -14,6 +14,7 @@
 #include "logger/log.h"
 #include "ai_scene_director.h"
 #include "nn_vision_rockx.h"
+#include "frame_tracer.h"
 
 #define HAVE_SIGNAL_PROC 1
 
@@ -26,6 +27,8 @@ typedef struct _AIServerCtx {
     int  mFlagDBusServer;
     int  mFlagDBusDbServer;
     int  mFlagDBusConn;
+    // trace flags, -1 runs the server
+    int  mFlagTrace;
     // server flags
     bool mQuit;
     std::string mConfigUri;
@@ -99,9 +102,20 @@ int main(int argc, char *argv[]) {
     mAIServerCtx.mFlagDBusServer   = true;
     mAIServerCtx.mFlagDBusDbServer = false;
     mAIServerCtx.mFlagDBusConn     = false;
+    mAIServerCtx.mFlagTrace        = -1;
 
     parse_args(argc, argv);
 
+    // talk to the running instance through the trace segment and leave
+    if (mAIServerCtx.mFlagTrace >= 0) {
+        if (mAIServerCtx.mFlagTrace == 0 || mAIServerCtx.mFlagTrace == 1) {
+            FrameTracer::setMask(mAIServerCtx.mFlagTrace ? FRAME_TRACE_LATENCY : 0);
+        } else if (mAIServerCtx.mFlagTrace == 2) {
+            FrameTracer::setMask(FrameTracer::getMask() | FRAME_TRACE_IPC_LOG);
+        }
+        return FrameTracer::dump(stdout) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
     LOG_INFO("parse_args done!\n");
 
     // __minilog_log_init(argv[0], NULL, false, mAIServerCtx.mFlagMinilogBacktrace,
@@ -145,17 +159,19 @@ static void usage_tip(FILE *fp, int argc, char **argv) {
               "-o | --dbus_conn   0:system,  1:session \n"
               "-d | --dbus_db     0:disable, 1:enable \n"
               "-s | --dbus_server 0:disable, 1:enable \n"
+              "-t | --trace       0:off, 1:latency, 2:add ipc log, 3:keep, then print p50/p99 \n"
               "-h | --help        For help \n"
               "\n",
           argv[0], "V1.1");
 }
 
-static const char short_options[] = "c:odsh";
+static const char short_options[] = "c:odst:h";
 static const struct option long_options[] = {
     {"ai_config",   required_argument, NULL, 'c'},
     {"dbus_conn",   optional_argument, 0,    'o'},
     {"dbus_db",     optional_argument, 0,    'd'},
     {"dbus_server", optional_argument, 0,    's'},
+    {"trace",       required_argument, 0,    't'},
     {"help",        no_argument,       0,    'h'},
     {0, 0, 0, 0}
 };
@@ -179,6 +195,9 @@ static void parse_args(int argc, char **argv) {
         case 's':
           mAIServerCtx.mFlagDBusServer = atoi(argv[optind]);
           break;
+        case 't':
+          mAIServerCtx.mFlagTrace = atoi(optarg);
+          break;
         case 'h':
           usage_tip(stdout, argc, argv);
           exit(EXIT_SUCCESS);
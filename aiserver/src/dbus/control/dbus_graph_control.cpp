@@ -163,5 +163,60 @@ int32_t DBusGraphControl::UpdateAIAlgorithmParams(const std::string &cmdName) {
     return 0;
 }
 
+std::map<std::string, int64_t> DBusGraphControl::GetUVCStats() {
+    std::map<std::string, int64_t> stats;
+    if (NULL != mGraphListener) {
+        mGraphListener->getUVCStats(&stats);
+    }
+
+    return stats;
+}
+
+int32_t DBusGraphControl::EnrollFace(const std::string &id, const std::vector<uint8_t> &feature) {
+    if (NULL != mGraphListener) {
+        return mGraphListener->enrollFace(id, feature);
+    }
+
+    return -1;
+}
+
+int32_t DBusGraphControl::RemoveFace(const std::string &id) {
+    if (NULL != mGraphListener) {
+        return mGraphListener->removeFace(id);
+    }
+
+    return -1;
+}
+
+std::vector< ::DBus::Struct< std::string, double > > DBusGraphControl::SearchFace(
+                    const std::vector<uint8_t> &feature, const int32_t &topK) {
+    std::vector< ::DBus::Struct< std::string, double > > result;
+    std::vector<AIFaceMatch> matches;
+    if (NULL != mGraphListener && mGraphListener->searchFace(feature, topK, &matches) > 0) {
+        for (size_t i = 0; i < matches.size(); i++) {
+            ::DBus::Struct< std::string, double > match;
+            match._1 = matches[i].id;
+            match._2 = matches[i].score;
+            result.push_back(match);
+        }
+    }
+
+    return result;
+}
+
+// 1:1 check, needs no gallery
+double DBusGraphControl::CompareFaces(const std::vector<uint8_t> &feature1,
+                                      const std::vector<uint8_t> &feature2) {
+    int32_t dim = feature1.size() / sizeof(float);
+    if (dim <= 0 || feature1.size() != feature2.size()) {
+        LOG_ERROR("compare faces of %zu and %zu bytes\n", feature1.size(), feature2.size());
+        return 0.0;
+    }
+    std::vector<float> a(dim), b(dim);
+    memcpy(a.data(), feature1.data(), dim * sizeof(float));
+    memcpy(b.data(), feature2.data(), dim * sizeof(float));
+    return faceCosine(a.data(), b.data(), dim);
+}
+
 } // namespace aiserver
 } // namespace rockchip
@@ -11,10 +11,14 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <map>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "dbus_dispatcher.h"
 #include "ai_uvc_graph.h"
+#include "ai_face_gallery.h"
 
 #define RT_APP_UVC                     "app_uvc"
 #define RT_APP_NN                      "app_nn"
@@ -45,6 +49,13 @@ class RTGraphListener {
 
     virtual int32_t invoke(const std::string &appName, const std::string &actionName, void *params) = 0;
     virtual int32_t ctrlSubGraph(const char* nnName, int32_t enable) = 0;
+    virtual int32_t getUVCStats(std::map<std::string, int64_t> *stats) = 0;
+
+    // features are float arrays as the feature extraction sends them
+    virtual int32_t enrollFace(const std::string &id, const std::vector<uint8_t> &feature) = 0;
+    virtual int32_t removeFace(const std::string &id) = 0;
+    virtual int32_t searchFace(const std::vector<uint8_t> &feature, int32_t topK,
+                               std::vector<AIFaceMatch> *matches) = 0;
 };
 
 class DBusGraphControl : public control::graph_adaptor,
@@ -79,6 +90,14 @@ class DBusGraphControl : public control::graph_adaptor,
     // Old API
     int32_t SetRockxStatus(const std::string &nnName);
     int32_t SetNpuCtlStatus(const std::string &cmdName);
+    // Monitor
+    std::map<std::string, int64_t> GetUVCStats();
+    // Face gallery
+    int32_t EnrollFace(const std::string &id, const std::vector<uint8_t> &feature);
+    int32_t RemoveFace(const std::string &id);
+    std::vector< ::DBus::Struct< std::string, double > > SearchFace(
+                        const std::vector<uint8_t> &feature, const int32_t &topK);
+    double  CompareFaces(const std::vector<uint8_t> &feature1, const std::vector<uint8_t> &feature2);
 
 private:
     RTGraphListener* mGraphListener;
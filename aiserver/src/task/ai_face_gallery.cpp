@@ -0,0 +1,390 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FACE_GALLERY_NEON   1
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#define FACE_GALLERY_SSE    1
+#endif
+
+#include "ai_face_gallery.h"
+#include "logger/log.h"
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "AIFaceGallery"
+
+#define FACE_GALLERY_MAGIC          0x4C414746  // "FGAL"
+#define FACE_GALLERY_VERSION        1
+#define FACE_GALLERY_INIT_CAPACITY  1024
+#define FACE_GALLERY_MAX_DIM        4096
+#define FACE_GALLERY_ENTRY_HEAD     64          // id, then the feature
+
+namespace rockchip {
+namespace aiserver {
+
+typedef struct _AIFaceGalleryHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t dim;         // floats per feature, 0 until the first enroll
+    uint32_t stride;      // bytes per entry
+    uint32_t capacity;    // entries the file has room for
+    uint32_t count;       // entries in use, always the first count ones
+    uint8_t  reserved[40];
+} AIFaceGalleryHeader;
+
+float faceDot(const float *a, const float *b, int32_t dim) {
+    int32_t i = 0;
+    float   sum = 0.0f;
+#if FACE_GALLERY_NEON
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    for (; i + 8 <= dim; i += 8) {
+        acc0 = vmlaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vmlaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    acc0 = vaddq_f32(acc0, acc1);
+    float32x2_t half = vadd_f32(vget_low_f32(acc0), vget_high_f32(acc0));
+    sum = vget_lane_f32(vpadd_f32(half, half), 0);
+#elif FACE_GALLERY_SSE
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    for (; i + 8 <= dim; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+    sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+    for (; i < dim; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+float faceCosine(const float *a, const float *b, int32_t dim) {
+    float norm = faceDot(a, a, dim) * faceDot(b, b, dim);
+    if (norm <= 0.0f) {
+        return 0.0f;
+    }
+    return faceDot(a, b, dim) / sqrtf(norm);
+}
+
+uint32_t faceIdHash(const char *id) {
+    uint32_t hash = 2166136261u;
+    for (const uint8_t *c = (const uint8_t *)id; *c != '\0'; c++) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+AIFaceGallery::AIFaceGallery() {
+    mFd = -1;
+    mBase = nullptr;
+    mMapSize = 0;
+    mGeneration = 0;
+}
+
+AIFaceGallery::~AIFaceGallery() {
+    close();
+}
+
+int32_t AIFaceGallery::open(const char *path) {
+    std::lock_guard<std::mutex> lock(mOpMutex);
+    if (mFd >= 0) {
+        return 0;
+    }
+
+    mFd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (mFd < 0) {
+        LOG_ERROR("open face gallery %s failed, errno %d\n", path, errno);
+        return -1;
+    }
+    mPath = path;
+    mGeneration++;
+
+    struct stat st;
+    if (fstat(mFd, &st) < 0 || st.st_size == 0) {
+        // new gallery, the layout is set by the first enroll
+        LOG_INFO("face gallery %s is empty\n", path);
+        return 0;
+    }
+
+    AIFaceGalleryHeader header;
+    if (st.st_size < (off_t)sizeof(header)
+            || pread(mFd, &header, sizeof(header), 0) != sizeof(header)
+            || header.magic != FACE_GALLERY_MAGIC || header.version != FACE_GALLERY_VERSION
+            || header.dim == 0 || header.dim > FACE_GALLERY_MAX_DIM
+            || header.stride < FACE_GALLERY_ENTRY_HEAD + header.dim * sizeof(float)
+            || header.count > header.capacity
+            || st.st_size < (off_t)(sizeof(header) + (size_t)header.capacity * header.stride)) {
+        // never overwrite what may be somebody's enrolled faces
+        LOG_ERROR("face gallery %s is not valid, not used\n", path);
+        ::close(mFd);
+        mFd = -1;
+        return -1;
+    }
+
+    if (mapFile(header.capacity) < 0) {
+        ::close(mFd);
+        mFd = -1;
+        return -1;
+    }
+
+    AIFaceGalleryHeader *mapped = (AIFaceGalleryHeader *)mBase;
+    for (uint32_t slot = 0; slot < mapped->count; slot++) {
+        char *id = (char *)entryAt(slot);
+        id[AI_FACE_GALLERY_ID_LEN - 1] = '\0';
+        mSlots[id] = slot;
+    }
+    LOG_INFO("face gallery %s opened, %u faces of %u floats\n", path, mapped->count, mapped->dim);
+    return 0;
+}
+
+void AIFaceGallery::close() {
+    std::lock_guard<std::mutex> lock(mOpMutex);
+    unmapFile();
+    if (mFd >= 0) {
+        ::close(mFd);
+        mFd = -1;
+    }
+    mSlots.clear();
+    mGeneration++;
+}
+
+int32_t AIFaceGallery::mapFile(uint32_t capacity) {
+    AIFaceGalleryHeader header;
+    if (pread(mFd, &header, sizeof(header), 0) != sizeof(header)) {
+        return -1;
+    }
+
+    size_t size = sizeof(AIFaceGalleryHeader) + (size_t)capacity * header.stride;
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+    if (addr == MAP_FAILED) {
+        LOG_ERROR("mmap face gallery(%zu bytes) failed, errno %d\n", size, errno);
+        return -1;
+    }
+    mBase = (uint8_t *)addr;
+    mMapSize = size;
+    return 0;
+}
+
+void AIFaceGallery::unmapFile() {
+    if (mBase != nullptr) {
+        msync(mBase, mMapSize, MS_ASYNC);
+        munmap(mBase, mMapSize);
+        mBase = nullptr;
+        mMapSize = 0;
+    }
+}
+
+int32_t AIFaceGallery::growTo(uint32_t capacity) {
+    AIFaceGalleryHeader *header = (AIFaceGalleryHeader *)mBase;
+    uint32_t stride = header->stride;
+    uint32_t oldCapacity = header->capacity;
+    unmapFile();
+
+    if (ftruncate(mFd, sizeof(AIFaceGalleryHeader) + (off_t)capacity * stride) < 0) {
+        LOG_ERROR("grow face gallery to %u faces failed, errno %d\n", capacity, errno);
+        mapFile(oldCapacity);
+        return -1;
+    }
+    if (mapFile(capacity) < 0) {
+        return -1;
+    }
+    ((AIFaceGalleryHeader *)mBase)->capacity = capacity;
+    return 0;
+}
+
+uint8_t *AIFaceGallery::entryAt(uint32_t slot) {
+    AIFaceGalleryHeader *header = (AIFaceGalleryHeader *)mBase;
+    return mBase + sizeof(AIFaceGalleryHeader) + (size_t)slot * header->stride;
+}
+
+float *AIFaceGallery::featureAt(uint32_t slot) {
+    return (float *)(entryAt(slot) + FACE_GALLERY_ENTRY_HEAD);
+}
+
+// copies the feature into query at unit length, false if it has none
+static bool normalizeFeature(const void *feature, int32_t dim, std::vector<float> *query) {
+    query->resize(dim);
+    memcpy(query->data(), feature, dim * sizeof(float));
+    float norm = faceDot(query->data(), query->data(), dim);
+    if (!(norm > 0.0f) || !isfinite(norm)) {
+        return false;
+    }
+    float scale = 1.0f / sqrtf(norm);
+    for (int32_t i = 0; i < dim; i++) {
+        (*query)[i] *= scale;
+    }
+    return true;
+}
+
+int32_t AIFaceGallery::enroll(const std::string &id, const void *feature, int32_t featureSize) {
+    std::lock_guard<std::mutex> lock(mOpMutex);
+    int32_t dim = featureSize / sizeof(float);
+    if (mFd < 0 || feature == nullptr || id.empty() || id.length() >= AI_FACE_GALLERY_ID_LEN
+            || dim <= 0 || dim > FACE_GALLERY_MAX_DIM || featureSize % sizeof(float) != 0) {
+        LOG_ERROR("invalid face enroll(id %s, feature %d bytes)\n", id.c_str(), featureSize);
+        return -1;
+    }
+
+    if (mBase == nullptr) {
+        struct stat st;
+        if (fstat(mFd, &st) < 0 || st.st_size != 0) {
+            // mapping lost after a failed grow, keep the file as it is
+            LOG_ERROR("face gallery %s is not mapped\n", mPath.c_str());
+            return -1;
+        }
+        AIFaceGalleryHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic    = FACE_GALLERY_MAGIC;
+        header.version  = FACE_GALLERY_VERSION;
+        header.dim      = dim;
+        header.stride   = (FACE_GALLERY_ENTRY_HEAD + dim * sizeof(float) + 15) & ~15;
+        header.capacity = FACE_GALLERY_INIT_CAPACITY;
+        if (ftruncate(mFd, sizeof(header) + (off_t)header.capacity * header.stride) < 0
+                || pwrite(mFd, &header, sizeof(header), 0) != sizeof(header)
+                || mapFile(header.capacity) < 0) {
+            LOG_ERROR("create face gallery %s failed, errno %d\n", mPath.c_str(), errno);
+            return -1;
+        }
+    }
+
+    AIFaceGalleryHeader *header = (AIFaceGalleryHeader *)mBase;
+    if ((uint32_t)dim != header->dim) {
+        LOG_ERROR("face feature of %d floats, the gallery holds %u\n", dim, header->dim);
+        return -1;
+    }
+    if (!normalizeFeature(feature, dim, &mQuery)) {
+        LOG_ERROR("face %s has an empty feature\n", id.c_str());
+        return -1;
+    }
+
+    uint32_t slot;
+    std::map<std::string, uint32_t>::iterator it = mSlots.find(id);
+    if (it != mSlots.end()) {
+        slot = it->second;
+    } else {
+        if (header->count >= header->capacity) {
+            if (growTo(header->capacity * 2) < 0) {
+                return -1;
+            }
+            header = (AIFaceGalleryHeader *)mBase;
+        }
+        slot = header->count;
+    }
+
+    uint8_t *entry = entryAt(slot);
+    memset(entry, 0, FACE_GALLERY_ENTRY_HEAD);
+    memcpy(entry, id.c_str(), id.length());
+    memcpy(featureAt(slot), mQuery.data(), dim * sizeof(float));
+    // the entry is complete before it is counted
+    if (slot == header->count) {
+        header->count++;
+        mSlots[id] = slot;
+    }
+    mGeneration++;
+    msync(mBase, mMapSize, MS_ASYNC);
+    return 0;
+}
+
+int32_t AIFaceGallery::remove(const std::string &id) {
+    std::lock_guard<std::mutex> lock(mOpMutex);
+    std::map<std::string, uint32_t>::iterator it = mSlots.find(id);
+    if (mBase == nullptr || it == mSlots.end()) {
+        return -1;
+    }
+
+    AIFaceGalleryHeader *header = (AIFaceGalleryHeader *)mBase;
+    uint32_t slot = it->second;
+    uint32_t last = header->count - 1;
+    mSlots.erase(it);
+    if (slot != last) {
+        memcpy(entryAt(slot), entryAt(last), header->stride);
+        mSlots[(const char *)entryAt(slot)] = slot;
+    }
+    header->count--;
+    mGeneration++;
+    msync(mBase, mMapSize, MS_ASYNC);
+    return 0;
+}
+
+int32_t AIFaceGallery::search(const void *feature, int32_t featureSize, int32_t topK,
+                              float minScore, std::vector<AIFaceMatch> *matches) {
+    std::lock_guard<std::mutex> lock(mOpMutex);
+    if (matches == nullptr) {
+        return -1;
+    }
+    matches->clear();
+    if (mBase == nullptr || feature == nullptr) {
+        return 0;
+    }
+
+    AIFaceGalleryHeader *header = (AIFaceGalleryHeader *)mBase;
+    int32_t dim = header->dim;
+    if (featureSize != (int32_t)(dim * sizeof(float)) || !normalizeFeature(feature, dim, &mQuery)) {
+        LOG_ERROR("face search with a feature of %d bytes, the gallery holds %d floats\n",
+                  featureSize, dim);
+        return -1;
+    }
+    topK = topK <= 0 ? 1 : topK;
+    topK = topK > AI_FACE_GALLERY_MAX_TOPK ? AI_FACE_GALLERY_MAX_TOPK : topK;
+
+    // best first, insertion into a short list beats a heap for small k
+    float    scores[AI_FACE_GALLERY_MAX_TOPK];
+    uint32_t slots[AI_FACE_GALLERY_MAX_TOPK];
+    int32_t  found = 0;
+    const float *query = mQuery.data();
+    for (uint32_t slot = 0; slot < header->count; slot++) {
+        float score = faceDot(query, featureAt(slot), dim);
+        if (score < minScore || (found == topK && score <= scores[found - 1])) {
+            continue;
+        }
+        int32_t pos = found < topK ? found++ : found - 1;
+        while (pos > 0 && scores[pos - 1] < score) {
+            scores[pos] = scores[pos - 1];
+            slots[pos]  = slots[pos - 1];
+            pos--;
+        }
+        scores[pos] = score;
+        slots[pos]  = slot;
+    }
+
+    for (int32_t i = 0; i < found; i++) {
+        AIFaceMatch match;
+        match.id = (const char *)entryAt(slots[i]);
+        match.score = scores[i];
+        matches->push_back(match);
+    }
+    return found;
+}
+
+int32_t AIFaceGallery::count() {
+    std::lock_guard<std::mutex> lock(mOpMutex);
+    if (mBase == nullptr) {
+        return 0;
+    }
+    return ((AIFaceGalleryHeader *)mBase)->count;
+}
+
+uint32_t AIFaceGallery::generation() {
+    std::lock_guard<std::mutex> lock(mOpMutex);
+    return mGeneration;
+}
+
+} // namespace aiserver
+} // namespace rockchip
@@ -0,0 +1,82 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef _RK_AI_FACE_GALLERY_H_
+#define _RK_AI_FACE_GALLERY_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define AI_FACE_GALLERY_ID_LEN      48
+#define AI_FACE_GALLERY_MAX_TOPK    32
+
+namespace rockchip {
+namespace aiserver {
+
+typedef struct _AIFaceMatch {
+    std::string id;
+    float       score;    // cosine similarity, -1 ~ 1
+} AIFaceMatch;
+
+// similarity kernels, neon on arm, sse on x86, scalar otherwise
+float faceDot(const float *a, const float *b, int32_t dim);
+float faceCosine(const float *a, const float *b, int32_t dim);
+// 32 bit fnv-1a of the id. the nn result ring has no room for whole ids,
+// its "identity" attr carries this as 8 lower case hex digits
+uint32_t faceIdHash(const char *id);
+
+/*
+ * enrolled face features in a memory mapped file:
+ *   header | entry 0 | entry 1 | ...
+ * every entry is the id followed by the feature normalized to unit length,
+ * so a search is one dot product per entry over memory that is read
+ * straight from the page cache. entries are kept dense, a removed entry
+ * is replaced by the last one. the feature size is fixed by the first
+ * enroll.
+ */
+class AIFaceGallery {
+ public:
+    AIFaceGallery();
+    ~AIFaceGallery();
+
+    int32_t open(const char *path);
+    void    close();
+
+    // feature is featureSize bytes of float, an existing id is replaced
+    int32_t enroll(const std::string &id, const void *feature, int32_t featureSize);
+    int32_t remove(const std::string &id);
+    // best matches first, at most topK of them and none below minScore
+    int32_t search(const void *feature, int32_t featureSize, int32_t topK,
+                   float minScore, std::vector<AIFaceMatch> *matches);
+    int32_t count();
+    // changes with every enroll, remove, open and close
+    uint32_t generation();
+
+ private:
+    int32_t mapFile(uint32_t capacity);
+    void    unmapFile();
+    int32_t growTo(uint32_t capacity);
+    uint8_t *entryAt(uint32_t slot);
+    float  *featureAt(uint32_t slot);
+
+ private:
+    std::mutex  mOpMutex;
+    std::string mPath;
+    int32_t     mFd;
+    uint8_t    *mBase;
+    size_t      mMapSize;
+    // id -> slot, rebuilt from the file on open
+    std::map<std::string, uint32_t> mSlots;
+    std::vector<float> mQuery;
+    uint32_t    mGeneration;
+};
+
+} // namespace aiserver
+} // namespace rockchip
+
+#endif // _RK_AI_FACE_GALLERY_H_
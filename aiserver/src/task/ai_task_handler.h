@@ -6,13 +6,14 @@
 #define _RK_AI_TASK_HANDLER_H_
 
 #include "RTMediaBuffer.h"
+#include "ai_face_gallery.h"
 
 namespace rockchip {
 namespace aiserver {
 
 class AITaskHandler {
  public:
-    AITaskHandler() {}
+    AITaskHandler() : mFaceGallery(nullptr) {}
     virtual ~AITaskHandler() {}
 
     virtual int32_t processAIData(RTMediaBuffer *buffer) = 0;
@@ -20,6 +21,16 @@ class AITaskHandler {
     virtual int32_t processAIFeature(RTMediaBuffer *buffer) = 0;
     virtual int32_t convertDetectType(int32_t detectType) = 0;
 
+    // enrolled faces to match extracted features against, owned by the caller
+    void setFaceGallery(AIFaceGallery *gallery) { mFaceGallery = gallery; }
+    // handler counters merged into the uvc stats
+    virtual void getStats(std::map<std::string, int64_t> *stats) {}
+    // answers feature requests whose images stopped coming back, called
+    // periodically by the feature ingest thread
+    virtual void expireFeatureRequests() {}
+
+ protected:
+    AIFaceGallery *mFaceGallery;
 };
 
 } // namespace aiserver
@@ -35,5 +35,17 @@ int32_t AITaskManager::convertDetectType(int32_t detectType) {
     return mTaskHandler->convertDetectType(detectType);
 }
 
+void AITaskManager::setFaceGallery(AIFaceGallery *gallery) {
+    mTaskHandler->setFaceGallery(gallery);
+}
+
+void AITaskManager::getStats(std::map<std::string, int64_t> *stats) {
+    mTaskHandler->getStats(stats);
+}
+
+void AITaskManager::expireFeatureRequests() {
+    mTaskHandler->expireFeatureRequests();
+}
+
 } // namespace aiserver
 } // namespace rockchip
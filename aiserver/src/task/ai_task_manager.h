@@ -19,6 +19,9 @@ class AITaskManager {
     int32_t processAIMatting(RTMediaBuffer *buffer);
     int32_t processAIFeature(RTMediaBuffer *buffer);
     int32_t convertDetectType(int32_t detectType);
+    void    setFaceGallery(AIFaceGallery *gallery);
+    void    getStats(std::map<std::string, int64_t> *stats);
+    void    expireFeatureRequests();
 
   private:
     AITaskHandler *mTaskHandler;
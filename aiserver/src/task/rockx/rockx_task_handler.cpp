@@ -2,10 +2,13 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <string.h>
+
 #include "rockx_task_handler.h"
 #include "logger/log.h"
 #include "nn_vision_rockx.h"
 #include "RTAIDetectResults.h"
+#include "RTMediaMetaKeys.h"
 
 #ifdef LOG_TAG
 #undef LOG_TAG
@@ -34,7 +37,11 @@ int32_t RockxTaskHandler::processAIData(RTMediaBuffer *buffer) {
 
     void* nnResult = getAIDetectResults(buffer);
     if (nnResult != NULL) {
-        postNNData(nnResult);
+        int64_t pts = 0;
+        if (buffer->getMetaData() != NULL) {
+            buffer->getMetaData()->findInt64(kKeyFramePts, &pts);
+        }
+        postNNData(nnResult, pts);
     }
     buffer->release();
 
@@ -52,14 +59,29 @@ int32_t RockxTaskHandler::processAIFeature(RTMediaBuffer *buffer) {
 }
 
 
-void RockxTaskHandler::postNNData(void *nnResult) {
+void RockxTaskHandler::postNNData(void *nnResult, int64_t pts) {
     std::lock_guard<std::mutex> lock(opMutex);
     auto   detectRes    = (RTRknnAnalysisResults*)(nnResult);
     bool   needUpate    = true;
     const char *nnName  = NULL;
 
-    if (!detectRes || !(detectRes->count) || (detectRes->results == NULL))
+    if (!detectRes)
+        return;
+    // the consumers drop their tracks on an empty record
+    if (!(detectRes->count) || (detectRes->results == NULL)) {
+        mShmNNcontroller->commitEmptyRecord(pts);
+        return;
+    }
+
+    // written straight into the shared ring, readers use it in place
+    NNResultRecord *record = mShmNNcontroller->beginRecord();
+    if (record != nullptr) {
+        fillNNRecord(record, detectRes, pts);
+        mShmNNcontroller->commitRecord();
+    }
+    if (!mShmNNcontroller->protobufEnabled())
         return;
+
     NNData nnData;
     int32_t size = detectRes->count;
     for (int32_t i = 0; i < size; i++) {
@@ -94,12 +116,91 @@ void RockxTaskHandler::postNNData(void *nnResult) {
         if (res >= 0) {
             nnData.set_model_name(nnName);
             nnData.SerializeToString(&sendbuf);
-            nnData.ParseFromString(sendbuf);
             mShmNNcontroller->send(sendbuf);
         }
     }
 }
 
+void RockxTaskHandler::fillNNRecord(NNResultRecord *record, void *nnResult, int64_t pts) {
+    auto detectRes = (RTRknnAnalysisResults*)(nnResult);
+    const char *nnName = "";
+
+    record->pts       = pts;
+    record->modelType = detectRes->results[0].type;
+    record->nnWidth   = detectRes->results[0].img_w;
+    record->nnHeight  = detectRes->results[0].img_h;
+    if (record->nnWidth <= 0 || record->nnHeight <= 0) {
+        record->nnWidth  = 300;
+        record->nnHeight = 300;
+    }
+
+    uint32_t count = 0;
+    for (int32_t i = 0; i < detectRes->count && count < NN_RESULT_MAX_OBJECTS; i++) {
+        RTRknnResult   *result = &detectRes->results[i];
+        NNResultObject *object = &record->objects[count];
+        object->type       = result->type;
+        object->trackId    = -1;
+        object->score      = 0.0f;
+        object->pointCount = 0;
+        object->attrCount  = 0;
+        switch (result->type) {
+          case RT_NN_TYPE_FACE: {
+            auto face = &result->info_face.object;
+            if (face->score < 0.5f)
+                continue;
+            object->trackId = face->id;
+            object->left    = face->box.left;
+            object->top     = face->box.top;
+            object->right   = face->box.right;
+            object->bottom  = face->box.bottom;
+            object->score   = face->score;
+            nnName = ROCKX_MODEL_FACE_DETECT;
+          } break;
+          case RT_NN_TYPE_BODY: {
+            // no box from the model, take the one around the key points
+            auto body = &result->info_body.object;
+            int32_t points = body->count < NN_RESULT_MAX_POINTS ? body->count : NN_RESULT_MAX_POINTS;
+            if (points <= 0)
+                continue;
+            object->left   = object->top    = INT16_MAX;
+            object->right  = object->bottom = 0;
+            for (int32_t j = 0; j < points; j++) {
+                object->points[j].x = body->points[j].x;
+                object->points[j].y = body->points[j].y;
+                object->left   = body->points[j].x < object->left   ? body->points[j].x : object->left;
+                object->top    = body->points[j].y < object->top    ? body->points[j].y : object->top;
+                object->right  = body->points[j].x > object->right  ? body->points[j].x : object->right;
+                object->bottom = body->points[j].y > object->bottom ? body->points[j].y : object->bottom;
+            }
+            object->pointCount = points;
+            nnName = ROCKX_MODEL_POSE_BODY;
+          } break;
+          case RT_NN_TYPE_LANDMARK: {
+            auto landmark = &result->info_landmark.object;
+            int32_t points = landmark->landmarks_count < NN_RESULT_MAX_POINTS
+                                 ? landmark->landmarks_count : NN_RESULT_MAX_POINTS;
+            object->left   = landmark->face_box.left;
+            object->top    = landmark->face_box.top;
+            object->right  = landmark->face_box.right;
+            object->bottom = landmark->face_box.bottom;
+            object->score  = landmark->score;
+            for (int32_t j = 0; j < points; j++) {
+                object->points[j].x = landmark->landmarks[j].x;
+                object->points[j].y = landmark->landmarks[j].y;
+            }
+            object->pointCount = points;
+            nnName = ROCKX_MODEL_FACE_LANDMARK;
+          } break;
+          default:
+            continue;
+        }
+        count++;
+    }
+    record->objectCount = count;
+    strncpy(record->modelName, nnName, NN_RESULT_MODEL_NAME_LEN - 1);
+    record->modelName[NN_RESULT_MODEL_NAME_LEN - 1] = '\0';
+}
+
 void RockxTaskHandler::pushFaceDetectInfo(NNData *nnData, void *bufptr, int32_t size) {
     if (!bufptr || !nnData)
         return;
@@ -26,7 +26,8 @@ class RockxTaskHandler : public AITaskHandler {
     virtual int32_t convertDetectType(int32_t detectType);
 
   private:
-    void    postNNData(void *nnResult);
+    void    postNNData(void *nnResult, int64_t pts);
+    void    fillNNRecord(NNResultRecord *record, void *nnResult, int64_t pts);
     void    pushFaceDetectInfo(NNData *nnData, void *bufptr, int32_t size);
     void    pushPoseBodyInfo(NNData *nnData, void *bufptr, int32_t size);
     void    pushLandMarkInfo(NNData *nnData, void *bufptr, int32_t size);
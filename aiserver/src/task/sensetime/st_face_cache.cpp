@@ -0,0 +1,231 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "st_face_cache.h"
+#include "logger/log.h"
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "MattingFaceCache"
+
+namespace rockchip {
+namespace aiserver {
+
+MattingFaceCache::MattingFaceCache() {
+    mTableMask = 0;
+    mSlab = nullptr;
+    mCropSize = 0;
+    mFeatureSize = 0;
+    mHead = mTail = mFree = -1;
+    mSize = 0;
+    memset(&mStats, 0, sizeof(mStats));
+}
+
+MattingFaceCache::~MattingFaceCache() {
+    if (mSlab != nullptr) {
+        free(mSlab);
+        mSlab = nullptr;
+    }
+}
+
+int32_t MattingFaceCache::init(int32_t capacity, int32_t cropSize, int32_t featureSize) {
+    if (mSlab != nullptr || capacity <= 0 || cropSize <= 0 || featureSize <= 0) {
+        return -1;
+    }
+
+    // slots keep the features 16 byte aligned
+    mCropSize    = (cropSize + 15) & ~15;
+    mFeatureSize = (featureSize + 15) & ~15;
+    size_t slot  = (size_t)mCropSize + mFeatureSize;
+    mSlab = (uint8_t *)malloc(slot * capacity);
+    if (mSlab == nullptr) {
+        LOG_ERROR("no memory for %d matting faces(%zu bytes)\n", capacity, slot * capacity);
+        return -1;
+    }
+
+    mNodes.resize(capacity);
+    for (int32_t i = 0; i < capacity; i++) {
+        MattingFaceHolder *node = &mNodes[i];
+        memset(node, 0, sizeof(MattingFaceHolder));
+        node->faceData     = mSlab + slot * i;
+        node->faceInfo     = &node->info;
+        node->info.feature = mSlab + slot * i + mCropSize;
+        node->lruPrev      = -1;
+        node->lruNext      = i + 1 < capacity ? i + 1 : -1;
+    }
+    mFree = 0;
+
+    // at most half full keeps the probes short
+    uint32_t tableSize = 4;
+    while (tableSize < (uint32_t)capacity * 2) {
+        tableSize <<= 1;
+    }
+    mTable.assign(tableSize, -1);
+    mTableMask = tableSize - 1;
+
+    LOG_INFO("matting face cache of %d faces, crop %d feature %d bytes\n",
+             capacity, mCropSize, mFeatureSize);
+    return 0;
+}
+
+uint32_t MattingFaceCache::home(int32_t faceID) const {
+    return ((uint32_t)faceID * 2654435761u) & mTableMask;
+}
+
+int32_t MattingFaceCache::lookup(int32_t faceID) const {
+    if (mTable.empty()) {
+        return -1;
+    }
+    for (uint32_t pos = home(faceID); mTable[pos] >= 0; pos = (pos + 1) & mTableMask) {
+        if (mNodes[mTable[pos]].faceID == faceID) {
+            return mTable[pos];
+        }
+    }
+    return -1;
+}
+
+void MattingFaceCache::indexAdd(int32_t node) {
+    uint32_t pos = home(mNodes[node].faceID);
+    while (mTable[pos] >= 0) {
+        pos = (pos + 1) & mTableMask;
+    }
+    mTable[pos] = node;
+}
+
+// backward shift, the table never holds tombstones
+void MattingFaceCache::indexRemove(int32_t faceID) {
+    uint32_t pos = home(faceID);
+    while (mTable[pos] >= 0 && mNodes[mTable[pos]].faceID != faceID) {
+        pos = (pos + 1) & mTableMask;
+    }
+    if (mTable[pos] < 0) {
+        return;
+    }
+
+    mTable[pos] = -1;
+    for (uint32_t next = (pos + 1) & mTableMask; mTable[next] >= 0; next = (next + 1) & mTableMask) {
+        uint32_t want = home(mNodes[mTable[next]].faceID);
+        // leave it if its home lies cyclically in (pos, next]
+        bool inPlace = pos < next ? (want > pos && want <= next) : (want > pos || want <= next);
+        if (!inPlace) {
+            mTable[pos] = mTable[next];
+            mTable[next] = -1;
+            pos = next;
+        }
+    }
+}
+
+void MattingFaceCache::lruUnlink(int32_t node) {
+    MattingFaceHolder *holder = &mNodes[node];
+    if (holder->lruPrev >= 0) {
+        mNodes[holder->lruPrev].lruNext = holder->lruNext;
+    } else {
+        mHead = holder->lruNext;
+    }
+    if (holder->lruNext >= 0) {
+        mNodes[holder->lruNext].lruPrev = holder->lruPrev;
+    } else {
+        mTail = holder->lruPrev;
+    }
+    holder->lruPrev = holder->lruNext = -1;
+}
+
+void MattingFaceCache::lruPushFront(int32_t node) {
+    MattingFaceHolder *holder = &mNodes[node];
+    holder->lruPrev = -1;
+    holder->lruNext = mHead;
+    if (mHead >= 0) {
+        mNodes[mHead].lruPrev = node;
+    }
+    mHead = node;
+    if (mTail < 0) {
+        mTail = node;
+    }
+}
+
+MattingFaceHolder *MattingFaceCache::find(int32_t faceID) {
+    int32_t node = lookup(faceID);
+    if (node < 0) {
+        mStats.misses++;
+        return nullptr;
+    }
+    mStats.hits++;
+    if (node != mHead) {
+        lruUnlink(node);
+        lruPushFront(node);
+    }
+    return &mNodes[node];
+}
+
+MattingFaceHolder *MattingFaceCache::insert(const RTKKMattingFaceInfo *faceInfo, const void *imgData) {
+    if (mSlab == nullptr || faceInfo->dataSize > mCropSize || faceInfo->featureLen > mFeatureSize) {
+        mStats.rejected++;
+        LOG_DEBUG("matting face[%d] crop %d feature %d does not fit\n",
+                  faceInfo->faceID, faceInfo->dataSize, faceInfo->featureLen);
+        return nullptr;
+    }
+
+    bool fresh = true;
+    int32_t node = lookup(faceInfo->faceID);
+    if (node >= 0) {
+        lruUnlink(node);
+        fresh = false;
+    } else if (mFree >= 0) {
+        node = mFree;
+        mFree = mNodes[node].lruNext;
+        mNodes[node].faceID = faceInfo->faceID;
+        indexAdd(node);
+        mSize++;
+    } else {
+        node = mTail;
+        LOG_DEBUG("evict matting face[%d] repeat[%d]\n", mNodes[node].faceID, mNodes[node].repeatCnt);
+        lruUnlink(node);
+        indexRemove(mNodes[node].faceID);
+        mNodes[node].faceID = faceInfo->faceID;
+        indexAdd(node);
+        mStats.evictions++;
+    }
+    lruPushFront(node);
+
+    MattingFaceHolder *holder = &mNodes[node];
+    unsigned char *feature = holder->info.feature;
+    holder->info      = *faceInfo;
+    holder->info.feature = feature;
+    holder->dataSize  = faceInfo->dataSize;
+    if (fresh) {
+        holder->picID     = 0;
+        holder->repeatCnt = 0;
+        holder->sended    = 0;
+        holder->recTime   = 0;
+        holder->shotScore = 0.0f;
+        holder->sentScore = 0.0f;
+    }
+    memcpy(holder->faceData, imgData, faceInfo->dataSize);
+    memcpy(feature, faceInfo->feature, faceInfo->featureLen);
+    return holder;
+}
+
+void MattingFaceCache::clear() {
+    int32_t capacity = mNodes.size();
+    for (int32_t i = 0; i < capacity; i++) {
+        mNodes[i].lruPrev = -1;
+        mNodes[i].lruNext = i + 1 < capacity ? i + 1 : -1;
+    }
+    mFree = capacity > 0 ? 0 : -1;
+    mHead = mTail = -1;
+    mSize = 0;
+    mTable.assign(mTable.size(), -1);
+}
+
+void MattingFaceCache::getStats(MattingFaceCacheStats *stats) {
+    *stats = mStats;
+    stats->size = mSize;
+}
+
+} // namespace aiserver
+} // namespace rockchip
@@ -0,0 +1,87 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef _RK_ST_FACE_CACHE_H_
+#define _RK_ST_FACE_CACHE_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "nn_vision_rockx.h"
+
+namespace rockchip {
+namespace aiserver {
+
+typedef struct _MattingFaceHolder {
+    int32_t picID;
+    int32_t faceID;
+    int32_t repeatCnt;
+    int32_t sended;
+    int64_t recTime;
+    int32_t dataSize;
+    float   shotScore;              // quality of the crop held
+    float   sentScore;              // quality of the crop last sent
+    unsigned char *faceData;        // crop, in the cache slab
+    RTKKMattingFaceInfo *faceInfo;  // &info
+    RTKKMattingFaceInfo info;       // feature points into the cache slab
+    int32_t lruPrev;                // node index, -1 at the ends
+    int32_t lruNext;
+} MattingFaceHolder;
+
+typedef struct _MattingFaceCacheStats {
+    int64_t hits;
+    int64_t misses;
+    int64_t evictions;
+    int64_t rejected;     // crop or feature larger than a slab slot
+    int64_t size;
+} MattingFaceCacheStats;
+
+/*
+ * fixed capacity lru of matting faces. nodes, crops and features are all
+ * allocated by init(), every node owns one crop and one feature slot of
+ * the slab, so a crowded scene never reaches the allocator. faces are
+ * found through an open addressing table on the face id.
+ */
+class MattingFaceCache {
+ public:
+    MattingFaceCache();
+    ~MattingFaceCache();
+
+    int32_t init(int32_t capacity, int32_t cropSize, int32_t featureSize);
+    // most recently used on a hit
+    MattingFaceHolder *find(int32_t faceID);
+    // copies the face in, over the least recently used face when full. a
+    // face already held only gets the new crop and feature, its counters
+    // are kept. nullptr if it does not fit a slot
+    MattingFaceHolder *insert(const RTKKMattingFaceInfo *faceInfo, const void *imgData);
+    void    clear();
+    void    getStats(MattingFaceCacheStats *stats);
+
+ private:
+    uint32_t home(int32_t faceID) const;
+    int32_t  lookup(int32_t faceID) const;
+    void     indexAdd(int32_t node);
+    void     indexRemove(int32_t faceID);
+    void     lruUnlink(int32_t node);
+    void     lruPushFront(int32_t node);
+
+ private:
+    std::vector<MattingFaceHolder> mNodes;
+    std::vector<int32_t> mTable;    // node index or -1
+    uint32_t   mTableMask;
+    uint8_t   *mSlab;
+    int32_t    mCropSize;
+    int32_t    mFeatureSize;
+    int32_t    mHead;               // most recently used
+    int32_t    mTail;
+    int32_t    mFree;               // unused nodes, linked by lruNext
+    int32_t    mSize;
+    MattingFaceCacheStats mStats;
+};
+
+} // namespace aiserver
+} // namespace rockchip
+
+#endif // _RK_ST_FACE_CACHE_H_
@@ -2,17 +2,47 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/prctl.h>
 #include <sys/time.h>
 
+#include <algorithm>
+
 #include "st_task_handler.h"
 #include "logger/log.h"
 #include "parse/ai_results_parse.h"
 #include "RTAIDetectResults.h"
 
-#define MAX_KEEP_FACE_COUNT     24
-#define FACE_FIRST_SEND_DELAY   8
-#define FACE_SAME_SEND_DELAY    30
+#define MATTING_FACE_CAPACITY_ENV   "AI_MATTING_FACE_CAPACITY"
+#define MATTING_FACE_CAPACITY       24
+#define MATTING_CROP_MAX_ENV        "AI_MATTING_CROP_MAX"
+#define MATTING_CROP_MAX            (256 * 1024)
+#define MATTING_FEATURE_MAX_ENV     "AI_MATTING_FEATURE_MAX"
+#define MATTING_FEATURE_MAX         (4 * 1024)
+// frames a new track collects crops before its best one is sent
+#define FACE_SHOT_WINDOW_ENV        "AI_FACE_SHOT_WINDOW"
+#define FACE_SHOT_WINDOW            8
+// a crop this good is sent without waiting for the window
+#define FACE_SHOT_GOOD              0.85f
+// resend when the best crop beats the sent one by this ratio, 0 never
+#define FACE_SHOT_REFRESH_ENV       "AI_FACE_SHOT_REFRESH"
+#define FACE_SHOT_REFRESH           0.3f
+#define FACE_SHOT_FULL_SIZE         112
+#define FACE_SHOT_MAX_YAW           60.0f
+#define FACE_SHOT_MAX_PITCH         45.0f
+// serialized ai data of a crowded frame fits without growing
+#define NN_SEND_BUF_RESERVE     (64 * 1024)
+#define FACE_MATCH_SCORE_ENV    "AI_FACE_MATCH_SCORE"
+#define FACE_MATCH_SCORE        0.6f
+// a track is searched again once its feature is less similar than this
+// to the one of its last search
+#define FACE_MATCH_DRIFT_ENV    "AI_FACE_MATCH_DRIFT"
+#define FACE_MATCH_DRIFT        0.9f
+// a batch that got no image for this long is answered with what came back
+#define FEATURE_BATCH_TIMEOUT_US    (30 * 1000000LL)
 
 #ifdef LOG_TAG
 #undef LOG_TAG
@@ -23,16 +53,45 @@
 namespace rockchip {
 namespace aiserver {
 
-static std::map<int32_t, MattingFaceHolder *> mFaceMap;
-
 static int64_t getNowUs() {
     struct timeval tv;
     gettimeofday(&tv, NULL);
     return tv.tv_sec * 1000000.0 + tv.tv_usec;
 }
 
+static int32_t getEnvInt(const char *name, int32_t def) {
+    char *env = getenv(name);
+    if (env && strlen(env) > 0 && atoi(env) > 0) {
+        return atoi(env);
+    }
+    return def;
+}
+
 STTaskHandler::STTaskHandler() {
     mShmNNcontroller = new ShmNNController();
+    mSendBuf.reserve(NN_SEND_BUF_RESERVE);
+    mMatchScore = FACE_MATCH_SCORE;
+    char *matchEnv = getenv(FACE_MATCH_SCORE_ENV);
+    if (matchEnv && strlen(matchEnv) > 0) {
+        mMatchScore = atof(matchEnv);
+    }
+    mMatchDrift = FACE_MATCH_DRIFT;
+    char *driftEnv = getenv(FACE_MATCH_DRIFT_ENV);
+    if (driftEnv && strlen(driftEnv) > 0) {
+        mMatchDrift = atof(driftEnv);
+    }
+    mMatchFrame = 0;
+    mMatchSearches = 0;
+    mMatchReused = 0;
+    mShotWindow = getEnvInt(FACE_SHOT_WINDOW_ENV, FACE_SHOT_WINDOW);
+    mShotRefreshGain = FACE_SHOT_REFRESH;
+    char *refreshEnv = getenv(FACE_SHOT_REFRESH_ENV);
+    if (refreshEnv && strlen(refreshEnv) > 0) {
+        mShotRefreshGain = atof(refreshEnv);
+    }
+    mFaceCache.init(getEnvInt(MATTING_FACE_CAPACITY_ENV, MATTING_FACE_CAPACITY),
+                    getEnvInt(MATTING_CROP_MAX_ENV, MATTING_CROP_MAX),
+                    getEnvInt(MATTING_FEATURE_MAX_ENV, MATTING_FEATURE_MAX));
 }
 
 STTaskHandler::~STTaskHandler() {
@@ -40,15 +99,6 @@ STTaskHandler::~STTaskHandler() {
         delete mShmNNcontroller;
         mShmNNcontroller = nullptr;
     }
-
-    std::lock_guard<std::mutex> lock(mOpMutex);
-    std::map<int32_t, MattingFaceHolder *>::iterator it;
-    for (it = mFaceMap.begin(); it != mFaceMap.end();) {
-        MattingFaceHolder *holder = it->second;
-        it = mFaceMap.erase(it);
-        LOG_INFO("clear matting face[%d]\n", holder->faceID);
-        freeMattingFaceInfo(holder);
-    }
 }
 
 int32_t STTaskHandler::processAIData(RTMediaBuffer *buffer) {
@@ -89,12 +139,14 @@ int32_t STTaskHandler::processAIFeature(RTMediaBuffer *buffer) {
     const char *uuid      = RT_NULL;
     INT32       retryAI   = 0;
     INT32       hasFeature = 0;
+    INT32       batchSize = 1;
 
     extraInfo = buffer->getMetaData();
     if (RT_NULL != extraInfo) {
         if (!extraInfo->findCString("stream_uuid", &uuid)) {
             uuid = "feature_extract";
         }
+        extraInfo->findInt32("batch_size", &batchSize);
 
         nnResult = getAIDetectResults(buffer);
         if (NULL == nnResult) {
@@ -113,7 +165,7 @@ int32_t STTaskHandler::processAIFeature(RTMediaBuffer *buffer) {
         }
         if (hasFeature) {
             extraInfo->setInt32("ai_retry", retryAI);
-            postFeatureData(nnResult, uuid);
+            postFeatureData(nnResult, uuid, batchSize);
         } else {
             if (!extraInfo->findInt32("ai_retry", &retryAI)) {
                 retryAI = 8;
@@ -131,31 +183,256 @@ int32_t STTaskHandler::processAIFeature(RTMediaBuffer *buffer) {
 __FAILED:
     LOG_INFO("aifeature callback(buf=%p,uuid=%s)\n", buffer, uuid);
     if (hasFeature == 0) {
-        postEmptyFeatureData(uuid);
+        postEmptyFeatureData(uuid, batchSize);
     }
     buffer->release();
 
     return 0;
 }
 
+/*
+ * the messages and the send buffer live as long as the handler. Clear()
+ * keeps the sub-messages of repeated fields and the string capacity, so
+ * once a frame as busy as this one was seen it is built and serialized
+ * without touching the heap. strings go through mutable_*()->assign()
+ * for the same reason, set_*() would build a temporary.
+ */
 void STTaskHandler::postNNData(void *nnResult) {
     std::lock_guard<std::mutex> lock(mOpMutex);
-    KKMessage kkMsg;
-    KKAIData *mNNData = kkMsg.mutable_kkaidata();
     auto stRes = (STDetectResult *)(nnResult);
-    if (stRes->faceCount <= 0 && stRes->handCount <= 0 && stRes->bodyCount <= 0) {
-        return;
+    recordFaceShots(stRes);
+    bool empty = stRes->faceCount <= 0 && stRes->handCount <= 0 && stRes->bodyCount <= 0;
+    if (!empty) {
+        matchFaces(stRes, true);
+    }
+
+    // empty frames go to the ring too, the consumers drop their tracks on them
+    NNResultRecord *record = mShmNNcontroller->beginRecord();
+    if (record != nullptr) {
+        fillNNRecord(record, stRes);
+        mShmNNcontroller->commitRecord();
     }
+    if (empty || !mShmNNcontroller->protobufEnabled())
+        return;
+
+    mNNMsg.Clear();
+    KKAIData *mNNData = mNNMsg.mutable_kkaidata();
     pushDetectInfo(mNNData, stRes, 1);
     mNNData->set_width(1280);
     mNNData->set_height(720);
-    mNNData->set_function("KK_AI_DATA");
-    kkMsg.set_msg_type(1);
-    kkMsg.set_msg_name("KK_AI_DATA");
+    mNNData->mutable_function()->assign("KK_AI_DATA");
+    mNNMsg.set_msg_type(1);
+    mNNMsg.mutable_msg_name()->assign("KK_AI_DATA");
+
+    mNNMsg.SerializeToString(&mSendBuf);
+    mShmNNcontroller->send(mSendBuf);
+}
+
+// st hand action bit -> gesture index expected by the consumers
+static const char *getHandActionName(int32_t action) {
+    static const struct {
+        int32_t     action;
+        const char *name;
+    } sHandActions[] = {
+        { 0x00000200, "0"  }, { 0x00000008, "1"  }, { 0x00000001, "2"  },
+        { 0x00001000, "3"  }, { 0x00000080, "4"  }, { 0x00004000, "5"  },
+        { 0x00000100, "6"  }, { 0x00000002, "7"  }, { 0x00000040, "8"  },
+        { 0x00000010, "9"  }, { 0x00000020, "10" }, { 0x00000400, "11" },
+        { 0x00000800, "12" }, { 0x00000004, "13" }, { 0x00002000, "14" },
+    };
+    for (int32_t i = 0; i < sizeof(sHandActions) / sizeof(sHandActions[0]); i++) {
+        if (sHandActions[i].action == action) {
+            return sHandActions[i].name;
+        }
+    }
+    return "999";
+}
+
+static void fillNNObject(NNResultObject *object, int32_t type, int32_t id, float score) {
+    object->type       = type;
+    object->trackId    = id;
+    object->score      = score;
+    object->pointCount = 0;
+    object->attrCount  = 0;
+}
+
+static void fillNNAttr(NNResultObject *object, const char *name, const char *value, float score) {
+    if (object->attrCount >= NN_RESULT_MAX_ATTRS)
+        return;
+    NNResultAttr *attr = &object->attrs[object->attrCount++];
+    strncpy(attr->name, name, NN_RESULT_ATTR_LEN - 1);
+    attr->name[NN_RESULT_ATTR_LEN - 1] = '\0';
+    strncpy(attr->value, value, NN_RESULT_ATTR_LEN - 1);
+    attr->value[NN_RESULT_ATTR_LEN - 1] = '\0';
+    attr->score = score;
+}
+
+// same content as pushDetectInfo() without the features, in the ring layout
+void STTaskHandler::fillNNRecord(NNResultRecord *record, STDetectResult *detectResult) {
+    int32_t i, j;
+    uint32_t count = 0;
+    NNResultObject *object;
+
+    record->pts       = 0;
+    record->modelType = RT_NN_TYPE_FACE;
+    record->nnWidth   = 1280;
+    record->nnHeight  = 720;
+    strncpy(record->modelName, "sensetime", NN_RESULT_MODEL_NAME_LEN - 1);
+    record->modelName[NN_RESULT_MODEL_NAME_LEN - 1] = '\0';
+
+    for (i = 0; i < detectResult->faceCount && count < NN_RESULT_MAX_OBJECTS; i++) {
+        object = &record->objects[count++];
+        fillNNObject(object, RT_NN_TYPE_FACE, detectResult->faces[i].id, detectResult->faces[i].quality);
+        object->left   = detectResult->faces[i].rect.left;
+        object->top    = detectResult->faces[i].rect.top;
+        object->right  = detectResult->faces[i].rect.right;
+        object->bottom = detectResult->faces[i].rect.bottom;
+        for (j = 0; j < detectResult->faces[i].pointCount && j < NN_RESULT_MAX_POINTS; j++) {
+            object->points[j].x = detectResult->faces[i].points[j].x;
+            object->points[j].y = detectResult->faces[i].points[j].y;
+        }
+        object->pointCount = j;
+        for (j = 0; j < detectResult->faces[i].attributeCount; j++) {
+            fillNNAttr(object, detectResult->faces[i].attributes[j].category,
+                       detectResult->faces[i].attributes[j].label,
+                       detectResult->faces[i].attributes[j].score);
+        }
+        // gallery ids do not fit an attr value, the protobuf keeps them whole
+        if (i < (int32_t)mFaceMatches.size() && mFaceMatches[i] != nullptr) {
+            fillNNAttr(object, "identity", mFaceMatches[i]->hash, mFaceMatches[i]->match.score);
+        }
+    }
+
+    for (i = 0; i < detectResult->handCount && count < NN_RESULT_MAX_OBJECTS; i++) {
+        object = &record->objects[count++];
+        fillNNObject(object, RT_NN_TYPE_FINGER, detectResult->hands[i].id, 1.0f);
+        object->left   = detectResult->hands[i].rect.left;
+        object->top    = detectResult->hands[i].rect.top;
+        object->right  = detectResult->hands[i].rect.right;
+        object->bottom = detectResult->hands[i].rect.bottom;
+        for (j = 0; j < detectResult->hands[i].pointCount && j < NN_RESULT_MAX_POINTS; j++) {
+            object->points[j].x = detectResult->hands[i].points[j].x;
+            object->points[j].y = detectResult->hands[i].points[j].y;
+        }
+        object->pointCount = j;
+        fillNNAttr(object, "action", getHandActionName(detectResult->hands[i].action), 1.0f);
+    }
+
+    for (i = 0; i < detectResult->bodyCount && count < NN_RESULT_MAX_OBJECTS; i++) {
+        object = &record->objects[count++];
+        fillNNObject(object, RT_NN_TYPE_BODY, detectResult->bodys[i].id, detectResult->bodys[i].quality);
+        object->left   = detectResult->bodys[i].rect.left;
+        object->top    = detectResult->bodys[i].rect.top;
+        object->right  = detectResult->bodys[i].rect.right;
+        object->bottom = detectResult->bodys[i].rect.bottom;
+        for (j = 0; j < detectResult->bodys[i].pointCount && j < NN_RESULT_MAX_POINTS; j++) {
+            object->points[j].x = detectResult->bodys[i].points[j].x;
+            object->points[j].y = detectResult->bodys[i].points[j].y;
+        }
+        object->pointCount = j;
+    }
+    record->objectCount = count;
+}
+
+/*
+ * search the gallery here so the consumers get an identity, not a feature
+ * to match. a tracked face keeps the match of its track, it is searched
+ * again only when its feature drifts from the one last searched or the
+ * gallery changed. frames without a feature keep the match as it is.
+ */
+void STTaskHandler::matchFaces(STDetectResult *detectResult, bool tracked) {
+    int32_t faceCount = detectResult->faceCount > 0 ? detectResult->faceCount : 0;
+    uint32_t generation = mFaceGallery != nullptr ? mFaceGallery->generation() : 0;
+    mFaceMatches.assign(faceCount, nullptr);
+    if (!tracked && (int32_t)mStillFaces.size() < faceCount) {
+        mStillFaces.resize(faceCount);
+    }
+    mMatchFrame++;
+
+    for (int32_t i = 0; i < faceCount; i++) {
+        const void *feature = detectResult->faces[i].feature;
+        int32_t featureLen  = detectResult->faces[i].featureLen;
+        STFaceTrack *track  = tracked ? &mFaceTracks[detectResult->faces[i].id] : &mStillFaces[i];
+        track->seenFrame = mMatchFrame;
+        if (mFaceGallery == nullptr) {
+            continue;
+        }
+        if (feature != nullptr && featureLen > 0) {
+            int32_t dim = featureLen / sizeof(float);
+            bool search = !tracked || track->generation != generation
+                          || (int32_t)track->feature.size() != dim
+                          || faceCosine(reinterpret_cast<const float *>(feature),
+                                        track->feature.data(), dim) < mMatchDrift;
+            if (search) {
+                searchFace(track, feature, featureLen, generation);
+                mMatchSearches++;
+            } else {
+                mMatchReused++;
+            }
+        } else if (!tracked) {
+            track->match.id.clear();
+        }
+        if (!track->match.id.empty()) {
+            mFaceMatches[i] = track;
+        }
+    }
+
+    if (tracked) {
+        std::map<int32_t, STFaceTrack>::iterator it = mFaceTracks.begin();
+        while (it != mFaceTracks.end()) {
+            if (it->second.seenFrame != mMatchFrame) {
+                it = mFaceTracks.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+}
+
+void STTaskHandler::searchFace(STFaceTrack *track, const void *feature, int32_t featureLen,
+                               uint32_t generation) {
+    const float *values = reinterpret_cast<const float *>(feature);
+    track->feature.assign(values, values + featureLen / sizeof(float));
+    track->generation = generation;
+    if (mFaceGallery->search(feature, featureLen, 1, mMatchScore, &mMatchBest) > 0) {
+        track->match = mMatchBest[0];
+        snprintf(track->hash, sizeof(track->hash), "%08x", faceIdHash(track->match.id.c_str()));
+    } else {
+        track->match.id.clear();
+        track->match.score = 0.0f;
+        track->hash[0] = '\0';
+    }
+}
 
-    std::string sendbuf;
-    kkMsg.SerializeToString(&sendbuf);
-    mShmNNcontroller->send(sendbuf);
+void STTaskHandler::recordFaceShots(STDetectResult *detectResult) {
+    mFaceShots.resize(detectResult->faceCount > 0 ? detectResult->faceCount : 0);
+    for (int32_t i = 0; i < detectResult->faceCount; i++) {
+        STFaceShot *shot = &mFaceShots[i];
+        shot->id      = detectResult->faces[i].id;
+        shot->quality = detectResult->faces[i].quality;
+        shot->yaw     = detectResult->faces[i].yaw;
+        shot->pitch   = detectResult->faces[i].pitch;
+        shot->size    = std::min(detectResult->faces[i].rect.right - detectResult->faces[i].rect.left,
+                                 detectResult->faces[i].rect.bottom - detectResult->faces[i].rect.top);
+    }
+}
+
+// quality x pose x size of the latest detection of the track, 0 ~ 1
+float STTaskHandler::scoreFaceShot(RTKKMattingFaceInfo *faceInfo) {
+    float quality = 0.5f;
+    float pose    = 0.5f;
+    float size    = std::min(faceInfo->width, faceInfo->height);
+    for (size_t i = 0; i < mFaceShots.size(); i++) {
+        if (mFaceShots[i].id != faceInfo->faceID)
+            continue;
+        quality = std::max(0.0f, std::min(1.0f, mFaceShots[i].quality));
+        pose = 1.0f - std::max(fabsf(mFaceShots[i].yaw) / FACE_SHOT_MAX_YAW,
+                               fabsf(mFaceShots[i].pitch) / FACE_SHOT_MAX_PITCH);
+        pose = std::max(0.0f, pose);
+        size = mFaceShots[i].size;
+        break;
+    }
+    return quality * pose * std::max(0.0f, std::min(1.0f, size / FACE_SHOT_FULL_SIZE));
 }
 
 void STTaskHandler::pushDetectInfo(KKAIData *mNNData, STDetectResult *detectResult, int32_t size) {
@@ -196,14 +473,22 @@ void STTaskHandler::pushDetectInfo(KKAIData *mNNData, STDetectResult *detectResu
                 Attr *attributes = facedetect->add_attrs();
 
                 //attributes->set_category(detectResult->faces[i].attributes[j].category);
-                attributes->set_name(detectResult->faces[i].attributes[j].category);
-                attributes->set_value(detectResult->faces[i].attributes[j].label);
+                attributes->mutable_name()->assign(detectResult->faces[i].attributes[j].category);
+                attributes->mutable_value()->assign(detectResult->faces[i].attributes[j].label);
                 attributes->set_score(detectResult->faces[i].attributes[j].score);
             }
 
+            if (i < (int32_t)mFaceMatches.size() && mFaceMatches[i] != nullptr) {
+                Attr *identity = facedetect->add_attrs();
+                identity->mutable_name()->assign("identity");
+                identity->mutable_value()->assign(mFaceMatches[i]->match.id);
+                identity->set_score(mFaceMatches[i]->match.score);
+            }
+
             if(detectResult->faces[i].feature != nullptr) {
                 Feature *feature = facedetect->mutable_feature();
-                feature->set_data((char *)detectResult->faces[i].feature, detectResult->faces[i].featureLen);
+                feature->mutable_data()->assign((char *)detectResult->faces[i].feature,
+                                                detectResult->faces[i].featureLen);
                 feature->set_length(detectResult->faces[i].featureLen);
             }
         }
@@ -233,57 +518,8 @@ void STTaskHandler::pushDetectInfo(KKAIData *mNNData, STDetectResult *detectResu
             }
 
             Attr *attributes = handdetect->add_attrs();
-            attributes->set_name("action");
-            switch(detectResult->hands[i].action) {
-                case 0x00000200:
-                attributes->set_value("0");
-                break;
-                case 0x00000008:
-                attributes->set_value("1");
-                break;
-                case 0x00000001:
-                attributes->set_value("2");
-                break;
-                case 0x00001000:
-                attributes->set_value("3");
-                break;
-                case 0x00000080:
-                attributes->set_value("4");
-                break;
-                case 0x00004000:
-                attributes->set_value("5");
-                break;
-                case 0x00000100:
-                attributes->set_value("6");
-                break;
-                case 0x00000002:
-                attributes->set_value("7");
-                break;
-                case 0x00000040:
-                attributes->set_value("8");
-                break;
-                case 0x00000010:
-                attributes->set_value("9");
-                break;
-                case 0x00000020:
-                attributes->set_value("10");
-                break;
-                case 0x00000400:
-                attributes->set_value("11");
-                break;
-                case 0x00000800:
-                attributes->set_value("12");
-                break;
-                case 0x00000004:
-                attributes->set_value("13");
-                break;
-                case 0x00002000:
-                attributes->set_value("14");
-                break;
-                default:
-                attributes->set_value("999");
-                break;
-            }
+            attributes->mutable_name()->assign("action");
+            attributes->mutable_value()->assign(getHandActionName(detectResult->hands[i].action));
         //handdetect->set_action(detectResult->hands[i].action);
         //handdetect->set_event(detectResult->hands[i].event);
         }
@@ -312,6 +548,11 @@ void STTaskHandler::pushDetectInfo(KKAIData *mNNData, STDetectResult *detectResu
     }
 }
 
+/*
+ * a track collects crops for mShotWindow frames and only the best scored
+ * one is kept, that one is sent once. it is sent again only when a later
+ * crop is clearly better, not every few frames.
+ */
 void STTaskHandler::postAIMattingData(void *mattingBuffer, void *imgData) {
     if (!mattingBuffer || !imgData)
         return;
@@ -325,13 +566,18 @@ void STTaskHandler::postAIMattingData(void *mattingBuffer, void *imgData) {
         if (holder == nullptr)
             continue;
 
-        if ((!holder->sended && holder->repeatCnt > FACE_FIRST_SEND_DELAY) ||
-            (holder->sended && holder->repeatCnt > FACE_SAME_SEND_DELAY)) {
-            LOG_DEBUG("post matting face[%d] repeat[%d]\n", holder->faceID, holder->repeatCnt);
-            holder->sended = 1;
-            holder->repeatCnt = 0;
-            doPostMattingFace(holder);
+        if (!holder->sended) {
+            if (holder->repeatCnt < mShotWindow && holder->shotScore < FACE_SHOT_GOOD)
+                continue;
+        } else if (mShotRefreshGain <= 0.0f
+                || holder->shotScore <= holder->sentScore * (1.0f + mShotRefreshGain)) {
+            continue;
         }
+        LOG_DEBUG("post matting face[%d] score[%.2f] seen[%d]\n",
+                  holder->faceID, holder->shotScore, holder->repeatCnt);
+        holder->sended = 1;
+        holder->sentScore = holder->shotScore;
+        doPostMattingFace(holder);
     }
 }
 
@@ -339,131 +585,150 @@ void STTaskHandler::doPostMattingFace(MattingFaceHolder *holder) {
     RTKKMattingFaceInfo* faceInfo = holder->faceInfo;
     void* imgData = holder->faceData;
 
-    KKMessage kkMsg;
-    ImageClip* imgClip = kkMsg.mutable_imgclip();
-    imgClip->set_data(imgData, faceInfo->dataSize);
+    mClipMsg.Clear();
+    ImageClip* imgClip = mClipMsg.mutable_imgclip();
+    imgClip->mutable_data()->assign((const char *)imgData, faceInfo->dataSize);
     imgClip->set_height(faceInfo->width);
     imgClip->set_width(faceInfo->height);
     imgClip->set_format(faceInfo->format);
     imgClip->set_angle(faceInfo->angle);
     imgClip->set_mirror(faceInfo->mirror);
     imgClip->set_imgid(faceInfo->faceID);
-    kkMsg.set_msg_type(2);
-    kkMsg.set_msg_name("KK_AI_IMAGE_CLIP");
-    std::string sendbuf;
-    kkMsg.SerializeToString(&sendbuf);
-    mShmNNcontroller->send(sendbuf);
+    mClipMsg.set_msg_type(2);
+    mClipMsg.mutable_msg_name()->assign("KK_AI_IMAGE_CLIP");
+    mClipMsg.SerializeToString(&mSendBuf);
+    mShmNNcontroller->send(mSendBuf);
 }
 
-void STTaskHandler::freeMattingFaceInfo(MattingFaceHolder* holder) {
-    if (!holder)
-        return;
+MattingFaceHolder* STTaskHandler::saveMattingFaceInfo(RTKKMattingFaceInfo *faceInfo, void *imgData) {
+    MattingFaceHolder* faceHolder = mFaceCache.find(faceInfo->faceID);
+    if (faceHolder != nullptr) {
+        faceHolder->recTime = getNowUs();
+        faceHolder->repeatCnt += 1;
+    }
 
-    if (holder->faceInfo != nullptr) {
-        if (holder->faceInfo->feature) {
-            free(holder->faceInfo->feature);
-            holder->faceInfo->feature = nullptr;
+    if (faceInfo->featureLen <= 0 || faceInfo->dataSize <= 0) {
+        if (faceHolder == nullptr) {
+            LOG_DEBUG("empty face[%d] feature\n", faceInfo->faceID);
         }
-        free(holder->faceInfo);
-        holder->faceInfo = nullptr;
+        return faceHolder;
     }
 
-    if (holder->faceData != nullptr) {
-        free(holder->faceData);
-        holder->faceData = nullptr;
+    float score = scoreFaceShot(faceInfo);
+    if (faceHolder != nullptr && score <= faceHolder->shotScore) {
+        return faceHolder;
     }
 
-    free(holder);
-}
-
-MattingFaceHolder* STTaskHandler::saveMattingFaceInfo(RTKKMattingFaceInfo *faceInfo, void *imgData) {
-    MattingFaceHolder* faceHolder = nullptr;
-
-    std::map<int32_t, MattingFaceHolder *>::iterator faceIter = mFaceMap.find(faceInfo->faceID);
-    if (faceIter != mFaceMap.end()) {
-        faceHolder = faceIter->second;
+    // a crop that does not fit leaves the one held in place
+    MattingFaceHolder* bestHolder = mFaceCache.insert(faceInfo, imgData);
+    if (bestHolder == nullptr) {
+        return faceHolder;
     }
+    LOG_DEBUG("keep matting face[%d] score[%.2f -> %.2f]\n", faceInfo->faceID,
+              bestHolder->shotScore, score);
+    bestHolder->shotScore = score;
+    bestHolder->recTime = getNowUs();
+
+    return bestHolder;
+}
 
-    if (faceHolder != nullptr && faceInfo->featureLen > 0 && faceInfo->dataSize > 0) {
-        LOG_INFO("remove for update matting face[%d]\n", faceHolder->faceID);
-        mFaceMap.erase(faceHolder->faceID);
-        freeMattingFaceInfo(faceHolder);
-        faceHolder = nullptr;
+void STTaskHandler::getStats(std::map<std::string, int64_t> *stats) {
+    MattingFaceCacheStats cacheStats;
+    {
+        std::lock_guard<std::mutex> lock(mOpMutex);
+        mFaceCache.getStats(&cacheStats);
+        (*stats)["face_match_searches"] = mMatchSearches;
+        (*stats)["face_match_reused"]   = mMatchReused;
     }
+    (*stats)["matting_cache_hits"]      = cacheStats.hits;
+    (*stats)["matting_cache_misses"]    = cacheStats.misses;
+    (*stats)["matting_cache_evictions"] = cacheStats.evictions;
+    (*stats)["matting_cache_rejected"]  = cacheStats.rejected;
+    (*stats)["matting_cache_size"]      = cacheStats.size;
+}
 
-    if (faceHolder == nullptr) {
-        if (faceInfo->featureLen <= 0 || faceInfo->dataSize <= 0) {
-            LOG_DEBUG("empty face[%d] feature\n", faceInfo->faceID);
-            return nullptr;
+void STTaskHandler::postFeatureData(void* nnResult, const char* uuid, int32_t batchSize) {
+    std::lock_guard<std::mutex> lock(mOpMutex);
+    if (batchSize > 1) {
+        // requests overlap in the retriver, images of several batches interleave
+        int64_t nowUs = getNowUs();
+        expireFeatureBatches(nowUs);
+        std::map<std::string, STFeatureBatch>::iterator it = mBatches.find(uuid);
+        if (it == mBatches.end()) {
+            it = mBatches.insert(std::make_pair(std::string(uuid), STFeatureBatch())).first;
+            it->second.size = batchSize;
+            it->second.done = 0;
         }
-
-        // remove oldest face if over max size
-        if (mFaceMap.size() >= MAX_KEEP_FACE_COUNT) {
-            int64_t recTime = getNowUs();
-            MattingFaceHolder *oldHolder = nullptr;
-            std::map<int32_t, MattingFaceHolder *>::iterator it;
-            for (it = mFaceMap.begin(); it != mFaceMap.end();) {
-                MattingFaceHolder *holder = it->second;
-                if (holder->recTime < recTime) {
-                    recTime = holder->recTime;
-                    oldHolder = holder;
-                }
-                it++;
-            }
-
-            if (oldHolder != nullptr) {
-                LOG_DEBUG("remove oldest matting face[%d] repeat[%d]\n", oldHolder->faceID, oldHolder->repeatCnt);
-                mFaceMap.erase(oldHolder->faceID);
-                freeMattingFaceInfo(oldHolder);
-            } else {
-                LOG_ERROR("error record time!!!\n");
-            }
+        STFeatureBatch *batch = &it->second;
+        batch->lastUs = nowUs;
+        auto st_result = (STDetectResult *)(nnResult);
+        matchFaces(st_result, false);
+        pushDetectInfo(batch->msg.mutable_kkaidata(), st_result, 1);
+        if (++batch->done >= batch->size) {
+            sendFeatureBatch(it->first, batch);
+            mBatches.erase(it);
         }
-
-        faceHolder = (MattingFaceHolder *)malloc(sizeof(MattingFaceHolder));
-        memset(faceHolder, 0, sizeof(MattingFaceHolder));
-        faceHolder->recTime = getNowUs();
-        faceHolder->faceID = faceInfo->faceID;
-        faceHolder->dataSize = faceInfo->dataSize;
-        faceHolder->faceData = (unsigned char*)malloc(faceInfo->dataSize);
-        faceHolder->faceInfo = (RTKKMattingFaceInfo *)malloc(sizeof(RTKKMattingFaceInfo));
-        memcpy(faceHolder->faceData, imgData, faceInfo->dataSize);
-        memcpy(faceHolder->faceInfo, faceInfo, sizeof(RTKKMattingFaceInfo));
-        faceHolder->faceInfo->feature = (unsigned char*)malloc(faceInfo->featureLen);
-        memcpy(faceHolder->faceInfo->feature, faceInfo->feature, faceInfo->featureLen);
-        mFaceMap[faceInfo->faceID] = faceHolder;
-        LOG_DEBUG("save matting face[%d] size[%d]\n", faceHolder->faceID, mFaceMap.size());
-    } else {
-        faceHolder->recTime = getNowUs();
-        faceHolder->repeatCnt += 1;
+        return;
     }
 
-    return faceHolder;
-}
-
-void STTaskHandler::postFeatureData(void* nnResult, const char* uuid) {
-    std::lock_guard<std::mutex> lock(mOpMutex);
-    KKMessage kkMsg;
-    KKAIData *mNNData = kkMsg.mutable_kkaidata();
+    mFeatureMsg.Clear();
+    KKAIData *mNNData = mFeatureMsg.mutable_kkaidata();
     auto st_result = (STDetectResult *)(nnResult);
+    matchFaces(st_result, false);
     pushDetectInfo(mNNData, st_result, 1);
     mNNData->set_width(1280);
     mNNData->set_height(720);
     mNNData->set_index(0);
-    mNNData->set_function("ANALYSE");
-    mNNData->set_uuid(uuid);
-    kkMsg.set_msg_type(4);
-    kkMsg.set_msg_name("ANALYSE");
-
-    std::string sendBuf;
-    kkMsg.SerializeToString(&sendBuf);
-    mShmNNcontroller->send(sendBuf);
+    mNNData->mutable_function()->assign("ANALYSE");
+    mNNData->mutable_uuid()->assign(uuid);
+    mFeatureMsg.set_msg_type(4);
+    mFeatureMsg.mutable_msg_name()->assign("ANALYSE");
+
+    mFeatureMsg.SerializeToString(&mSendBuf);
+    mShmNNcontroller->send(mSendBuf);
 }
 
-void STTaskHandler::postEmptyFeatureData(const char* uuid) {
+void STTaskHandler::postEmptyFeatureData(const char* uuid, int32_t batchSize) {
     STDetectResult nnResult;
     memset(&nnResult, 0, sizeof(STDetectResult));
-    postFeatureData(&nnResult, uuid);
+    postFeatureData(&nnResult, uuid, batchSize);
+}
+
+// under mOpMutex
+void STTaskHandler::sendFeatureBatch(const std::string &uuid, STFeatureBatch *batch) {
+    KKAIData *mNNData = batch->msg.mutable_kkaidata();
+    mNNData->set_width(1280);
+    mNNData->set_height(720);
+    mNNData->set_index(0);
+    mNNData->mutable_function()->assign("ANALYSE");
+    mNNData->mutable_uuid()->assign(uuid);
+    batch->msg.set_msg_type(4);
+    batch->msg.mutable_msg_name()->assign("ANALYSE");
+
+    LOG_INFO("feature batch %s done, %d/%d images %d faces\n", uuid.c_str(),
+             batch->done, batch->size, mNNData->facedata_size());
+    batch->msg.SerializeToString(&mSendBuf);
+    mShmNNcontroller->send(mSendBuf);
+}
+
+void STTaskHandler::expireFeatureRequests() {
+    std::lock_guard<std::mutex> lock(mOpMutex);
+    expireFeatureBatches(getNowUs());
+}
+
+// under mOpMutex, a lost image must not keep its batch from being answered
+void STTaskHandler::expireFeatureBatches(int64_t nowUs) {
+    std::map<std::string, STFeatureBatch>::iterator it = mBatches.begin();
+    while (it != mBatches.end()) {
+        if (nowUs - it->second.lastUs < FEATURE_BATCH_TIMEOUT_US) {
+            it++;
+            continue;
+        }
+        LOG_ERROR("feature batch %s left with %d/%d images\n",
+                  it->first.c_str(), it->second.done, it->second.size);
+        sendFeatureBatch(it->first, &it->second);
+        mBatches.erase(it++);
+    }
 }
 
 int32_t STTaskHandler::convertDetectType(int32_t detectType) {
@@ -5,8 +5,11 @@
 #ifndef _RK_ST_TASK_HANDLER_H_
 #define _RK_ST_TASK_HANDLER_H_
 
+#include <map>
 #include <mutex>
 #include <stdint.h>
+#include <string>
+#include <vector>
 
 #include "ai_task_handler.h"
 #include "shm_control_nn.h"
@@ -14,20 +17,37 @@
 #include "nn_vision_rockx.h"
 #include "st_asteria_api.h"
 #include "st_asteria_common.h"
+#include "st_face_cache.h"
 
 namespace rockchip {
 namespace aiserver {
 
+// what the last detection frame tells about a face track
 typedef struct {
-    int32_t picID;
-    int32_t faceID;
-    int32_t repeatCnt;
-    int32_t sended;
-    int64_t recTime;
-    int32_t dataSize;
-    unsigned char *faceData;
-    RTKKMattingFaceInfo *faceInfo;
-} MattingFaceHolder;
+    int32_t id;
+    float   quality;
+    float   yaw;
+    float   pitch;
+    int32_t size;       // short side of the face box
+} STFaceShot;
+
+// gallery match of a face, kept per track so a track is searched again
+// only when its feature drifts or the gallery changes
+typedef struct {
+    AIFaceMatch        match;        // empty id if none
+    char               hash[12];     // "identity" attr of the ring, faceIdHash()
+    std::vector<float> feature;      // the feature of the last search
+    uint32_t           generation;   // of the gallery at the last search
+    uint32_t           seenFrame;
+} STFaceTrack;
+
+// the answer of one feature request, collected until all images are back
+typedef struct {
+    KKMessage msg;
+    int32_t   size;
+    int32_t   done;
+    int64_t   lastUs;     // last image of the batch came back
+} STFeatureBatch;
 
 class STTaskHandler : public AITaskHandler {
  public:
@@ -38,22 +58,52 @@ class STTaskHandler : public AITaskHandler {
     virtual int32_t processAIMatting(RTMediaBuffer *buffer);
     virtual int32_t processAIFeature(RTMediaBuffer *buffer);
     virtual int32_t convertDetectType(int32_t detectType);
+    virtual void    getStats(std::map<std::string, int64_t> *stats);
+    virtual void    expireFeatureRequests();
 
   private:
     void    postNNData(void *nnResult);
     void    pushDetectInfo(KKAIData *mNNData, STDetectResult *detectResult, int32_t size);
+    void    fillNNRecord(NNResultRecord *record, STDetectResult *detectResult);
+    void    matchFaces(STDetectResult *detectResult, bool tracked);
+    void    searchFace(STFaceTrack *track, const void *feature, int32_t featureLen, uint32_t generation);
+    void    recordFaceShots(STDetectResult *detectResult);
+    float   scoreFaceShot(RTKKMattingFaceInfo *faceInfo);
 
     void    postAIMattingData(void *mattingBuffer, void *imgData);
     void    doPostMattingFace(MattingFaceHolder *holder);
-    void    freeMattingFaceInfo(MattingFaceHolder* holder);
     MattingFaceHolder* saveMattingFaceInfo(RTKKMattingFaceInfo *faceInfo, void *imgData);
 
-    void    postFeatureData(void *nnResult, const char *uuid);
-    void    postEmptyFeatureData(const char* uuid);
+    void    postFeatureData(void *nnResult, const char *uuid, int32_t batchSize = 1);
+    void    postEmptyFeatureData(const char* uuid, int32_t batchSize = 1);
+    void    sendFeatureBatch(const std::string &uuid, STFeatureBatch *batch);
+    void    expireFeatureBatches(int64_t nowUs);
 
   private:
     std::mutex       mOpMutex;
     ShmNNController *mShmNNcontroller;
+    // reused for every frame under mOpMutex, see postNNData()
+    KKMessage        mNNMsg;
+    KKMessage        mFeatureMsg;
+    KKMessage        mClipMsg;
+    // one answer for all images of a feature batch, by request uuid
+    std::map<std::string, STFeatureBatch> mBatches;
+    std::string      mSendBuf;
+    // gallery match of every face in the current result, nullptr if none
+    std::vector<const STFaceTrack *> mFaceMatches;
+    std::map<int32_t, STFaceTrack> mFaceTracks;   // live faces by track id
+    std::vector<STFaceTrack> mStillFaces;         // feature requests, untracked
+    std::vector<AIFaceMatch> mMatchBest;
+    uint32_t         mMatchFrame;
+    int64_t          mMatchSearches;
+    int64_t          mMatchReused;     // faces that kept the match of their track
+    float            mMatchScore;
+    float            mMatchDrift;
+    // best crop of every matting face track, under mOpMutex
+    MattingFaceCache mFaceCache;
+    std::vector<STFaceShot> mFaceShots;
+    int32_t          mShotWindow;
+    float            mShotRefreshGain;
 
 };
 
@@ -0,0 +1,519 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nn_result_delta.h"
+
+namespace rockchip {
+namespace aiserver {
+
+#define NN_DELTA_KEY_INTERVAL_DEFAULT   30
+#define NN_DELTA_MOVE_THRESHOLD_DEFAULT 2
+#define NN_DELTA_SCORE_SCALE            1000
+#define NN_DELTA_SCORE_THRESHOLD        20    // in score scale units
+
+static void putU8(std::string *out, uint8_t value) {
+    out->push_back((char)value);
+}
+
+static void putU16(std::string *out, uint16_t value) {
+    out->push_back((char)(value & 0xff));
+    out->push_back((char)(value >> 8));
+}
+
+static void putU32(std::string *out, uint32_t value) {
+    putU16(out, (uint16_t)(value & 0xffff));
+    putU16(out, (uint16_t)(value >> 16));
+}
+
+static void putU64(std::string *out, uint64_t value) {
+    putU32(out, (uint32_t)(value & 0xffffffff));
+    putU32(out, (uint32_t)(value >> 32));
+}
+
+static void putString(std::string *out, const char *str, size_t maxLen) {
+    size_t len = strnlen(str, maxLen - 1);
+    putU8(out, (uint8_t)len);
+    out->append(str, len);
+}
+
+static uint16_t quantizeScore(float score) {
+    float value = score * NN_DELTA_SCORE_SCALE + 0.5f;
+    if (value <= 0.0f) {
+        return 0;
+    }
+    return value >= 65535.0f ? 65535 : (uint16_t)value;
+}
+
+static float dequantizeScore(uint16_t value) {
+    return (float)value / NN_DELTA_SCORE_SCALE;
+}
+
+static void putPoints(std::string *out, const NNResultObject *object) {
+    putU8(out, (uint8_t)object->pointCount);
+    for (uint32_t i = 0; i < object->pointCount; i++) {
+        putU16(out, (uint16_t)object->points[i].x);
+        putU16(out, (uint16_t)object->points[i].y);
+    }
+}
+
+static void putAttrs(std::string *out, const NNResultObject *object) {
+    putU8(out, (uint8_t)object->attrCount);
+    for (uint32_t i = 0; i < object->attrCount; i++) {
+        putString(out, object->attrs[i].name, NN_RESULT_ATTR_LEN);
+        putString(out, object->attrs[i].value, NN_RESULT_ATTR_LEN);
+        putU16(out, quantizeScore(object->attrs[i].score));
+    }
+}
+
+static void putObject(std::string *out, const NNResultObject *object) {
+    putU8(out, (uint8_t)object->type);
+    putU32(out, (uint32_t)object->trackId);
+    putU16(out, (uint16_t)object->left);
+    putU16(out, (uint16_t)object->top);
+    putU16(out, (uint16_t)object->right);
+    putU16(out, (uint16_t)object->bottom);
+    putU16(out, quantizeScore(object->score));
+    putPoints(out, object);
+    putAttrs(out, object);
+}
+
+// the object as a consumer sees it after decoding
+static void copyQuantized(NNResultObject *dst, const NNResultObject *src) {
+    *dst = *src;
+    dst->pointCount = src->pointCount < NN_RESULT_MAX_POINTS ? src->pointCount : NN_RESULT_MAX_POINTS;
+    dst->attrCount  = src->attrCount < NN_RESULT_MAX_ATTRS ? src->attrCount : NN_RESULT_MAX_ATTRS;
+    dst->score = dequantizeScore(quantizeScore(src->score));
+    for (uint32_t i = 0; i < dst->attrCount; i++) {
+        dst->attrs[i].name[NN_RESULT_ATTR_LEN - 1]  = '\0';
+        dst->attrs[i].value[NN_RESULT_ATTR_LEN - 1] = '\0';
+        dst->attrs[i].score = dequantizeScore(quantizeScore(src->attrs[i].score));
+    }
+}
+
+// track ids are only unique within one object type
+static const NNResultObject *findTrack(const NNResultRecord *record, int32_t type, int32_t trackId) {
+    for (uint32_t i = 0; i < record->objectCount; i++) {
+        if (record->objects[i].type == type && record->objects[i].trackId == trackId) {
+            return &record->objects[i];
+        }
+    }
+    return nullptr;
+}
+
+NNDeltaEncoder::NNDeltaEncoder() {
+    memset(&reference, 0, sizeof(reference));
+    hasReference   = false;
+    keyRequested   = false;
+    keyInterval    = NN_DELTA_KEY_INTERVAL_DEFAULT;
+    framesSinceKey = 0;
+    moveThreshold  = NN_DELTA_MOVE_THRESHOLD_DEFAULT;
+}
+
+bool NNDeltaEncoder::needKey(const NNResultRecord *record) {
+    if (!hasReference || keyRequested || framesSinceKey + 1 >= keyInterval) {
+        return true;
+    }
+    if (record->index != reference.index + 1
+            || record->modelType != reference.modelType
+            || record->nnWidth != reference.nnWidth
+            || record->nnHeight != reference.nnHeight
+            || strncmp(record->modelName, reference.modelName, NN_RESULT_MODEL_NAME_LEN) != 0) {
+        return true;
+    }
+    // untracked or ambiguous objects can not be matched frame to frame
+    for (uint32_t i = 0; i < record->objectCount; i++) {
+        const NNResultObject *object = &record->objects[i];
+        if (object->trackId < 0
+                || findTrack(record, object->type, object->trackId) != object) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint8_t NNDeltaEncoder::diffObject(const NNResultObject *ref, const NNResultObject *object) {
+    uint8_t flags = 0;
+    if (abs(object->left - ref->left) >= moveThreshold
+            || abs(object->top - ref->top) >= moveThreshold
+            || abs(object->right - ref->right) >= moveThreshold
+            || abs(object->bottom - ref->bottom) >= moveThreshold) {
+        flags |= NN_DELTA_UPDATE_BOX;
+        if (abs(object->left - ref->left) <= INT8_MAX && abs(object->top - ref->top) <= INT8_MAX
+                && abs(object->right - ref->right) <= INT8_MAX
+                && abs(object->bottom - ref->bottom) <= INT8_MAX) {
+            flags = (flags & ~NN_DELTA_UPDATE_BOX) | NN_DELTA_UPDATE_BOX_SMALL;
+        }
+    }
+    if (abs((int32_t)quantizeScore(object->score) - (int32_t)quantizeScore(ref->score))
+            >= NN_DELTA_SCORE_THRESHOLD) {
+        flags |= NN_DELTA_UPDATE_SCORE;
+    }
+
+    uint32_t pointCount = object->pointCount < NN_RESULT_MAX_POINTS ? object->pointCount : NN_RESULT_MAX_POINTS;
+    if (pointCount != ref->pointCount) {
+        flags |= NN_DELTA_UPDATE_POINTS;
+    } else {
+        for (uint32_t i = 0; i < pointCount; i++) {
+            if (abs(object->points[i].x - ref->points[i].x) >= moveThreshold
+                    || abs(object->points[i].y - ref->points[i].y) >= moveThreshold) {
+                flags |= NN_DELTA_UPDATE_POINTS;
+                break;
+            }
+        }
+    }
+
+    // attributes are labels, any change is sent
+    uint32_t attrCount = object->attrCount < NN_RESULT_MAX_ATTRS ? object->attrCount : NN_RESULT_MAX_ATTRS;
+    if (attrCount != ref->attrCount) {
+        flags |= NN_DELTA_UPDATE_ATTRS;
+    } else {
+        for (uint32_t i = 0; i < attrCount; i++) {
+            if (strncmp(object->attrs[i].name, ref->attrs[i].name, NN_RESULT_ATTR_LEN - 1) != 0
+                    || strncmp(object->attrs[i].value, ref->attrs[i].value, NN_RESULT_ATTR_LEN - 1) != 0
+                    || abs((int32_t)quantizeScore(object->attrs[i].score)
+                           - (int32_t)quantizeScore(ref->attrs[i].score)) >= NN_DELTA_SCORE_THRESHOLD) {
+                flags |= NN_DELTA_UPDATE_ATTRS;
+                break;
+            }
+        }
+    }
+    return flags;
+}
+
+void NNDeltaEncoder::encodeUpdate(NNResultObject *ref, const NNResultObject *object,
+                                  uint8_t flags, std::string *out) {
+    NNResultObject quantized;
+    copyQuantized(&quantized, object);
+
+    putU8(out, NN_DELTA_OP_UPDATE);
+    putU8(out, (uint8_t)object->type);
+    putU32(out, (uint32_t)object->trackId);
+    putU8(out, flags);
+    if (flags & NN_DELTA_UPDATE_BOX) {
+        putU16(out, (uint16_t)quantized.left);
+        putU16(out, (uint16_t)quantized.top);
+        putU16(out, (uint16_t)quantized.right);
+        putU16(out, (uint16_t)quantized.bottom);
+    }
+    if (flags & NN_DELTA_UPDATE_BOX_SMALL) {
+        putU8(out, (uint8_t)(int8_t)(quantized.left - ref->left));
+        putU8(out, (uint8_t)(int8_t)(quantized.top - ref->top));
+        putU8(out, (uint8_t)(int8_t)(quantized.right - ref->right));
+        putU8(out, (uint8_t)(int8_t)(quantized.bottom - ref->bottom));
+    }
+    if (flags & (NN_DELTA_UPDATE_BOX | NN_DELTA_UPDATE_BOX_SMALL)) {
+        ref->left   = quantized.left;
+        ref->top    = quantized.top;
+        ref->right  = quantized.right;
+        ref->bottom = quantized.bottom;
+    }
+    if (flags & NN_DELTA_UPDATE_SCORE) {
+        putU16(out, quantizeScore(quantized.score));
+        ref->score = quantized.score;
+    }
+    if (flags & NN_DELTA_UPDATE_POINTS) {
+        putPoints(out, &quantized);
+        ref->pointCount = quantized.pointCount;
+        memcpy(ref->points, quantized.points, sizeof(ref->points));
+    }
+    if (flags & NN_DELTA_UPDATE_ATTRS) {
+        putAttrs(out, &quantized);
+        ref->attrCount = quantized.attrCount;
+        memcpy(ref->attrs, quantized.attrs, sizeof(ref->attrs));
+    }
+}
+
+int32_t NNDeltaEncoder::encode(const NNResultRecord *record, std::string *out) {
+    bool key = needKey(record);
+    uint32_t count = record->objectCount < NN_RESULT_MAX_OBJECTS ? record->objectCount : NN_RESULT_MAX_OBJECTS;
+
+    out->clear();
+    putU16(out, NN_DELTA_MAGIC);
+    putU8(out, NN_DELTA_VERSION);
+    putU8(out, key ? NN_DELTA_FRAME_KEY : NN_DELTA_FRAME_DELTA);
+    putU32(out, record->index);
+    putU64(out, (uint64_t)record->pts);
+    size_t opCountPos = out->size();
+    putU16(out, 0);
+
+    uint16_t ops = 0;
+    if (key) {
+        putU32(out, (uint32_t)record->modelType);
+        putU32(out, (uint32_t)record->nnWidth);
+        putU32(out, (uint32_t)record->nnHeight);
+        putString(out, record->modelName, NN_RESULT_MODEL_NAME_LEN);
+        reference.modelType = record->modelType;
+        reference.nnWidth   = record->nnWidth;
+        reference.nnHeight  = record->nnHeight;
+        memcpy(reference.modelName, record->modelName, NN_RESULT_MODEL_NAME_LEN);
+        reference.modelName[NN_RESULT_MODEL_NAME_LEN - 1] = '\0';
+        for (uint32_t i = 0; i < count; i++) {
+            copyQuantized(&reference.objects[i], &record->objects[i]);
+            putObject(out, &reference.objects[i]);
+            ops++;
+        }
+        reference.objectCount = count;
+        framesSinceKey = 0;
+        keyRequested = false;
+        hasReference = true;
+    } else {
+        // tracks that are gone, kept in order for the consumers
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < reference.objectCount; i++) {
+            const NNResultObject *ref = &reference.objects[i];
+            if (findTrack(record, ref->type, ref->trackId) == nullptr) {
+                putU8(out, NN_DELTA_OP_REMOVE);
+                putU8(out, (uint8_t)ref->type);
+                putU32(out, (uint32_t)ref->trackId);
+                ops++;
+                continue;
+            }
+            if (kept != i) {
+                reference.objects[kept] = reference.objects[i];
+            }
+            kept++;
+        }
+        reference.objectCount = kept;
+
+        for (uint32_t i = 0; i < count; i++) {
+            const NNResultObject *object = &record->objects[i];
+            NNResultObject *ref = const_cast<NNResultObject *>(findTrack(&reference, object->type, object->trackId));
+            if (ref == nullptr) {
+                ref = &reference.objects[reference.objectCount++];
+                copyQuantized(ref, object);
+                putU8(out, NN_DELTA_OP_ADD);
+                putObject(out, ref);
+                ops++;
+                continue;
+            }
+            uint8_t flags = diffObject(ref, object);
+            if (flags != 0) {
+                encodeUpdate(ref, object, flags, out);
+                ops++;
+            }
+        }
+        framesSinceKey++;
+    }
+    reference.index = record->index;
+    reference.pts   = record->pts;
+
+    (*out)[opCountPos]     = (char)(ops & 0xff);
+    (*out)[opCountPos + 1] = (char)(ops >> 8);
+    return key ? NN_DELTA_FRAME_KEY : NN_DELTA_FRAME_DELTA;
+}
+
+/*
+ * bounds checked reader, a read past the end sets failed and returns 0
+ */
+typedef struct _NNDeltaReader {
+    const uint8_t *data;
+    size_t         size;
+    size_t         pos;
+    bool           failed;
+} NNDeltaReader;
+
+static bool readBytes(NNDeltaReader *reader, void *dst, size_t len) {
+    if (reader->failed || reader->size - reader->pos < len) {
+        reader->failed = true;
+        return false;
+    }
+    memcpy(dst, reader->data + reader->pos, len);
+    reader->pos += len;
+    return true;
+}
+
+static uint8_t getU8(NNDeltaReader *reader) {
+    uint8_t value = 0;
+    readBytes(reader, &value, 1);
+    return value;
+}
+
+static uint16_t getU16(NNDeltaReader *reader) {
+    uint8_t bytes[2] = {0, 0};
+    readBytes(reader, bytes, 2);
+    return (uint16_t)(bytes[0] | (bytes[1] << 8));
+}
+
+static uint32_t getU32(NNDeltaReader *reader) {
+    uint32_t low = getU16(reader);
+    return low | ((uint32_t)getU16(reader) << 16);
+}
+
+static uint64_t getU64(NNDeltaReader *reader) {
+    uint64_t low = getU32(reader);
+    return low | ((uint64_t)getU32(reader) << 32);
+}
+
+static void getString(NNDeltaReader *reader, char *dst, size_t maxLen) {
+    uint8_t len = getU8(reader);
+    if (len >= maxLen) {
+        reader->failed = true;
+        return;
+    }
+    if (readBytes(reader, dst, len)) {
+        dst[len] = '\0';
+    }
+}
+
+static void getPoints(NNDeltaReader *reader, NNResultObject *object) {
+    uint8_t count = getU8(reader);
+    if (count > NN_RESULT_MAX_POINTS) {
+        reader->failed = true;
+        return;
+    }
+    object->pointCount = count;
+    for (uint32_t i = 0; i < count; i++) {
+        object->points[i].x = (int16_t)getU16(reader);
+        object->points[i].y = (int16_t)getU16(reader);
+    }
+}
+
+static void getAttrs(NNDeltaReader *reader, NNResultObject *object) {
+    uint8_t count = getU8(reader);
+    if (count > NN_RESULT_MAX_ATTRS) {
+        reader->failed = true;
+        return;
+    }
+    object->attrCount = count;
+    for (uint32_t i = 0; i < count; i++) {
+        getString(reader, object->attrs[i].name, NN_RESULT_ATTR_LEN);
+        getString(reader, object->attrs[i].value, NN_RESULT_ATTR_LEN);
+        object->attrs[i].score = dequantizeScore(getU16(reader));
+    }
+}
+
+static void getObject(NNDeltaReader *reader, NNResultObject *object) {
+    memset(object, 0, sizeof(NNResultObject));
+    object->type    = getU8(reader);
+    object->trackId = (int32_t)getU32(reader);
+    object->left    = (int16_t)getU16(reader);
+    object->top     = (int16_t)getU16(reader);
+    object->right   = (int16_t)getU16(reader);
+    object->bottom  = (int16_t)getU16(reader);
+    object->score   = dequantizeScore(getU16(reader));
+    getPoints(reader, object);
+    getAttrs(reader, object);
+}
+
+static NNResultObject *findState(NNResultRecord *record, int32_t type, int32_t trackId) {
+    for (uint32_t i = 0; i < record->objectCount; i++) {
+        if (record->objects[i].type == type && record->objects[i].trackId == trackId) {
+            return &record->objects[i];
+        }
+    }
+    return nullptr;
+}
+
+NNDeltaDecoder::NNDeltaDecoder() {
+    memset(&state, 0, sizeof(state));
+    hasState = false;
+}
+
+int32_t NNDeltaDecoder::decode(const uint8_t *data, size_t size, NNResultRecord *out) {
+    NNDeltaReader reader = { data, size, 0, false };
+    if (data == nullptr || getU16(&reader) != NN_DELTA_MAGIC
+            || getU8(&reader) != NN_DELTA_VERSION) {
+        return NN_DELTA_MALFORMED;
+    }
+    uint8_t  type  = getU8(&reader);
+    uint32_t index = getU32(&reader);
+    int64_t  pts   = (int64_t)getU64(&reader);
+    uint16_t ops   = getU16(&reader);
+    if (reader.failed) {
+        return NN_DELTA_MALFORMED;
+    }
+
+    if (type == NN_DELTA_FRAME_KEY) {
+        state.modelType = (int32_t)getU32(&reader);
+        state.nnWidth   = (int32_t)getU32(&reader);
+        state.nnHeight  = (int32_t)getU32(&reader);
+        getString(&reader, state.modelName, NN_RESULT_MODEL_NAME_LEN);
+        if (ops > NN_RESULT_MAX_OBJECTS) {
+            reader.failed = true;
+        }
+        for (uint32_t i = 0; i < ops && !reader.failed; i++) {
+            getObject(&reader, &state.objects[i]);
+        }
+        state.objectCount = ops;
+    } else if (type == NN_DELTA_FRAME_DELTA) {
+        if (!hasState || index != state.index + 1) {
+            hasState = false;
+            return NN_DELTA_NEED_KEY;
+        }
+        for (uint32_t i = 0; i < ops && !reader.failed; i++) {
+            uint8_t op = getU8(&reader);
+            if (op == NN_DELTA_OP_ADD) {
+                if (state.objectCount >= NN_RESULT_MAX_OBJECTS) {
+                    reader.failed = true;
+                    break;
+                }
+                NNResultObject *added = &state.objects[state.objectCount];
+                getObject(&reader, added);
+                if (findState(&state, added->type, added->trackId) != nullptr) {
+                    reader.failed = true;
+                    break;
+                }
+                state.objectCount++;
+                continue;
+            }
+            int32_t objectType = getU8(&reader);
+            int32_t trackId = (int32_t)getU32(&reader);
+            NNResultObject *object = findState(&state, objectType, trackId);
+            if (op == NN_DELTA_OP_REMOVE) {
+                if (object == nullptr) {
+                    reader.failed = true;
+                    break;
+                }
+                uint32_t pos = object - state.objects;
+                memmove(object, object + 1, (state.objectCount - pos - 1) * sizeof(NNResultObject));
+                state.objectCount--;
+            } else if (op == NN_DELTA_OP_UPDATE && object != nullptr) {
+                uint8_t flags = getU8(&reader);
+                if (flags & NN_DELTA_UPDATE_BOX) {
+                    object->left   = (int16_t)getU16(&reader);
+                    object->top    = (int16_t)getU16(&reader);
+                    object->right  = (int16_t)getU16(&reader);
+                    object->bottom = (int16_t)getU16(&reader);
+                }
+                if (flags & NN_DELTA_UPDATE_BOX_SMALL) {
+                    object->left   += (int8_t)getU8(&reader);
+                    object->top    += (int8_t)getU8(&reader);
+                    object->right  += (int8_t)getU8(&reader);
+                    object->bottom += (int8_t)getU8(&reader);
+                }
+                if (flags & NN_DELTA_UPDATE_SCORE) {
+                    object->score = dequantizeScore(getU16(&reader));
+                }
+                if (flags & NN_DELTA_UPDATE_POINTS) {
+                    getPoints(&reader, object);
+                }
+                if (flags & NN_DELTA_UPDATE_ATTRS) {
+                    getAttrs(&reader, object);
+                }
+            } else {
+                reader.failed = true;
+            }
+        }
+    } else {
+        return NN_DELTA_MALFORMED;
+    }
+
+    if (reader.failed) {
+        hasState = false;
+        return NN_DELTA_MALFORMED;
+    }
+    state.index = index;
+    state.pts   = pts;
+    hasState    = true;
+    if (out != nullptr) {
+        memcpy(out, &state, sizeof(NNResultRecord));
+    }
+    return NN_DELTA_OK;
+}
+
+} // namespace aiserver
+} // namespace rockchip
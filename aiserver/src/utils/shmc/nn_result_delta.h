@@ -0,0 +1,112 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef NN_RESULT_DELTA_H_
+#define NN_RESULT_DELTA_H_
+
+#include <stdint.h>
+
+#include "nn_result_ring.h"
+
+/*
+ * compact nn result stream, every message is one NNResultRecord coded
+ * against the previous one. all values little endian, no padding.
+ *
+ * header:
+ *   u16 magic, u8 version, u8 frame type, u32 index, i64 pts, u16 op count
+ * key frame (type 1), after the header:
+ *   i32 model type, i32 nn width, i32 nn height, u8 name len, name,
+ *   op count full objects
+ * delta frame (type 2), only follows the frame with index - 1:
+ *   op count ops, each starting with u8 op
+ *     add     full object
+ *     remove  u8 type, i32 track id
+ *     update  u8 type, i32 track id, u8 flags, then the parts named by
+ *             the flags in flag order
+ * objects are matched by type and track id, a frame with untracked
+ * objects (track id -1) always goes out as a key frame.
+ * full object:
+ *   u8 type, i32 track id, i16 left/top/right/bottom, u16 score,
+ *   u8 point count, i16 x/y per point, u8 attr count, attrs
+ * attr:
+ *   u8 name len, name, u8 value len, value, u16 score
+ * scores are sent as score * 1000.
+ *
+ * box or point changes below the move threshold are not sent, the key
+ * frames bring the consumers back to the exact values. decoded records
+ * list the objects in the order they first appeared, not the model order.
+ */
+#define NN_DELTA_MAGIC             0x444E  // "ND"
+#define NN_DELTA_VERSION           1
+
+#define NN_DELTA_FRAME_KEY         1
+#define NN_DELTA_FRAME_DELTA       2
+
+#define NN_DELTA_OP_ADD            1
+#define NN_DELTA_OP_REMOVE         2
+#define NN_DELTA_OP_UPDATE         3
+
+#define NN_DELTA_UPDATE_BOX        0x01  // i16 left/top/right/bottom
+#define NN_DELTA_UPDATE_BOX_SMALL  0x02  // i8 left/top/right/bottom, relative
+#define NN_DELTA_UPDATE_SCORE      0x04  // u16
+#define NN_DELTA_UPDATE_POINTS     0x08  // u8 count, i16 x/y per point
+#define NN_DELTA_UPDATE_ATTRS      0x10  // u8 count, attrs
+
+#define NN_DELTA_OK                0
+#define NN_DELTA_NEED_KEY          -1    // missed a frame or no key frame yet
+#define NN_DELTA_MALFORMED         -2
+
+#ifdef __cplusplus
+
+#include <string>
+
+namespace rockchip {
+namespace aiserver {
+
+class NNDeltaEncoder {
+  public:
+    NNDeltaEncoder();
+
+    void     setKeyInterval(int32_t frames) { keyInterval = frames; }
+    void     setMoveThreshold(int32_t pixels) { moveThreshold = pixels; }
+    // the next frame goes out as a key frame
+    void     requestKey() { keyRequested = true; }
+    // out is overwritten, returns the frame type written
+    int32_t  encode(const NNResultRecord *record, std::string *out);
+
+  private:
+    bool     needKey(const NNResultRecord *record);
+    uint8_t  diffObject(const NNResultObject *ref, const NNResultObject *object);
+    void     encodeUpdate(NNResultObject *ref, const NNResultObject *object,
+                          uint8_t flags, std::string *out);
+
+  private:
+    NNResultRecord reference;  // what the consumers hold after the last frame
+    bool     hasReference;
+    bool     keyRequested;
+    int32_t  keyInterval;
+    int32_t  framesSinceKey;
+    int32_t  moveThreshold;
+};
+
+// consumer side, rebuilds the records from the stream
+class NNDeltaDecoder {
+  public:
+    NNDeltaDecoder();
+
+    // NN_DELTA_OK and the current record in out, or an NN_DELTA_* error
+    int32_t  decode(const uint8_t *data, size_t size, NNResultRecord *out);
+    void     reset() { hasState = false; }
+
+  private:
+    NNResultRecord state;
+    bool     hasState;
+};
+
+} // namespace aiserver
+} // namespace rockchip
+
+#endif // __cplusplus
+
+#endif // NN_RESULT_DELTA_H_
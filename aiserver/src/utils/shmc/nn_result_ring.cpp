@@ -0,0 +1,359 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nn_result_ring.h"
+#include "logger/log.h"
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "nn_result_ring"
+
+// commits between two looks for subscribers that died
+#define NN_RESULT_REAP_PERIOD      64
+
+namespace rockchip {
+namespace aiserver {
+
+static int64_t getMonotonicUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static bool matchObject(const NNResultFilter *filter, const NNResultObject *object) {
+    if (filter->typeMask != 0
+            && (object->type < 0 || object->type >= 32
+                || !(filter->typeMask & (1u << object->type)))) {
+        return false;
+    }
+    return object->score >= filter->minScore;
+}
+
+NNResultRing::NNResultRing() {
+    ringRole = NN_RESULT_RING_WRITER;
+    shmId = -1;
+    header = nullptr;
+    records = nullptr;
+    mask = 0;
+    subscriberSlot = -1;
+    memset(&subscriberFilter, 0, sizeof(subscriberFilter));
+    memset(slotPid, 0, sizeof(slotPid));
+    memset(slotFilterSeq, 0, sizeof(slotFilterSeq));
+    memset(slotDueUs, 0, sizeof(slotDueUs));
+    memset(slotMatched, 0, sizeof(slotMatched));
+    commits = 0;
+}
+
+NNResultRing::~NNResultRing() {
+    release();
+}
+
+bool NNResultRing::initialize(const char *key, NNResultRingRole role) {
+    if (header != nullptr) {
+        return true;
+    }
+
+    size_t shmSize = sizeof(NNResultRingHeader)
+                   + sizeof(NNResultRecord) * NN_RESULT_RING_CAPACITY;
+    key_t shmKey = (key_t)strtol(key, NULL, 0);
+    shmId = shmget(shmKey, shmSize, (role == NN_RESULT_RING_WRITER ? IPC_CREAT : 0) | 0666);
+    if (shmId < 0) {
+        LOG_ERROR("shmget nn result ring(%s) failed, errno %d\n", key, errno);
+        return false;
+    }
+
+    // readers attach writable for their subscriber slot
+    void *addr = shmat(shmId, NULL, 0);
+    if (addr == (void *)-1) {
+        LOG_ERROR("shmat nn result ring(%s) failed, errno %d\n", key, errno);
+        shmId = -1;
+        return false;
+    }
+
+    header = (NNResultRingHeader *)addr;
+    if (role == NN_RESULT_RING_WRITER
+            && __sync_bool_compare_and_swap(&header->magic, 0, NN_RESULT_RING_MAGIC)) {
+        header->version    = NN_RESULT_RING_VERSION;
+        header->capacity   = NN_RESULT_RING_CAPACITY;
+        header->recordSize = sizeof(NNResultRecord);
+    } else if (header->magic != NN_RESULT_RING_MAGIC
+            || header->version != NN_RESULT_RING_VERSION
+            || header->capacity != NN_RESULT_RING_CAPACITY
+            || header->recordSize != sizeof(NNResultRecord)) {
+        LOG_ERROR("nn result ring(%s) layout mismatch(magic 0x%x ver %u cap %u record %u)\n",
+                  key, header->magic, header->version, header->capacity, header->recordSize);
+        shmdt(addr);
+        header = nullptr;
+        shmId = -1;
+        return false;
+    }
+
+    ringRole = role;
+    records = (NNResultRecord *)((uint8_t *)addr + sizeof(NNResultRingHeader));
+    mask = NN_RESULT_RING_CAPACITY - 1;
+    if (ringRole == NN_RESULT_RING_WRITER) {
+        __atomic_store_n(&header->producerPid, getpid(), __ATOMIC_RELEASE);
+    }
+
+    LOG_INFO("nn result ring(%s) attached as %s\n", key,
+             ringRole == NN_RESULT_RING_READER ? "reader" : "writer");
+    return true;
+}
+
+void NNResultRing::release() {
+    unsubscribe();
+    if (header != nullptr) {
+        if (ringRole == NN_RESULT_RING_WRITER) {
+            __atomic_store_n(&header->producerPid, 0, __ATOMIC_RELEASE);
+        }
+        shmdt((void *)header);
+        header = nullptr;
+        records = nullptr;
+    }
+    shmId = -1;
+}
+
+NNResultRecord *NNResultRing::beginWrite() {
+    if (header == nullptr || ringRole != NN_RESULT_RING_WRITER) {
+        return nullptr;
+    }
+
+    uint32_t index = header->writeIndex;
+    NNResultRecord *record = &records[index & mask];
+    // readers still on the old record see the odd seq and drop it
+    __atomic_store_n(&record->seq, index * 2 + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    record->index = index;
+    record->objectCount = 0;
+    return record;
+}
+
+void NNResultRing::commit() {
+    if (header == nullptr || ringRole != NN_RESULT_RING_WRITER) {
+        return;
+    }
+
+    uint32_t index = header->writeIndex;
+    NNResultRecord *record = &records[index & mask];
+    updateSubscribers(record);
+    __atomic_store_n(&record->seq, index * 2 + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->writeIndex, index + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t NNResultRing::writeIndex() const {
+    if (header == nullptr) {
+        return 0;
+    }
+    return __atomic_load_n(&header->writeIndex, __ATOMIC_ACQUIRE);
+}
+
+void NNResultRing::updateSubscribers(NNResultRecord *record) {
+    uint32_t wanted = 0;
+    int64_t  nowUs = -1;
+    bool     reap = (++commits % NN_RESULT_REAP_PERIOD) == 0;
+
+    for (int32_t i = 0; i < NN_RESULT_MAX_SUBSCRIBERS; i++) {
+        NNResultSubscriber *subscriber = &header->subscribers[i];
+        int32_t pid = __atomic_load_n(&subscriber->pid, __ATOMIC_ACQUIRE);
+        if (pid <= 0) {
+            continue;
+        }
+        if (reap && kill(pid, 0) < 0 && errno == ESRCH) {
+            LOG_INFO("nn result subscriber %d(pid %d) is gone\n", i, pid);
+            __sync_bool_compare_and_swap(&subscriber->pid, pid, 0);
+            continue;
+        }
+        uint32_t filterSeq = __atomic_load_n(&subscriber->filterSeq, __ATOMIC_ACQUIRE);
+        if (filterSeq & 1) {
+            continue;
+        }
+        NNResultFilter filter = subscriber->filter;
+        // the reader may have changed the filter and put the same pid back
+        // while it was copied, skip the slot for this record if so
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&subscriber->filterSeq, __ATOMIC_RELAXED) != filterSeq
+                || __atomic_load_n(&subscriber->pid, __ATOMIC_RELAXED) != pid) {
+            continue;
+        }
+        if (slotPid[i] != pid || slotFilterSeq[i] != filterSeq) {
+            // a new subscriber or a new filter, start over
+            slotPid[i] = pid;
+            slotFilterSeq[i] = filterSeq;
+            slotDueUs[i] = 0;
+            slotMatched[i] = false;
+        }
+
+        bool matched = false;
+        for (uint32_t j = 0; j < record->objectCount && !matched; j++) {
+            matched = matchObject(&filter, &record->objects[j]);
+        }
+        if (!matched) {
+            // one empty record after the last match, so overlays can clear
+            if (slotMatched[i]) {
+                wanted |= 1u << i;
+                slotMatched[i] = false;
+            }
+            continue;
+        }
+        if (filter.maxFps > 0) {
+            int64_t intervalUs = 1000000LL / filter.maxFps;
+            nowUs = nowUs < 0 ? getMonotonicUs() : nowUs;
+            if (nowUs < slotDueUs[i]) {
+                continue;
+            }
+            slotDueUs[i] = slotDueUs[i] + intervalUs > nowUs ? slotDueUs[i] + intervalUs : nowUs + intervalUs;
+        }
+        wanted |= 1u << i;
+        slotMatched[i] = true;
+    }
+    record->subscriberMask = wanted;
+}
+
+bool NNResultRing::subscribe(const NNResultFilter *filter) {
+    if (header == nullptr || filter == nullptr || ringRole != NN_RESULT_RING_READER) {
+        return false;
+    }
+
+    if (subscriberSlot < 0) {
+        for (int32_t i = 0; i < NN_RESULT_MAX_SUBSCRIBERS; i++) {
+            if (__sync_bool_compare_and_swap(&header->subscribers[i].pid, 0, -1)) {
+                subscriberSlot = i;
+                break;
+            }
+        }
+        if (subscriberSlot < 0) {
+            LOG_ERROR("no free nn result subscriber slot\n");
+            return false;
+        }
+    } else {
+        // the writer skips the slot while the filter is changed
+        __atomic_store_n(&header->subscribers[subscriberSlot].pid, -1, __ATOMIC_RELEASE);
+    }
+
+    NNResultSubscriber *subscriber = &header->subscribers[subscriberSlot];
+    uint32_t filterSeq = __atomic_load_n(&subscriber->filterSeq, __ATOMIC_RELAXED);
+    __atomic_store_n(&subscriber->filterSeq, filterSeq | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    subscriberFilter = *filter;
+    subscriber->filter = *filter;
+    __atomic_store_n(&subscriber->filterSeq, (filterSeq | 1) + 1, __ATOMIC_RELEASE);
+    subscriber->cursor = writeIndex();
+    subscriber->lost = 0;
+    __atomic_store_n(&subscriber->pid, getpid(), __ATOMIC_RELEASE);
+
+    LOG_INFO("nn result subscriber %d types 0x%x min score %.2f max fps %u\n",
+             subscriberSlot, filter->typeMask, filter->minScore, filter->maxFps);
+    return true;
+}
+
+void NNResultRing::unsubscribe() {
+    if (header == nullptr || subscriberSlot < 0) {
+        return;
+    }
+    __atomic_store_n(&header->subscribers[subscriberSlot].pid, 0, __ATOMIC_RELEASE);
+    subscriberSlot = -1;
+}
+
+void NNResultRing::publishCursor(uint32_t cursor, uint32_t lost) {
+    if (subscriberSlot < 0) {
+        return;
+    }
+    NNResultSubscriber *subscriber = &header->subscribers[subscriberSlot];
+    __atomic_store_n(&subscriber->cursor, cursor, __ATOMIC_RELAXED);
+    if (lost > 0) {
+        __atomic_add_fetch(&subscriber->lost, lost, __ATOMIC_RELAXED);
+    }
+}
+
+const NNResultRecord *NNResultRing::peek(uint32_t *cursor, uint32_t *lost) {
+    if (header == nullptr || cursor == nullptr) {
+        return nullptr;
+    }
+
+    while (true) {
+        uint32_t head = __atomic_load_n(&header->writeIndex, __ATOMIC_ACQUIRE);
+        if (head - *cursor > NN_RESULT_RING_CAPACITY) {
+            // the writer lapped us, the oldest record left may be rewritten
+            // any moment, start one past it
+            uint32_t next = head - NN_RESULT_RING_CAPACITY + 1;
+            if (lost != nullptr) {
+                *lost += next - *cursor;
+            }
+            publishCursor(next, next - *cursor);
+            *cursor = next;
+        }
+        if (*cursor == head) {
+            publishCursor(*cursor, 0);
+            return nullptr;
+        }
+
+        const NNResultRecord *record = &records[*cursor & mask];
+        if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != *cursor * 2 + 2) {
+            return nullptr;
+        }
+        if (subscriberSlot < 0 || (record->subscriberMask & (1u << subscriberSlot))) {
+            return record;
+        }
+        // filtered out for us; a rewrite under the check is caught by the
+        // lap test on the next pass
+        if (stillValid(record, *cursor)) {
+            *cursor += 1;
+        }
+    }
+}
+
+bool NNResultRing::stillValid(const NNResultRecord *record, uint32_t cursor) const {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&record->seq, __ATOMIC_RELAXED) == cursor * 2 + 2;
+}
+
+bool NNResultRing::read(uint32_t *cursor, NNResultRecord *out, uint32_t *lost) {
+    const NNResultRecord *record = peek(cursor, lost);
+    if (record == nullptr || out == nullptr) {
+        return false;
+    }
+
+    if (subscriberSlot < 0) {
+        memcpy(out, (const void *)record, sizeof(NNResultRecord));
+    } else {
+        // the header fields, then only the objects the filter keeps
+        memcpy(out, (const void *)record, offsetof(NNResultRecord, objects));
+        uint32_t count = record->objectCount < NN_RESULT_MAX_OBJECTS
+                       ? record->objectCount : NN_RESULT_MAX_OBJECTS;
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            if (matchObject(&subscriberFilter, &record->objects[i])) {
+                memcpy(&out->objects[kept++], &record->objects[i], sizeof(NNResultObject));
+            }
+        }
+        out->objectCount = kept;
+        out->subscriberMask = record->subscriberMask;
+    }
+    if (!stillValid(record, *cursor)) {
+        if (lost != nullptr) {
+            *lost += 1;
+        }
+        *cursor += 1;
+        publishCursor(*cursor, 1);
+        return false;
+    }
+    *cursor += 1;
+    publishCursor(*cursor, 0);
+    return true;
+}
+
+} // namespace aiserver
+} // namespace rockchip
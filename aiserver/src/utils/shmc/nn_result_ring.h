@@ -0,0 +1,180 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef NN_RESULT_RING_H_
+#define NN_RESULT_RING_H_
+
+#include <stdint.h>
+
+/*
+ * fixed layout of the nn result ring, keep it plain C and only append
+ * fields (bump the version when a record changes size).
+ *
+ * one writer (aiserver), any number of readers reading records in place.
+ * readers keep their own cursor, records are never written by readers:
+ *   1. head = writeIndex (acquire); nothing new while cursor == head,
+ *      more than capacity behind means records were overwritten
+ *   2. s = record[cursor & mask].seq (acquire), the record is complete
+ *      only if s == cursor * 2 + 2
+ *   3. read the record, then acquire fence and load seq again, the read
+ *      is valid if it is still s
+ *
+ * a reader may also take one of the subscriber slots and set a filter.
+ * the writer then sets the slot bit in subscriberMask of the records the
+ * filter lets through, the reader skips the others without reading them.
+ * a slot is taken by moving pid from 0 to -1 (cas), writing the filter
+ * and storing the reader pid (release); slots of dead readers are freed
+ * by the writer. filterSeq is odd while the filter is written, the writer
+ * drops a copy of the filter if filterSeq or pid moved under it.
+ */
+#define NN_RESULT_RING_MAGIC       0x4E4E5252  // "NNRR"
+#define NN_RESULT_RING_VERSION     3
+#define NN_RESULT_RING_CAPACITY    16          // power of two
+
+#define NN_RESULT_MAX_OBJECTS      32
+#define NN_RESULT_MAX_POINTS       68          // rockx face landmark 68
+#define NN_RESULT_MODEL_NAME_LEN   32
+#define NN_RESULT_MAX_ATTRS        4
+#define NN_RESULT_ATTR_LEN         16
+
+#define NN_RESULT_RING_CACHELINE   64
+#define NN_RESULT_MAX_SUBSCRIBERS  8
+
+typedef struct _NNResultPoint {
+    int16_t x;
+    int16_t y;
+} NNResultPoint;
+
+typedef struct _NNResultAttr {
+    char     name[NN_RESULT_ATTR_LEN];
+    char     value[NN_RESULT_ATTR_LEN];
+    float    score;
+} NNResultAttr;
+
+typedef struct _NNResultObject {
+    int32_t  type;        // RTNNDataType
+    int32_t  trackId;     // -1 if the model does not track
+    int16_t  left;
+    int16_t  top;
+    int16_t  right;
+    int16_t  bottom;
+    float    score;
+    uint16_t pointCount;
+    uint16_t reserved;
+    NNResultPoint points[NN_RESULT_MAX_POINTS];
+    // since version 2
+    uint32_t attrCount;
+    NNResultAttr attrs[NN_RESULT_MAX_ATTRS];
+} NNResultObject;
+
+typedef struct _NNResultRecord {
+    volatile uint32_t seq;       // index * 2 + 1 while written, index * 2 + 2 when done
+    uint32_t index;              // position in the stream
+    int64_t  pts;                // ISP timestamp of the source frame, 0 unknown
+    int32_t  modelType;
+    int32_t  nnWidth;            // coordinate space of the boxes
+    int32_t  nnHeight;
+    uint32_t objectCount;
+    char     modelName[NN_RESULT_MODEL_NAME_LEN];
+    NNResultObject objects[NN_RESULT_MAX_OBJECTS];
+    // since version 3, bit n set if subscriber slot n wants this record
+    uint32_t subscriberMask;
+} NNResultRecord;
+
+typedef struct _NNResultFilter {
+    uint32_t typeMask;    // 1 << RTNNDataType, 0 for all types
+    float    minScore;    // objects below are not delivered
+    uint32_t maxFps;      // 0 for every record
+} NNResultFilter;
+
+typedef struct _NNResultSubscriber {
+    volatile int32_t  pid;     // 0 free, -1 while the filter is changed
+    NNResultFilter    filter;
+    // published by the reader, the writer index minus cursor is its lag
+    volatile uint32_t cursor;
+    volatile uint32_t lost;    // records overwritten before they were read
+    volatile uint32_t filterSeq;
+    uint8_t  pad[NN_RESULT_RING_CACHELINE - 4 * sizeof(uint32_t) - sizeof(NNResultFilter)];
+} NNResultSubscriber;
+
+typedef struct _NNResultRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t recordSize;
+    volatile int32_t producerPid;
+    uint8_t  pad0[NN_RESULT_RING_CACHELINE - 5 * sizeof(uint32_t)];
+    volatile uint32_t writeIndex;  // records committed so far
+    uint8_t  pad1[NN_RESULT_RING_CACHELINE - sizeof(uint32_t)];
+    // since version 3
+    NNResultSubscriber subscribers[NN_RESULT_MAX_SUBSCRIBERS];
+} NNResultRingHeader;
+
+#ifdef __cplusplus
+
+namespace rockchip {
+namespace aiserver {
+
+enum NNResultRingRole {
+    NN_RESULT_RING_WRITER = 0,
+    NN_RESULT_RING_READER = 1,
+};
+
+class NNResultRing {
+  public:
+    NNResultRing();
+   ~NNResultRing();
+
+    bool     initialize(const char *key, NNResultRingRole role);
+    void     release();
+    bool     isValid() const { return header != nullptr; }
+
+    // writer side, fill the returned record in place then commit it
+    NNResultRecord *beginWrite();
+    void     commit();
+
+    // reader side, start from writeIndex() to skip the backlog
+    uint32_t writeIndex() const;
+    // in place view of record *cursor, nullptr if there is none yet.
+    // skips ahead over overwritten records and counts them in lost,
+    // and over the records the filter drops
+    const NNResultRecord *peek(uint32_t *cursor, uint32_t *lost);
+    // after the record from peek() was used, false if it was overwritten
+    bool     stillValid(const NNResultRecord *record, uint32_t cursor) const;
+    // copying read, advances the cursor on success. with a filter only
+    // the objects passing it are copied
+    bool     read(uint32_t *cursor, NNResultRecord *out, uint32_t *lost);
+
+    // reader side filter, takes a subscriber slot on the first call.
+    // false if all slots are taken
+    bool     subscribe(const NNResultFilter *filter);
+    void     unsubscribe();
+
+  private:
+    void     updateSubscribers(NNResultRecord *record);
+    void     publishCursor(uint32_t cursor, uint32_t lost);
+
+  private:
+    NNResultRingRole    ringRole;
+    int32_t             shmId;
+    NNResultRingHeader *header;
+    NNResultRecord     *records;
+    uint32_t            mask;
+    // reader, the slot taken by subscribe() or -1
+    int32_t             subscriberSlot;
+    NNResultFilter      subscriberFilter;
+    // writer, per slot state behind the rate limit
+    int32_t             slotPid[NN_RESULT_MAX_SUBSCRIBERS];
+    uint32_t            slotFilterSeq[NN_RESULT_MAX_SUBSCRIBERS];
+    int64_t             slotDueUs[NN_RESULT_MAX_SUBSCRIBERS];
+    bool                slotMatched[NN_RESULT_MAX_SUBSCRIBERS];
+    uint32_t            commits;
+};
+
+} // namespace aiserver
+} // namespace rockchip
+
+#endif // __cplusplus
+
+#endif // NN_RESULT_RING_H_
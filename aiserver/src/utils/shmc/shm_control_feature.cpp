@@ -1,61 +1,264 @@
-
 #ifndef SHM_QUEUE_TRANSCEIER_H_
 #define SHM_QUEUE_TRANSCEIER_H_
 
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+
 #include <shmc/shm_queue.h>
 #include "shm_control_feature.h"
+#include "shm_doorbell.h"
 #include "logger/log.h"
 
 #define MAX_IMAGE_SIZE (1920*1088*2)
-const  char *kShmFeatureKey = "0x100ff";
-static int   mShmReadOK   = 0;
-static int   mShmWriteOK  = 0;
-static shmc::ShmQueue<shmc::SVIPC>  mShmQueue;
-static shmc::ShmQueue<shmc::SVIPC> *mShmReadQueue = nullptr;
+#define FEATURE_REQUEST_MAGIC       "FREQ"
+#define FEATURE_REQUEST_MAGIC_LEN   4
+#define FEATURE_MAX_PENDING         8      // requests picked up for other ids
+#define FEATURE_LEGACY_POLL_MS      2      // writers that never ring the doorbell
+#define FEATURE_ATTACH_RETRY_MS     500
 
-pthread_mutex_t gMutex = PTHREAD_MUTEX_INITIALIZER;
+const  char *kShmFeatureKey     = "0x100ff";
+const  char *kShmFeatureBellKey = "0x10100";
 
-void shm_queue_send_buffer(std::string buffer) {
-    shmc::SetLogHandler(shmc::kDebug, [](shmc::LogLevel lv, const char *s) {
-        LOG_INFO("[%d] %s\n", lv, s);
+/*
+ * attached once and kept. the queue is attached again only while the
+ * writer has not created it yet, or with a fresh queue object once the
+ * writer made a new segment. the lock covers the queue calls, never the
+ * wait for a request, which sleeps on the doorbell.
+ */
+typedef struct _ShmFeatureChannel {
+    std::mutex  mutex;
+    shmc::ShmQueue<shmc::SVIPC> *readQueue = nullptr;
+    shmc::ShmQueue<shmc::SVIPC> writeQueue;
+    bool        readOK   = false;
+    bool        writeOK  = false;
+    int         readShmId = -1;   // segment the read queue is attached to
+    rockchip::aiserver::ShmDoorbell bell;
+    std::chrono::steady_clock::time_point nextAttach;
+    // requests already taken off the queue for another id
+    std::map<std::string, std::string> pending;
+    std::deque<std::string> pendingOrder;
+    // plain buffers of older clients
+    std::deque<std::string> unnamed;
+} ShmFeatureChannel;
+
+static ShmFeatureChannel gChannel;
+static std::once_flag    gLogOnce;
+
+static void setupLogHandler() {
+    std::call_once(gLogOnce, [] {
+        shmc::SetLogHandler(shmc::kDebug, [](shmc::LogLevel lv, const char *s) {
+            LOG_INFO("[%d] %s\n", lv, s);
+        });
     });
-    if (mShmWriteOK == 0) {
-        mShmWriteOK = mShmQueue.InitForWrite(kShmFeatureKey, MAX_IMAGE_SIZE);
+}
+
+// under gChannel.mutex
+static void attachBell() {
+    if (!gChannel.bell.isValid()) {
+        gChannel.bell.initialize(kShmFeatureBellKey);
+    }
+}
+
+// under gChannel.mutex, -1 if the writer has not created the queue
+static int getFeatureShmId() {
+    return shmget((key_t)strtol(kShmFeatureKey, NULL, 0), 0, 0);
+}
+
+// under gChannel.mutex
+static bool attachForRead() {
+    if (gChannel.readOK) {
+        return true;
     }
-    if (mShmWriteOK > 0) {
-        pthread_mutex_lock(&gMutex);
-        mShmQueue.Push(buffer);
-        pthread_mutex_unlock(&gMutex);
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now < gChannel.nextAttach) {
+        return false;
     }
+    if (gChannel.readQueue == nullptr) {
+        gChannel.readQueue = new shmc::ShmQueue<shmc::SVIPC>();
+    }
+    gChannel.readOK = gChannel.readQueue->InitForRead(kShmFeatureKey);
+    if (!gChannel.readOK) {
+        gChannel.nextAttach = now + std::chrono::milliseconds(FEATURE_ATTACH_RETRY_MS);
+        return false;
+    }
+    gChannel.readShmId = getFeatureShmId();
+    return true;
 }
 
-void shm_queue_recv_buffer(std::string *buffer) {
-    bool hasRetry = false;
-    shmc::SetLogHandler(shmc::kDebug, [](shmc::LogLevel lv, const char *s) {
-        LOG_INFO("[%d] %s\n", lv, s);
-    });
-RETRY:
-    if (mShmReadQueue == nullptr) {
-        mShmReadQueue = new shmc::ShmQueue<shmc::SVIPC>();
-    }
-    if (mShmReadOK == 0) {
-        mShmReadOK = mShmReadQueue->InitForRead(kShmFeatureKey);
-    }
-    if (mShmReadOK > 0) {
-        pthread_mutex_lock(&gMutex);
-        mShmReadQueue->Pop(buffer);
-        pthread_mutex_unlock(&gMutex);
-        if (buffer->length() == 0 && hasRetry == false) {
-            hasRetry = true;
-            delete mShmReadQueue;
-            mShmReadQueue = nullptr;
-            mShmReadOK = 0;
-            LOG_ERROR("shm_queue_recv_buffer RETRY %s", kShmFeatureKey);
-            goto RETRY;
+// under gChannel.mutex, a writer that came back may have made a new segment
+static void checkReadSegment() {
+    if (!gChannel.readOK || getFeatureShmId() == gChannel.readShmId) {
+        return;
+    }
+    LOG_INFO("feature queue %s was recreated, attach again\n", kShmFeatureKey);
+    delete gChannel.readQueue;
+    gChannel.readQueue = nullptr;
+    gChannel.readOK = false;
+    gChannel.readShmId = -1;
+    gChannel.nextAttach = std::chrono::steady_clock::time_point();
+}
+
+// under gChannel.mutex, a named request in id/buffer or a plain one in buffer
+static bool parseRequest(std::string *raw, std::string *id) {
+    id->clear();
+    if (raw->length() < FEATURE_REQUEST_MAGIC_LEN + 2
+            || memcmp(raw->data(), FEATURE_REQUEST_MAGIC, FEATURE_REQUEST_MAGIC_LEN) != 0) {
+        return false;
+    }
+    const uint8_t *lenBytes = (const uint8_t *)raw->data() + FEATURE_REQUEST_MAGIC_LEN;
+    size_t idLen = lenBytes[0] | (lenBytes[1] << 8);
+    size_t head  = FEATURE_REQUEST_MAGIC_LEN + 2 + idLen;
+    if (raw->length() < head) {
+        return false;
+    }
+    id->assign(raw->data() + FEATURE_REQUEST_MAGIC_LEN + 2, idLen);
+    raw->erase(0, head);
+    return true;
+}
+
+// under gChannel.mutex
+static void keepPending(const std::string &id, std::string *buffer) {
+    if (gChannel.pending.find(id) == gChannel.pending.end()) {
+        gChannel.pendingOrder.push_back(id);
+    }
+    gChannel.pending[id].swap(*buffer);
+    if (gChannel.pendingOrder.size() > FEATURE_MAX_PENDING) {
+        LOG_ERROR("feature request %s never asked for, dropped\n", gChannel.pendingOrder.front().c_str());
+        gChannel.pending.erase(gChannel.pendingOrder.front());
+        gChannel.pendingOrder.pop_front();
+    }
+}
+
+// under gChannel.mutex
+static bool takePending(const std::string &id, std::string *buffer) {
+    std::map<std::string, std::string>::iterator it = gChannel.pending.find(id);
+    if (!id.empty() && it != gChannel.pending.end()) {
+        buffer->swap(it->second);
+        gChannel.pending.erase(it);
+        for (std::deque<std::string>::iterator order = gChannel.pendingOrder.begin();
+                order != gChannel.pendingOrder.end(); order++) {
+            if (*order == id) {
+                gChannel.pendingOrder.erase(order);
+                break;
+            }
+        }
+        return true;
+    }
+    if (!gChannel.unnamed.empty()) {
+        buffer->swap(gChannel.unnamed.front());
+        gChannel.unnamed.pop_front();
+        return true;
+    }
+    if (id.empty() && !gChannel.pendingOrder.empty()) {
+        buffer->swap(gChannel.pending[gChannel.pendingOrder.front()]);
+        gChannel.pending.erase(gChannel.pendingOrder.front());
+        gChannel.pendingOrder.pop_front();
+        return true;
+    }
+    return false;
+}
+
+void shm_feature_send_request(const std::string &id, const std::string &buffer) {
+    setupLogHandler();
+    std::string message;
+    message.reserve(FEATURE_REQUEST_MAGIC_LEN + 2 + id.length() + buffer.length());
+    message.append(FEATURE_REQUEST_MAGIC, FEATURE_REQUEST_MAGIC_LEN);
+    message.push_back((char)(id.length() & 0xff));
+    message.push_back((char)((id.length() >> 8) & 0xff));
+    message.append(id);
+    message.append(buffer);
+
+    std::lock_guard<std::mutex> lock(gChannel.mutex);
+    if (!gChannel.writeOK) {
+        gChannel.writeOK = gChannel.writeQueue.InitForWrite(kShmFeatureKey, MAX_IMAGE_SIZE);
+    }
+    if (gChannel.writeOK) {
+        gChannel.writeQueue.Push(message);
+        attachBell();
+        gChannel.bell.ring();
+    }
+}
+
+int32_t shm_feature_recv_request(const std::string &id, std::string *buffer, int32_t timeoutMs) {
+    setupLogHandler();
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    std::string raw;
+    std::string rawId;
+
+    buffer->clear();
+    while (true) {
+        uint32_t bellSeq = 0;
+        {
+            std::lock_guard<std::mutex> lock(gChannel.mutex);
+            attachBell();
+            // sample before popping, a ring between pop and wait is not lost
+            bellSeq = gChannel.bell.sequence();
+            if (takePending(id, buffer)) {
+                return 0;
+            }
+            // drain what is there, the request may be behind others
+            while (attachForRead() && gChannel.readQueue->Pop(&raw) && raw.length() > 0) {
+                if (!parseRequest(&raw, &rawId)) {
+                    gChannel.unnamed.push_back(std::string());
+                    gChannel.unnamed.back().swap(raw);
+                    if (gChannel.unnamed.size() > FEATURE_MAX_PENDING) {
+                        LOG_ERROR("unnamed feature request never asked for, dropped\n");
+                        gChannel.unnamed.pop_front();
+                    }
+                } else if (rawId == id || id.empty()) {
+                    buffer->swap(raw);
+                    return 0;
+                } else {
+                    keepPending(rawId, &raw);
+                }
+            }
+            if (takePending(id, buffer)) {
+                return 0;
+            }
+        }
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+            break;
+        }
+        int32_t waitMs = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1;
+        if (!gChannel.bell.hasWriter()) {
+            waitMs = std::min(waitMs, FEATURE_LEGACY_POLL_MS);
+        }
+        if (gChannel.bell.wait(bellSeq, waitMs) < 0) {
+            usleep(FEATURE_LEGACY_POLL_MS * 1000);
         }
-    } else {
-        LOG_ERROR("shm_queue_recv_buffer read error");
     }
+
+    std::lock_guard<std::mutex> lock(gChannel.mutex);
+    checkReadSegment();
+    LOG_ERROR("no feature request %s in %dms\n", id.c_str(), timeoutMs);
+    return -1;
+}
+
+void shm_queue_send_buffer(std::string buffer) {
+    setupLogHandler();
+    std::lock_guard<std::mutex> lock(gChannel.mutex);
+    if (!gChannel.writeOK) {
+        gChannel.writeOK = gChannel.writeQueue.InitForWrite(kShmFeatureKey, MAX_IMAGE_SIZE);
+    }
+    if (gChannel.writeOK) {
+        gChannel.writeQueue.Push(buffer);
+        attachBell();
+        gChannel.bell.ring();
+    }
+}
+
+void shm_queue_recv_buffer(std::string *buffer) {
+    shm_feature_recv_request(std::string(), buffer, SHM_FEATURE_RECV_TIMEOUT_MS);
 }
 
 #endif
@@ -1,10 +1,26 @@
-
 #ifndef SHM_CONTROL_FEATURE_H_
 #define SHM_CONTROL_FEATURE_H_
 
+#include <stdint.h>
 #include <string>
 
+/*
+ * feature requests, the client pushes the images and then names the
+ * request id over dbus. requests sent with shm_feature_send_request()
+ * carry their id, so any number of them may be in flight and each is
+ * picked up by its own id. plain buffers from older clients are taken in
+ * arrival order by whoever asks next. the senders ring a doorbell after
+ * the push, the receiver sleeps on it and polls only writers that never
+ * ring.
+ */
+#define SHM_FEATURE_RECV_TIMEOUT_MS     1000
+
+void    shm_feature_send_request(const std::string &id, const std::string &buffer);
+// 0 and the request in buffer, -1 if nothing came within timeoutMs
+int32_t shm_feature_recv_request(const std::string &id, std::string *buffer, int32_t timeoutMs);
+
+// unnamed requests, kept for older callers
 void shm_queue_send_buffer(std::string buffer);
 void shm_queue_recv_buffer(std::string *buffer);
 
-#endif // SHM_CONTROL_FEATURE_H_
\ No newline at end of file
+#endif // SHM_CONTROL_FEATURE_H_
@@ -2,6 +2,12 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <chrono>
+
 #include "shm_control_nn.h"
 #include "logger/log.h"
 
@@ -10,16 +16,66 @@
 #endif
 #define LOG_TAG "shm_control_nn"
 
+#define NN_CLEAR_MS_DEFAULT 500
+
 namespace rockchip {
 namespace aiserver {
 
+static int64_t getNowUs() {
+    struct timespec now = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
 ShmNNController::ShmNNController() {
     shmWriteInited = 0;
+    protobufOutput = true;
+    char *protobufEnv = getenv("AI_NN_PROTOBUF");
+    if (protobufEnv && strlen(protobufEnv) > 0) {
+        protobufOutput = atoi(protobufEnv) != 0;
+    }
+
+    deltaWriteInited = 0;
+    deltaOutput = false;
+    char *deltaEnv = getenv("AI_NN_DELTA");
+    if (deltaEnv && strlen(deltaEnv) > 0) {
+        deltaOutput = atoi(deltaEnv) != 0;
+    }
+    char *keyframeEnv = getenv("AI_NN_DELTA_KEYFRAME");
+    if (keyframeEnv && atoi(keyframeEnv) > 0) {
+        deltaEncoder.setKeyInterval(atoi(keyframeEnv));
+    }
+    pendingRecord = nullptr;
+    memset(&scratchRecord, 0, sizeof(scratchRecord));
+    scratchIndex = 0;
+    memset(&lastHeader, 0, sizeof(lastHeader));
+    lastObjectCount = 0;
+    lastCommitUs = 0;
+    clearMs = NN_CLEAR_MS_DEFAULT;
+    char *clearEnv = getenv("AI_NN_CLEAR_MS");
+    if (clearEnv && strlen(clearEnv) > 0) {
+        clearMs = atoi(clearEnv);
+    }
+    clearRunning = false;
+    clearThread = nullptr;
     initialize();
+    if (clearMs > 0 && (resultRing.isValid() || deltaWriteInited)) {
+        clearRunning = true;
+        clearThread = new std::thread(clearLoop, this);
+    }
 }
 
 ShmNNController::~ShmNNController() {
-
+    if (clearThread) {
+        {
+            std::lock_guard<std::mutex> lock(recordMutex);
+            clearRunning = false;
+        }
+        clearCond.notify_all();
+        clearThread->join();
+        delete clearThread;
+        clearThread = nullptr;
+    }
 }
 
 void ShmNNController::initialize() {
@@ -31,7 +87,13 @@ void ShmNNController::initialize() {
     shmc::SetLogHandler(shmc::kDebug, [](shmc::LogLevel lv, const char *s) {
         LOG_INFO("[%d] %s\n", lv, s);
     });
-    shmWriteInited = shmNNQueue.InitForWrite(kShmNNKey, kNNQueueBufSize);
+    if (protobufOutput) {
+        shmWriteInited = shmNNQueue.InitForWrite(kShmNNKey, kNNQueueBufSize);
+    }
+    resultRing.initialize(kShmNNResultRingKey, NN_RESULT_RING_WRITER);
+    if (deltaOutput && !deltaWriteInited) {
+        deltaWriteInited = shmDeltaQueue.InitForWrite(kShmNNDeltaKey, kNNDeltaBufSize);
+    }
 #endif
 }
 
@@ -47,6 +109,98 @@ void ShmNNController::send(std::string &buf) {
     }
 }
 
+NNResultRecord *ShmNNController::beginRecord() {
+    recordMutex.lock();
+    NNResultRecord *record = beginRecordLocked();
+    if (record == nullptr) {
+        recordMutex.unlock();
+    }
+    return record;
+}
+
+void ShmNNController::commitRecord() {
+    if (pendingRecord == nullptr) {
+        return;
+    }
+    commitRecordLocked();
+    recordMutex.unlock();
+}
+
+void ShmNNController::commitEmptyRecord(int64_t pts) {
+    std::lock_guard<std::mutex> lock(recordMutex);
+    commitEmptyRecordLocked(pts);
+}
+
+void ShmNNController::commitEmptyRecordLocked(int64_t pts) {
+    NNResultRecord *record = beginRecordLocked();
+    if (record == nullptr) {
+        return;
+    }
+    record->pts       = pts;
+    record->modelType = lastHeader.modelType;
+    record->nnWidth   = lastHeader.nnWidth;
+    record->nnHeight  = lastHeader.nnHeight;
+    memcpy(record->modelName, lastHeader.modelName, NN_RESULT_MODEL_NAME_LEN);
+    record->objectCount = 0;
+    commitRecordLocked();
+}
+
+NNResultRecord *ShmNNController::beginRecordLocked() {
+    pendingRecord = resultRing.isValid() ? resultRing.beginWrite() : nullptr;
+    if (pendingRecord == nullptr && deltaWriteInited) {
+        scratchRecord.index = scratchIndex++;
+        scratchRecord.objectCount = 0;
+        pendingRecord = &scratchRecord;
+    }
+    return pendingRecord;
+}
+
+void ShmNNController::commitRecordLocked() {
+    lastHeader.pts       = pendingRecord->pts;
+    lastHeader.modelType = pendingRecord->modelType;
+    lastHeader.nnWidth   = pendingRecord->nnWidth;
+    lastHeader.nnHeight  = pendingRecord->nnHeight;
+    memcpy(lastHeader.modelName, pendingRecord->modelName, NN_RESULT_MODEL_NAME_LEN);
+    lastHeader.modelName[NN_RESULT_MODEL_NAME_LEN - 1] = '\0';
+    lastObjectCount = pendingRecord->objectCount;
+    lastCommitUs = getNowUs();
+    if (deltaWriteInited) {
+        sendDelta(pendingRecord);
+    }
+    if (pendingRecord != &scratchRecord) {
+        resultRing.commit();
+    }
+    pendingRecord = nullptr;
+}
+
+void ShmNNController::sendDelta(const NNResultRecord *record) {
+    // frames without changes still go out, a gap in the index is how the
+    // consumers notice a dropped message
+    deltaEncoder.encode(record, &deltaBuf);
+    if (!shmDeltaQueue.Push(deltaBuf)) {
+        // the consumers lost this frame, resync them
+        deltaEncoder.requestKey();
+    }
+}
+
+void ShmNNController::clearLoop(void *opaque) {
+    ShmNNController *controller = reinterpret_cast<ShmNNController *>(opaque);
+    std::unique_lock<std::mutex> lock(controller->recordMutex);
+    while (controller->clearRunning) {
+        controller->clearCond.wait_for(lock, std::chrono::milliseconds(controller->clearMs));
+        if (!controller->clearRunning) {
+            break;
+        }
+        if (controller->lastObjectCount == 0
+                || getNowUs() - controller->lastCommitUs < controller->clearMs * 1000LL) {
+            continue;
+        }
+        LOG_DEBUG("no nn result for %d ms, clear %u objects\n",
+                  controller->clearMs, controller->lastObjectCount);
+        controller->commitEmptyRecordLocked(controller->lastHeader.pts);
+    }
+}
+
 }
 }
 // namespace ShmControl
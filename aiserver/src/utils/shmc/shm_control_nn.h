@@ -5,13 +5,21 @@
 #ifndef SHM_CONTROL_NN_H_
 #define SHM_CONTROL_NN_H_
 
+#include <condition_variable>
 #include <mutex>
+#include <thread>
 #include <shmc/shm_queue.h>
 #include <stdint.h>
 
+#include "nn_result_delta.h"
+#include "nn_result_ring.h"
+
 namespace {
 constexpr const char *kShmNNKey       = "0x10007";
+constexpr const char *kShmNNResultRingKey = "0x10017";
+constexpr const char *kShmNNDeltaKey  = "0x10027";
 constexpr size_t      kNNQueueBufSize = 1024 * 1024 * 1;
+constexpr size_t      kNNDeltaBufSize = 256 * 1024;
 } // namespace
 
 using namespace shmc;
@@ -27,10 +35,50 @@ class ShmNNController {
     void initialize();
     void send(std::string &buf);
 
+    // flat results, filled in place in shared memory. nullptr if the ring
+    // is not available, otherwise commitRecord() must follow. the record
+    // lock is held in between
+    NNResultRecord *beginRecord();
+    void commitRecord();
+    // a frame without objects, keeps the model of the last record
+    void commitEmptyRecord(int64_t pts);
+    // the protobuf queue is kept for older consumers, AI_NN_PROTOBUF=0 drops it
+    bool protobufEnabled() const { return protobufOutput; }
+
+  private:
+    NNResultRecord *beginRecordLocked();
+    void commitRecordLocked();
+    void commitEmptyRecordLocked(int64_t pts);
+    void sendDelta(const NNResultRecord *record);
+    // producers that skip frames without objects get an empty record after
+    // AI_NN_CLEAR_MS, so the consumers drop the tracks they still hold
+    static void clearLoop(void *opaque);
+
   private:
     std::mutex            opMutex;
     ShmQueue<shmc::SVIPC> shmNNQueue;
     int32_t               shmWriteInited;
+    NNResultRing          resultRing;
+    bool                  protobufOutput;
+    // track delta stream, AI_NN_DELTA=1 turns it on
+    ShmQueue<shmc::SVIPC> shmDeltaQueue;
+    int32_t               deltaWriteInited;
+    bool                  deltaOutput;
+    NNDeltaEncoder        deltaEncoder;
+    std::string           deltaBuf;
+    NNResultRecord       *pendingRecord;
+    // stands in for the ring record when only the delta stream is up
+    NNResultRecord        scratchRecord;
+    uint32_t              scratchIndex;
+    // the last committed record, the base of the empty ones
+    std::mutex            recordMutex;
+    NNResultRecord        lastHeader;
+    uint32_t              lastObjectCount;
+    int64_t               lastCommitUs;
+    int32_t               clearMs;
+    bool                  clearRunning;
+    std::condition_variable clearCond;
+    std::thread          *clearThread;
 };
 
 } // namespace aiserver
@@ -2,9 +2,13 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <stdlib.h>
+#include <string.h>
 #include <sys/prctl.h>
 #include <sys/time.h>
 
+#include <algorithm>
+
 #include "shm_control_uvc.h"
 #include "logger/log.h"
 #include "drm_helper.h"
@@ -17,6 +21,12 @@
 namespace rockchip {
 namespace aiserver {
 
+static int64_t getMonotonicUs() {
+    struct timespec now = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
 void ProcessRecvUVCMessage(void *opaque) {
     prctl(PR_SET_NAME, "aiuvc_recv_msg_thread");
     ShmUVCController* controller = (ShmUVCController *)opaque;
@@ -28,51 +38,46 @@ ShmUVCController::ShmUVCController() {
 }
 
 ShmUVCController::~ShmUVCController() {
-#if UVC_DYNAMIC_DEBUG
-    debugLooping = false;
-    if (debugThread)
-    {
-        debugThread->join();
-        delete debugThread;
-        debugThread = nullptr;
-    }
-#endif
     if (drmFd >= 0) {
         drm_close(drmFd);
         drmFd = -1;
     }
 }
 
-#if UVC_DYNAMIC_DEBUG
-void ProcessDebug(void *opaque)
-{
-    prctl(PR_SET_NAME, "shm_uvc_debug_thread");
-    ShmUVCController *controller = (ShmUVCController *)opaque;
-    controller->debugLoop();
-}
-
-void ShmUVCController::debugLoop()
-{
-    LOG_INFO("enter\n");
-    while (debugLooping)
-    {
-        sleep(1);
-        if (!access(UVC_IPC_DYNAMIC_DEBUG_STATE, 0))
-        {
-            LOG_INFO("send_seq:%d, recv_seq:%d send_count:%d, recv_count:%d\n",
-                      send_seq, recv_seq, send_count, recv_count);
-        }
-    }
-    LOG_INFO("exit \n");
-}
-#endif
-
 void ShmUVCController::initialize() {
     recvLooping = false;
     uvcRunning  = false;
     cameraWidth = -1;
     cameraHeight = -1;
+    lastExpireCheckUs = 0;
+    recvSeq = 0;
+    sendSeq = 0;
+    recvCount = 0;
+    resumeOnConfigured = false;
+    sendCount = 0;
     bool shmRet = false;
+
+    int32_t timeoutMs = kUVCBufferReturnTimeoutMs;
+    char *timeoutEnv = getenv(UVC_BUFFER_RETURN_TIMEOUT_ENV);
+    if (timeoutEnv && strlen(timeoutEnv) > 0) {
+        timeoutMs = atoi(timeoutEnv);
+    }
+    setBufferReturnTimeout(timeoutMs);
+
+    memset(&flowStats, 0, sizeof(flowStats));
+    int32_t window = kUVCCreditWindow;
+    char *windowEnv = getenv(UVC_CREDIT_WINDOW_ENV);
+    if (windowEnv && strlen(windowEnv) > 0) {
+        window = atoi(windowEnv);
+    }
+    UVCFlowPolicy policy = UVC_FLOW_DROP_NEWEST;
+    char *policyEnv = getenv(UVC_FLOW_POLICY_ENV);
+    if (policyEnv && !strcmp(policyEnv, "replace_oldest")) {
+        policy = UVC_FLOW_REPLACE_OLDEST;
+    } else if (policyEnv && !strcmp(policyEnv, "block")) {
+        policy = UVC_FLOW_BLOCK;
+    }
+    setFlowControl(window, policy);
 #ifdef ENABLE_SHM_SERVER
     shmc::SetLogHandler(shmc::kDebug, [](shmc::LogLevel lv, const char *s) {
         LOG_INFO("[%d] %s\n", lv, s);
@@ -83,10 +88,17 @@ void ShmUVCController::initialize() {
     shmRet = shmReadWriteQueue.InitForWrite(kShmUVCReadKey, kUVCQueueBufSize);
     shmRet = shmReadQueue.InitForRead(kShmUVCReadKey);
     LOG_INFO("shmReadQueue InitForRead(ret=%d)\n", shmRet);
-#endif
-#if UVC_DYNAMIC_DEBUG
-    debugLooping = true;
-    debugThread = new std::thread(ProcessDebug, this);
+
+    shmRet = writeBell.initialize(kShmUVCWriteBellKey);
+    shmRet = readBell.initialize(kShmUVCReadBellKey) && shmRet;
+    LOG_INFO("uvc doorbell initialize(ret=%d)\n", shmRet);
+
+    shmRet = frameRing.initialize(kShmUVCFrameRingKey, UVC_FRAME_RING_PRODUCER);
+    shmRet = returnRing.initialize(kShmUVCReturnRingKey, UVC_FRAME_RING_CONSUMER) && shmRet;
+    LOG_INFO("uvc frame ring initialize(ret=%d)\n", shmRet);
+
+    shmRet = fdExporter.initialize(UVC_FD_CHANNEL_NAME);
+    LOG_INFO("uvc fd channel initialize(ret=%d)\n", shmRet);
 #endif
 
     drmFd = drm_open();
@@ -96,6 +108,53 @@ void ShmUVCController::setControlListener(RTGraphListener* listener) {
     graphListener = listener;
 }
 
+void ShmUVCController::setBufferReturnTimeout(int32_t timeoutMs) {
+    std::lock_guard<std::mutex> lock(opMutex);
+    // 0 or negative disables aging
+    bufReturnTimeoutUs = timeoutMs > 0 ? timeoutMs * 1000LL : 0;
+    LOG_INFO("uvc buffer return timeout %d ms\n", timeoutMs);
+}
+
+void ShmUVCController::setFlowControl(int32_t window, UVCFlowPolicy policy) {
+    std::lock_guard<std::mutex> lock(opMutex);
+    // the in-flight table is the hard limit
+    creditWindow = std::max(1, std::min(window, bufTable.capacity()));
+    flowPolicy = policy;
+    creditCond.notify_all();
+    LOG_INFO("uvc credit window %d, flow policy %d\n", creditWindow, flowPolicy);
+}
+
+UVCFlowStats ShmUVCController::getFlowStats() {
+    std::lock_guard<std::mutex> lock(opMutex);
+    return flowStats;
+}
+
+void ShmUVCController::getStats(std::map<std::string, int64_t> *stats) {
+    std::lock_guard<std::mutex> lock(opMutex);
+    const UVCBufferTableStats &table = bufTable.getStats();
+    (*stats)["running"]           = uvcRunning ? 1 : 0;
+    (*stats)["send_seq"]          = sendSeq;
+    (*stats)["recv_seq"]          = recvSeq;
+    (*stats)["send_count"]        = sendCount;
+    (*stats)["recv_count"]        = recvCount;
+    (*stats)["in_flight"]         = table.inFlight;
+    (*stats)["in_flight_max"]     = table.maxInFlight;
+    (*stats)["credit_window"]     = creditWindow;
+    (*stats)["frame_ring_depth"]  = frameRing.size();
+    (*stats)["return_ring_depth"] = returnRing.size();
+    (*stats)["fd_channel"]        = fdExporter.isConnected() ? 1 : 0;
+    (*stats)["stale_returns"]     = table.staleReturns;
+    (*stats)["expired"]           = table.expired;
+    (*stats)["table_overflow"]    = table.overflow;
+    (*stats)["drop_newest"]       = flowStats.dropNewest;
+    (*stats)["replace_oldest"]    = flowStats.replaceOldest;
+    (*stats)["block_waits"]       = flowStats.blockWaits;
+    (*stats)["block_timeouts"]    = flowStats.blockTimeouts;
+    (*stats)["return_avg_us"]     = table.returned > 0
+                                  ? table.returnTimeSumUs / table.returned : 0;
+    (*stats)["return_max_us"]     = table.returnTimeMaxUs;
+}
+
 void ShmUVCController::reset() {
     int ret = 0;
     int length = 0;
@@ -119,6 +178,7 @@ void ShmUVCController::startRecvMessage() {
 void ShmUVCController::stopRecvMessage()
 {
     recvLooping = false;
+    readBell.interrupt();
     if (recvThread) {
         recvThread->join();
         delete recvThread;
@@ -132,6 +192,10 @@ void ShmUVCController::recvUVCMessageLoop() {
     int ret = 0;
     while (recvLooping) {
         std::string msg;
+        // sample before popping, a ring between pop and wait is not lost
+        uint32_t bellSeq = readBell.sequence();
+
+        int32_t returned = drainReturnRing();
 
         do {
             std::lock_guard<std::mutex> lock(readQueueMtx);
@@ -142,8 +206,24 @@ void ShmUVCController::recvUVCMessageLoop() {
             LOG_DEBUG("recv uvc message = %s\n", msg.c_str());
             handleUVCMessage(msg);
             msg.clear();
+        } else if (returned > 0) {
+            continue;
+        } else if (readBell.isValid()) {
+            int32_t waitMs = readBell.hasWriter() ? kUVCIdleWaitMs : kUVCLegacyPollMs;
+            // a stalled consumer also stalls sendUVCBuffer, so age out here too
+            if (bufReturnTimeoutUs > 0 && bufTable.inFlight() > 0) {
+                waitMs = std::min<int64_t>(waitMs, bufReturnTimeoutUs / 2000 + 1);
+            }
+            if (readBell.wait(bellSeq, waitMs) == 0) {
+                std::lock_guard<std::mutex> lock(opMutex);
+                expireUVCBuffer(getMonotonicUs());
+                fdExporter.acceptPeer();
+            }
         } else {
-            usleep(5*1000);
+            usleep(kUVCLegacyPollMs * 1000);
+            std::lock_guard<std::mutex> lock(opMutex);
+            expireUVCBuffer(getMonotonicUs());
+            fdExporter.acceptPeer();
         }
     }
     LOG_INFO("recv uvc message thread end\n");
@@ -183,6 +263,10 @@ void ShmUVCController::handleUVCMessage(std::string &msg) {
         LOG_DEBUG("recv uvc buffer message\n");
         break;
       }
+      case MSG_UVC_TRANSPORT_BUF_BATCH: {
+        doRecvUVCBuffers(message);
+        break;
+      }
       case MSG_UVC_CONFIG_CAMERA: {
         StreamInfo streamInfo = message.stream_info();
         doUpdateCameraParams(&streamInfo);
@@ -217,17 +301,18 @@ void ShmUVCController::doStartUVC() {
         graphListener->start(RT_APP_UVC);
     }
     std::lock_guard<std::mutex> lock(opMutex);
+    // uvc_app connects before asking for frames
+    fdExporter.acceptPeer();
     uvcRunning = true;
-#if UVC_DYNAMIC_DEBUG
-    send_count = 0;
-    recv_count = 0;
-#endif
+    sendCount = 0;
+    recvCount = 0;
 }
 
 void ShmUVCController::doStopUVC() {
     {
         std::lock_guard<std::mutex> lock(opMutex);
         uvcRunning = false;
+        resumeOnConfigured = false;
         LOG_INFO("clear uvc buffer after stopped\n");
         clearUVCBuffer();
         LOG_INFO("clear uvc buffer ok\n");
@@ -239,42 +324,101 @@ void ShmUVCController::doStopUVC() {
 }
 
 void ShmUVCController::doRecvUVCBuffer(MediaBufferInfo* bufferInfo) {
-    std::lock_guard<std::mutex> lock(opMutex);
-    int32_t uniqueId = bufferInfo->id();
-    int64_t privData = bufferInfo->priv_data();
-    recv_seq = bufferInfo->seq();
-    recv_count ++;
-
-    RTMediaBuffer* mediaBuffer = (RTMediaBuffer *)privData;
-
-    int32_t found = 0;
-    std::list<RTMediaBuffer *>::iterator it;
-    for (it = bufList.begin(); it != bufList.end();) {
-        RTMediaBuffer *buf = *it;
-        if (buf == mediaBuffer) {
-            it = bufList.erase(it);
-            mediaBuffer->release();
-            found = 1;
-            break;
-        } else {
-            it++;
+    doReturnUVCBuffer(bufferInfo->priv_data(), bufferInfo->id(), bufferInfo->seq());
+}
+
+void ShmUVCController::doRecvUVCBuffers(const UVCMessage &message) {
+    int32_t count = message.buffer_infos_size();
+    std::vector<RTMediaBuffer *> buffers;
+    buffers.reserve(count);
+    {
+        // one lock for the whole burst, sendUVCBuffer waits on the same mutex
+        std::lock_guard<std::mutex> lock(opMutex);
+        for (int32_t i = 0; i < count; i++) {
+            const MediaBufferInfo &bufferInfo = message.buffer_infos(i);
+            RTMediaBuffer *buffer = returnUVCBufferLocked(bufferInfo.priv_data(),
+                                                          bufferInfo.id(), bufferInfo.seq());
+            if (buffer != nullptr) {
+                buffers.push_back(buffer);
+            }
         }
     }
+    releaseReturnedBuffers(buffers);
+    LOG_DEBUG("recv %d uvc buffers in one batch\n", count);
+}
+
+void ShmUVCController::doReturnUVCBuffer(int64_t cookie, int32_t uniqueId, int32_t seq) {
+    RTMediaBuffer *buffer = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(opMutex);
+        buffer = returnUVCBufferLocked(cookie, uniqueId, seq);
+    }
+    if (buffer != nullptr) {
+        buffer->release();
+        creditCond.notify_one();
+    }
+}
 
-    if (found) {
-        LOG_DEBUG("recv uvc buffer uniqueId %d, buffer 0x%llx\n", uniqueId, privData);
+// called with opMutex held, the caller releases the buffer after unlocking
+RTMediaBuffer *ShmUVCController::returnUVCBufferLocked(int64_t cookie, int32_t uniqueId,
+                                                       int32_t seq) {
+    recvSeq = seq;
+    recvCount++;
+
+    RTMediaBuffer* mediaBuffer = bufTable.release(cookie, uniqueId, getMonotonicUs());
+    if (mediaBuffer != nullptr) {
+        FrameTracer::mark(FRAME_TRACE_UVC_RETURN, seq, 0);
+        LOG_DEBUG("recv uvc buffer uniqueId %d, cookie 0x%llx\n", uniqueId, cookie);
     } else {
-        LOG_ERROR("recv invalid uvc buffer 0x%llx, seq:%d\n", privData, recv_seq);
+        LOG_ERROR("recv stale uvc buffer uniqueId %d cookie 0x%llx, seq:%d\n",
+                  uniqueId, cookie, seq);
+    }
+    return mediaBuffer;
+}
+
+void ShmUVCController::releaseReturnedBuffers(std::vector<RTMediaBuffer *> &buffers) {
+    if (buffers.empty()) {
+        return;
+    }
+    for (RTMediaBuffer *buffer : buffers) {
+        buffer->release();
+    }
+    creditCond.notify_all();
+}
+
+int32_t ShmUVCController::drainReturnRing() {
+    int32_t count = 0;
+    UVCFrameDesc descs[UVC_FRAME_RING_CAPACITY];
+    while (count < UVC_FRAME_RING_CAPACITY && returnRing.pop(&descs[count])) {
+        count++;
     }
+    if (count == 0) {
+        return 0;
+    }
+
+    std::vector<RTMediaBuffer *> buffers;
+    buffers.reserve(count);
+    {
+        std::lock_guard<std::mutex> lock(opMutex);
+        for (int32_t i = 0; i < count; i++) {
+            RTMediaBuffer *buffer = returnUVCBufferLocked(descs[i].cookie, descs[i].id,
+                                                          descs[i].seq);
+            if (buffer != nullptr) {
+                buffers.push_back(buffer);
+            }
+        }
+    }
+    releaseReturnedBuffers(buffers);
+    return count;
 }
 
 void ShmUVCController::doUpdateCameraParams(StreamInfo* streamInfo) {
-    int forceClear = 0;
     if (uvcRunning && (cameraWidth != streamInfo->width() ||
         cameraHeight != streamInfo->height())) {
         LOG_ERROR("config camera in unexpected state\n");
         uvcRunning = false;
-        forceClear = 1;
+        // the graph applies the config later on its command queue
+        resumeOnConfigured = true;
         std::lock_guard<std::mutex> lock(opMutex);
         clearUVCBuffer();
     }
@@ -289,76 +433,186 @@ void ShmUVCController::doUpdateCameraParams(StreamInfo* streamInfo) {
     cameraWidth = streamInfo->width();
     cameraHeight = streamInfo->height();
     graphListener->invoke(RT_APP_UVC, RT_ACTION_CONFIG_CAMERA, &cameraParams);
+}
 
-    if (forceClear) {
+void ShmUVCController::onCameraConfigured() {
+    if (resumeOnConfigured.exchange(false)) {
         uvcRunning = true;
     }
 }
 
 void ShmUVCController::clearUVCBuffer() {
-    std::list<RTMediaBuffer *>::iterator it;
-    for (it = bufList.begin(); it != bufList.end();) {
-        RTMediaBuffer *buffer = *it;
-        it = bufList.erase(it);
-        if (buffer == nullptr) {
-            LOG_ERROR("uvc buffer null pointer\n");
-        } else {
-            LOG_ERROR("force release uniqueId %d, buffer 0x%x\n", buffer->getUniqueID(), buffer);
+    std::vector<RTMediaBuffer *> buffers;
+    bufTable.clear(&buffers);
+    for (RTMediaBuffer *buffer : buffers) {
+        LOG_ERROR("force release uniqueId %d, buffer %p\n", buffer->getUniqueID(), buffer);
+        buffer->release();
+    }
+    // the pool may be torn down after this, let uvc_app unmap everything
+    fdExporter.flush();
+    creditCond.notify_all();
+}
+
+void ShmUVCController::expireUVCBuffer(int64_t nowUs) {
+    if (bufReturnTimeoutUs <= 0 || bufTable.inFlight() == 0) {
+        return;
+    }
+    // scanning the table is cheap but there is no need to do it every frame
+    if (nowUs - lastExpireCheckUs < bufReturnTimeoutUs / 4) {
+        return;
+    }
+    lastExpireCheckUs = nowUs;
+
+    std::vector<RTMediaBuffer *> buffers;
+    if (bufTable.expire(nowUs, bufReturnTimeoutUs, &buffers) > 0) {
+        for (RTMediaBuffer *buffer : buffers) {
+            LOG_ERROR("uvc buffer uniqueId %d not returned in %lld ms, release it\n",
+                      buffer->getUniqueID(), bufReturnTimeoutUs / 1000);
             buffer->release();
         }
+        LOG_ERROR("expired uvc buffers total %lld\n", bufTable.getStats().expired);
+        creditCond.notify_all();
     }
 }
 
-void ShmUVCController::sendUVCBuffer(RTMediaBuffer* buffer) {
-    int64_t pts = 0;
-    int32_t seq = 0;
-    std::string sendbuf;
-    UVCMessage message;
-    if (buffer == nullptr) {
-        return;
+// called with opMutex held, true when a frame may be lent to uvc_app
+bool ShmUVCController::waitForCredit(std::unique_lock<std::mutex> &lock, int32_t seq) {
+    if (bufTable.inFlight() < creditWindow) {
+        return true;
     }
 
-    MediaBufferInfo *bufferInfo = new MediaBufferInfo();
-    message.set_allocated_buffer_info(bufferInfo);
-    //MediaBufferInfo bufferInfo = message.buffer_info();
+    switch (flowPolicy) {
+      case UVC_FLOW_REPLACE_OLDEST: {
+        // freshest frame wins, but only over a frame uvc_app has not picked
+        // up yet. frames it holds may be in a transfer, they come back
+        // through the return path or the return timeout
+        UVCFrameDesc desc;
+        if (frameRing.peerReady() && frameRing.dropOldest(&desc)) {
+            RTMediaBuffer *oldest = bufTable.release(desc.cookie, desc.id, getMonotonicUs());
+            if (oldest != nullptr) {
+                oldest->release();
+            }
+            flowStats.replaceOldest++;
+            return true;
+        }
+        break;
+      }
+      case UVC_FLOW_BLOCK: {
+        int64_t waitMs = bufReturnTimeoutUs > 0 ? bufReturnTimeoutUs / 1000 : kUVCIdleWaitMs;
+        flowStats.blockWaits++;
+        bool credited = creditCond.wait_for(lock, std::chrono::milliseconds(waitMs), [this] {
+            return !uvcRunning || bufTable.inFlight() < creditWindow;
+        });
+        if (credited && uvcRunning) {
+            return true;
+        }
+        if (!credited) {
+            flowStats.blockTimeouts++;
+        }
+        break;
+      }
+      default:
+        break;
+    }
 
-    buffer->getMetaData()->findInt64(kKeyFramePts, &pts);
-    buffer->getMetaData()->findInt32(kKeyFrameSequence, &seq);
+    flowStats.dropNewest++;
+    LOG_DEBUG("uvc credit window(%d) full, drop seq:%d\n", creditWindow, seq);
+    return false;
+}
+
+bool ShmUVCController::pushFrameDesc(RTMediaBuffer *buffer, int64_t cookie,
+                                     int64_t pts, int32_t seq) {
+    UVCFrameDesc desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.id     = buffer->getUniqueID();
+    desc.fd     = buffer->getFd();
+    desc.size   = buffer->getSize();
+    desc.seq    = seq;
+    desc.pts    = pts;
+    desc.cookie = cookie;
+    desc.handle = buffer->getHandle();
+    if (fdExporter.exportBuffer(desc.id, desc.fd, desc.size)) {
+        desc.fd     = -1;
+        desc.flags |= UVC_FRAME_FLAG_FD_CHANNEL;
+        desc.epoch  = fdExporter.epoch();
+    }
+    return frameRing.push(desc);
+}
+
+// legacy path for uvc_app that has not attached to the frame ring
+bool ShmUVCController::pushFrameMessage(RTMediaBuffer *buffer, int64_t cookie,
+                                        int64_t pts, int32_t seq) {
+    std::string sendbuf;
+    UVCMessage message;
+    MediaBufferInfo *bufferInfo = message.mutable_buffer_info();
     bufferInfo->set_id(buffer->getUniqueID());
     bufferInfo->set_size(buffer->getSize());
-    bufferInfo->set_fd(buffer->getFd());
     bufferInfo->set_handle(buffer->getHandle());
     bufferInfo->set_pts(pts);
-    bufferInfo->set_data((int64_t)buffer->getData());
-    bufferInfo->set_priv_data((int64_t)buffer);
+    if (fdExporter.exportBuffer(buffer->getUniqueID(), buffer->getFd(), buffer->getSize())) {
+        // process local fd and address mean nothing to an importing peer
+        bufferInfo->set_fd(-1);
+        bufferInfo->set_epoch(fdExporter.epoch());
+    } else {
+        bufferInfo->set_fd(buffer->getFd());
+        bufferInfo->set_data((int64_t)buffer->getData());
+    }
+    // opaque to uvc_app, echoed back in MSG_UVC_TRANSPORT_BUF
+    bufferInfo->set_priv_data(cookie);
     bufferInfo->set_seq(seq);
     message.set_msg_type(MSG_UVC_TRANSPORT_BUF);
     message.set_msg_name("uvcbuffer");
     message.SerializeToString(&sendbuf);
-    message.ParseFromString(sendbuf);
+    return shmWriteQueue.Push(sendbuf);
+}
 
-    std::lock_guard<std::mutex> lock(opMutex);
+void ShmUVCController::sendUVCBuffer(RTMediaBuffer* buffer) {
+    int64_t pts = 0;
+    int32_t seq = 0;
+    if (buffer == nullptr) {
+        return;
+    }
+
+    buffer->getMetaData()->findInt64(kKeyFramePts, &pts);
+    buffer->getMetaData()->findInt32(kKeyFrameSequence, &seq);
+
+    std::unique_lock<std::mutex> lock(opMutex);
     if (!uvcRunning) {
         buffer->release();
         return;
     }
-    bufList.push_back(buffer);
-    shmWriteQueue.Push(sendbuf);
 
+    expireUVCBuffer(getMonotonicUs());
+    if (!waitForCredit(lock, seq)) {
+        buffer->release();
+        return;
+    }
+
+    int64_t nowUs = getMonotonicUs();
+    int64_t cookie = bufTable.acquire(buffer, seq, nowUs);
+    if (cookie == UVC_BUFFER_INVALID_COOKIE) {
+        LOG_ERROR("uvc in-flight table full(%d), drop seq:%d\n", bufTable.capacity(), seq);
+        buffer->release();
+        return;
+    }
+
+    bool pushed = frameRing.peerReady()
+                ? pushFrameDesc(buffer, cookie, pts, seq)
+                : pushFrameMessage(buffer, cookie, pts, seq);
+    if (!pushed) {
+        LOG_ERROR("push uvc buffer seq:%d failed, drop it\n", seq);
+        bufTable.release(cookie, buffer->getUniqueID(), nowUs);
+        buffer->release();
+        return;
+    }
+    writeBell.ring();
+    FrameTracer::mark(FRAME_TRACE_UVC_SEND, seq, pts);
+
+    sendSeq = seq;
+    sendCount++;
 #if UVC_DYNAMIC_DEBUG
-    send_seq = seq;
-    send_count ++;
-    if (!access(UVC_DYNAMIC_DEBUG_USE_TIME_CHECK, 0)) {
-        int32_t use_time_us, now_time_us;
-        struct timespec now_tm = {0, 0};
-        clock_gettime(CLOCK_MONOTONIC, &now_tm);
-        now_time_us = now_tm.tv_sec * 1000000LL + now_tm.tv_nsec / 1000; // us
-        use_time_us = now_time_us - pts;
-        LOG_ERROR("isp->aiserver seq:%d latency time:%d us, %d ms\n",seq, use_time_us, use_time_us / 1000);
-    }
-
-    if (!access(UVC_DYNAMIC_DEBUG_IPC_BUFFER_CHECK, 0)) {
-        LOG_ERROR("send uvc buffer uniqueId %d, buffer 0x%llx\n", buffer->getUniqueID(), (int64_t)buffer);
+    if (FrameTracer::isEnabled(FRAME_TRACE_IPC_LOG)) {
+        LOG_ERROR("send uvc buffer uniqueId %d, cookie 0x%llx\n", buffer->getUniqueID(), cookie);
     }
 #endif
 
@@ -5,6 +5,9 @@
 #ifndef SHM_CONTROL_UVC_H_
 #define SHM_CONTROL_UVC_H_
 
+#include <atomic>
+#include <condition_variable>
+#include <map>
 #include <mutex>
 #include <shmc/shm_queue.h>
 #include <stdint.h>
@@ -14,16 +17,33 @@
 #include "RTMediaBuffer.h"
 #include "rt_metadata.h"
 #include "dbus_graph_control.h"
+#include "shm_doorbell.h"
+#include "uvc_buffer_table.h"
+#include "uvc_fd_channel.h"
+#include "uvc_frame_ring.h"
+#include "frame_tracer.h"
 
 #define UVC_DYNAMIC_DEBUG 1 //release version can set to 0
-#define UVC_DYNAMIC_DEBUG_USE_TIME_CHECK   "/tmp/uvc_use_time"
-#define UVC_DYNAMIC_DEBUG_IPC_BUFFER_CHECK "/tmp/uvc_ipc_buffer"
-#define UVC_IPC_DYNAMIC_DEBUG_STATE        "/tmp/uvc_ipc_state"
+// buffers not returned by uvc_app within this time are force released
+#define UVC_BUFFER_RETURN_TIMEOUT_ENV      "UVC_BUFFER_RETURN_TIMEOUT_MS"
+// frames lent to uvc_app at once, and what to do when all are out
+#define UVC_CREDIT_WINDOW_ENV              "UVC_CREDIT_WINDOW"
+#define UVC_FLOW_POLICY_ENV                "UVC_FLOW_POLICY"
 
 namespace {
 constexpr const char *kShmUVCWriteKey  = "0x20001";
 constexpr const char *kShmUVCReadKey   = "0x20002";
+constexpr const char *kShmUVCWriteBellKey = "0x20011";
+constexpr const char *kShmUVCReadBellKey  = "0x20012";
+constexpr const char *kShmUVCFrameRingKey  = "0x20021";
+constexpr const char *kShmUVCReturnRingKey = "0x20022";
 constexpr size_t      kUVCQueueBufSize = 1024 * 1024 * 0.5;
+// uvc_app that never rang the doorbell is polled like before
+constexpr int32_t     kUVCLegacyPollMs = 5;
+// idle wakeup only to re-check recvLooping and legacy writers
+constexpr int32_t     kUVCIdleWaitMs   = 1000;
+constexpr int32_t     kUVCBufferReturnTimeoutMs = 1000;
+constexpr int32_t     kUVCCreditWindow = 4;
 } // namespace
 using namespace shmc;
 
@@ -42,8 +62,22 @@ enum ShmUVCMessageType {
     MSG_UVC_SET_EPTZ_PAN = 7,
     MSG_UVC_SET_EPTZ_TILT = 8,
     MSG_UVC_ENABLE_BYPASS  = 9,
+    MSG_UVC_TRANSPORT_BUF_BATCH = 10,  // buffer_infos, returned together
 };
 
+enum UVCFlowPolicy {
+    UVC_FLOW_DROP_NEWEST    = 0,  // skip the frame being sent
+    UVC_FLOW_REPLACE_OLDEST = 1,  // take back the oldest frame uvc_app has not read
+    UVC_FLOW_BLOCK          = 2,  // stall the caller until a credit returns
+};
+
+typedef struct _UVCFlowStats {
+    int64_t dropNewest;
+    int64_t replaceOldest;
+    int64_t blockWaits;
+    int64_t blockTimeouts;  // counted in dropNewest as well
+} UVCFlowStats;
+
 class ShmUVCController {
   public:
     ShmUVCController();
@@ -52,28 +86,52 @@ class ShmUVCController {
     void initialize();
     void reset();
     void setControlListener(RTGraphListener* listener);
+    void setBufferReturnTimeout(int32_t timeoutMs);
+    void setFlowControl(int32_t window, UVCFlowPolicy policy);
+    UVCFlowStats getFlowStats();
+    // snapshot for GetUVCStats, names are part of the dbus interface
+    void getStats(std::map<std::string, int64_t> *stats);
     void sendUVCBuffer(RTMediaBuffer* buffer);
+    // camera config is applied asynchronously, resume once the graph took it
+    void onCameraConfigured();
     void startRecvMessage();
     void stopRecvMessage();
     void recvUVCMessageLoop();
-#if UVC_DYNAMIC_DEBUG
-    void debugLoop();
-#endif
 
   private:
     void handleUVCMessage(std::string &msg);
     void doStartUVC();
     void doStopUVC();
     void doRecvUVCBuffer(MediaBufferInfo* bufferInfo);
+    void doRecvUVCBuffers(const UVCMessage &message);
+    void doReturnUVCBuffer(int64_t cookie, int32_t uniqueId, int32_t seq);
+    RTMediaBuffer *returnUVCBufferLocked(int64_t cookie, int32_t uniqueId, int32_t seq);
+    void releaseReturnedBuffers(std::vector<RTMediaBuffer *> &buffers);
+    int32_t drainReturnRing();
+    bool pushFrameDesc(RTMediaBuffer *buffer, int64_t cookie, int64_t pts, int32_t seq);
+    bool pushFrameMessage(RTMediaBuffer *buffer, int64_t cookie, int64_t pts, int32_t seq);
     void doUpdateCameraParams(StreamInfo* streamInfo);
     void clearUVCBuffer();
+    void expireUVCBuffer(int64_t nowUs);
+    bool waitForCredit(std::unique_lock<std::mutex> &lock, int32_t seq);
 
   private:
     RTGraphListener      *graphListener;
     ShmQueue<shmc::SVIPC> shmWriteQueue;
     ShmQueue<shmc::SVIPC> shmReadWriteQueue;
     ShmQueue<shmc::SVIPC> shmReadQueue;
-    std::list<RTMediaBuffer *> bufList;
+    ShmDoorbell           writeBell;
+    ShmDoorbell           readBell;
+    UVCFrameRing          frameRing;   // frame descriptors to uvc_app
+    UVCFrameRing          returnRing;  // returned descriptors from uvc_app
+    UVCFdExporter         fdExporter;  // dma-bufs to uvc_app by SCM_RIGHTS
+    UVCBufferTable        bufTable;
+    int64_t               bufReturnTimeoutUs;
+    int64_t               lastExpireCheckUs;
+    int32_t               creditWindow;
+    UVCFlowPolicy         flowPolicy;
+    UVCFlowStats          flowStats;
+    std::condition_variable creditCond;
     std::mutex            readQueueMtx;
     std::mutex            opMutex;
     std::thread          *recvThread;
@@ -82,14 +140,12 @@ class ShmUVCController {
     int32_t               drmFd;
     int32_t               cameraWidth;
     int32_t               cameraHeight;
-#if UVC_DYNAMIC_DEBUG
-    std::thread          *debugThread;
-    bool                 debugLooping;
-    int32_t              recv_seq;
-    int32_t              send_seq;
-    int32_t              recv_count;
-    int32_t              send_count;
-#endif
+    // written by the graph and the recv thread, read by dbus
+    std::atomic<int32_t>  recvSeq;
+    std::atomic<int32_t>  sendSeq;
+    std::atomic<int64_t>  recvCount;
+    std::atomic<int64_t>  sendCount;
+    std::atomic<bool>     resumeOnConfigured;
 
 };
 } // namespace aiserver
@@ -0,0 +1,160 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm_doorbell.h"
+#include "logger/log.h"
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "shm_doorbell"
+
+#define SHM_DOORBELL_MAGIC    0x44424c4c  // "DBLL"
+#define SHM_DOORBELL_VERSION  1
+
+namespace rockchip {
+namespace aiserver {
+
+static int futexWait(volatile uint32_t *addr, uint32_t val, const struct timespec *timeout) {
+    // FUTEX_WAIT without PRIVATE flag, the word is shared between processes
+    return syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+static int futexWake(volatile uint32_t *addr, int count) {
+    return syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+ShmDoorbell::ShmDoorbell() {
+    shmId = -1;
+    state = nullptr;
+}
+
+ShmDoorbell::~ShmDoorbell() {
+    release();
+}
+
+bool ShmDoorbell::initialize(const char *key) {
+    if (state != nullptr) {
+        return true;
+    }
+
+    key_t shmKey = (key_t)strtol(key, NULL, 0);
+    shmId = shmget(shmKey, sizeof(ShmDoorbellState), IPC_CREAT | 0666);
+    if (shmId < 0) {
+        LOG_ERROR("shmget doorbell(%s) failed, errno %d\n", key, errno);
+        return false;
+    }
+
+    void *addr = shmat(shmId, NULL, 0);
+    if (addr == (void *)-1) {
+        LOG_ERROR("shmat doorbell(%s) failed, errno %d\n", key, errno);
+        shmId = -1;
+        return false;
+    }
+
+    state = (ShmDoorbellState *)addr;
+    // a fresh segment is zero filled, whoever attaches first stamps it
+    if (__sync_bool_compare_and_swap(&state->magic, 0, SHM_DOORBELL_MAGIC)) {
+        state->version = SHM_DOORBELL_VERSION;
+    } else if (state->magic != SHM_DOORBELL_MAGIC) {
+        LOG_ERROR("doorbell(%s) bad magic 0x%x\n", key, state->magic);
+        shmdt(addr);
+        state = nullptr;
+        shmId = -1;
+        return false;
+    }
+
+    LOG_INFO("doorbell(%s) attached, seq %u\n", key, state->seq);
+    return true;
+}
+
+void ShmDoorbell::release() {
+    if (state != nullptr) {
+        shmdt((void *)state);
+        state = nullptr;
+    }
+    shmId = -1;
+}
+
+uint32_t ShmDoorbell::sequence() const {
+    if (state == nullptr) {
+        return 0;
+    }
+    return __atomic_load_n(&state->seq, __ATOMIC_ACQUIRE);
+}
+
+bool ShmDoorbell::hasWriter() const {
+    if (state == nullptr) {
+        return false;
+    }
+    return __atomic_load_n(&state->rings, __ATOMIC_RELAXED) != 0;
+}
+
+void ShmDoorbell::ring() {
+    if (state == nullptr) {
+        return;
+    }
+
+    __atomic_add_fetch(&state->rings, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&state->seq, 1, __ATOMIC_SEQ_CST);
+    // skip the syscall when nobody sleeps, the common case under load
+    if (__atomic_load_n(&state->waiters, __ATOMIC_SEQ_CST) > 0) {
+        futexWake(&state->seq, INT32_MAX);
+    }
+}
+
+void ShmDoorbell::interrupt() {
+    if (state == nullptr) {
+        return;
+    }
+
+    __atomic_add_fetch(&state->seq, 1, __ATOMIC_SEQ_CST);
+    futexWake(&state->seq, INT32_MAX);
+}
+
+int32_t ShmDoorbell::wait(uint32_t lastSeq, int32_t timeoutMs) {
+    if (state == nullptr) {
+        return -1;
+    }
+
+    struct timespec timeout;
+    struct timespec *pTimeout = nullptr;
+    if (timeoutMs >= 0) {
+        timeout.tv_sec  = timeoutMs / 1000;
+        timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+        pTimeout = &timeout;
+    }
+
+    int32_t ret = 0;
+    __atomic_add_fetch(&state->waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&state->seq, __ATOMIC_SEQ_CST) != lastSeq) {
+        ret = 1;
+    } else if (futexWait(&state->seq, lastSeq, pTimeout) == 0) {
+        ret = 1;
+    } else if (errno == EAGAIN || errno == EINTR) {
+        // value changed before we slept, or a signal, let caller re-check
+        ret = 1;
+    } else if (errno == ETIMEDOUT) {
+        ret = 0;
+    } else {
+        LOG_ERROR("futex wait failed, errno %d\n", errno);
+        ret = -1;
+    }
+    __atomic_sub_fetch(&state->waiters, 1, __ATOMIC_SEQ_CST);
+
+    return ret;
+}
+
+} // namespace aiserver
+} // namespace rockchip
@@ -0,0 +1,54 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SHM_DOORBELL_H_
+#define SHM_DOORBELL_H_
+
+#include <stdint.h>
+
+namespace rockchip {
+namespace aiserver {
+
+/*
+ * futex doorbell living in a small SysV segment next to a SVIPC queue.
+ * the writer pushes into the queue and then ring()s, the reader pops until
+ * the queue is empty and then wait()s on the sequence it saw before popping.
+ * both sides only need the key, so it works between unrelated processes.
+ */
+typedef struct _ShmDoorbellState {
+    uint32_t magic;
+    uint32_t version;
+    volatile uint32_t seq;      // futex word, bumped on every ring
+    volatile uint32_t waiters;  // readers sleeping on seq
+    volatile uint32_t rings;    // total rings, 0 means a legacy writer
+    uint32_t reserved[3];
+} ShmDoorbellState;
+
+class ShmDoorbell {
+  public:
+    ShmDoorbell();
+   ~ShmDoorbell();
+
+    bool     initialize(const char *key);
+    void     release();
+    bool     isValid() const { return state != nullptr; }
+
+    uint32_t sequence() const;
+    bool     hasWriter() const;
+    void     ring();
+    // wake local waiters without marking the writer as doorbell aware
+    void     interrupt();
+    // returns 1 if rung after lastSeq, 0 on timeout, -1 on error.
+    // timeoutMs < 0 waits forever.
+    int32_t  wait(uint32_t lastSeq, int32_t timeoutMs);
+
+  private:
+    int32_t           shmId;
+    ShmDoorbellState *state;
+};
+
+} // namespace aiserver
+} // namespace rockchip
+
+#endif // SHM_DOORBELL_H_
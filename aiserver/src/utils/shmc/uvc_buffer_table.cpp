@@ -0,0 +1,148 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string.h>
+
+#include "uvc_buffer_table.h"
+#include "RTMediaBuffer.h"
+
+namespace rockchip {
+namespace aiserver {
+
+#define COOKIE_SLOT_MASK    0xffffffffLL
+#define COOKIE_GEN_SHIFT    32
+#define COOKIE_GEN_MASK     0x7fffffff  // keep cookies positive
+
+UVCBufferTable::UVCBufferTable(int32_t capacity) {
+    slotCount = capacity > 0 ? capacity : UVC_BUFFER_SLOT_COUNT;
+    slots = new UVCBufferSlot[slotCount];
+    memset(slots, 0, sizeof(UVCBufferSlot) * slotCount);
+    memset(&stats, 0, sizeof(stats));
+
+    for (int32_t i = 0; i < slotCount; i++) {
+        // generation starts at 1, cookie 0 is never valid
+        slots[i].generation = 1;
+        slots[i].nextFree = (i + 1 < slotCount) ? i + 1 : -1;
+    }
+    freeHead = 0;
+}
+
+UVCBufferTable::~UVCBufferTable() {
+    delete[] slots;
+    slots = nullptr;
+}
+
+int64_t UVCBufferTable::acquire(RTMediaBuffer *buffer, int32_t seq, int64_t nowUs) {
+    if (buffer == nullptr) {
+        return UVC_BUFFER_INVALID_COOKIE;
+    }
+
+    if (freeHead < 0) {
+        stats.overflow++;
+        return UVC_BUFFER_INVALID_COOKIE;
+    }
+
+    int32_t index = freeHead;
+    UVCBufferSlot *slot = &slots[index];
+    freeHead = slot->nextFree;
+
+    slot->buffer     = buffer;
+    slot->uniqueId   = buffer->getUniqueID();
+    slot->seq        = seq;
+    slot->sendTimeUs = nowUs;
+    slot->nextFree   = -1;
+
+    stats.inFlight++;
+    if (stats.inFlight > stats.maxInFlight) {
+        stats.maxInFlight = stats.inFlight;
+    }
+
+    return ((int64_t)slot->generation << COOKIE_GEN_SHIFT) | index;
+}
+
+RTMediaBuffer *UVCBufferTable::release(int64_t cookie, int32_t uniqueId, int64_t nowUs) {
+    int64_t  index      = cookie & COOKIE_SLOT_MASK;
+    uint32_t generation = (uint32_t)((uint64_t)cookie >> COOKIE_GEN_SHIFT);
+
+    if (cookie <= 0 || index >= slotCount) {
+        stats.staleReturns++;
+        return nullptr;
+    }
+
+    UVCBufferSlot *slot = &slots[index];
+    if (slot->buffer == nullptr || slot->generation != generation
+            || slot->uniqueId != uniqueId) {
+        stats.staleReturns++;
+        return nullptr;
+    }
+
+    int64_t returnTimeUs = nowUs - slot->sendTimeUs;
+    if (returnTimeUs >= 0) {
+        stats.returned++;
+        stats.returnTimeSumUs += returnTimeUs;
+        if (returnTimeUs > stats.returnTimeMaxUs) {
+            stats.returnTimeMaxUs = returnTimeUs;
+        }
+    }
+
+    RTMediaBuffer *buffer = slot->buffer;
+    freeSlot(index);
+    return buffer;
+}
+
+int32_t UVCBufferTable::expire(int64_t nowUs, int64_t deadlineUs,
+                               std::vector<RTMediaBuffer *> *expiredBuffers) {
+    int32_t count = 0;
+    if (deadlineUs <= 0 || stats.inFlight == 0) {
+        return 0;
+    }
+
+    for (int32_t i = 0; i < slotCount; i++) {
+        UVCBufferSlot *slot = &slots[i];
+        if (slot->buffer == nullptr || nowUs - slot->sendTimeUs < deadlineUs) {
+            continue;
+        }
+        if (expiredBuffers != nullptr) {
+            expiredBuffers->push_back(slot->buffer);
+        }
+        freeSlot(i);
+        stats.expired++;
+        count++;
+    }
+
+    return count;
+}
+
+int32_t UVCBufferTable::clear(std::vector<RTMediaBuffer *> *buffers) {
+    int32_t count = 0;
+    for (int32_t i = 0; i < slotCount; i++) {
+        if (slots[i].buffer == nullptr) {
+            continue;
+        }
+        if (buffers != nullptr) {
+            buffers->push_back(slots[i].buffer);
+        }
+        freeSlot(i);
+        count++;
+    }
+
+    return count;
+}
+
+void UVCBufferTable::freeSlot(int32_t index) {
+    UVCBufferSlot *slot = &slots[index];
+    slot->buffer = nullptr;
+    slot->uniqueId = -1;
+    // bump so any cookie still held by the peer becomes stale
+    slot->generation = (slot->generation + 1) & COOKIE_GEN_MASK;
+    if (slot->generation == 0) {
+        slot->generation = 1;
+    }
+    slot->nextFree = freeHead;
+    freeHead = index;
+    stats.inFlight--;
+}
+
+} // namespace aiserver
+} // namespace rockchip
@@ -0,0 +1,73 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef UVC_BUFFER_TABLE_H_
+#define UVC_BUFFER_TABLE_H_
+
+#include <stdint.h>
+#include <vector>
+
+class RTMediaBuffer;
+
+namespace rockchip {
+namespace aiserver {
+
+#define UVC_BUFFER_SLOT_COUNT       32
+#define UVC_BUFFER_INVALID_COOKIE   (-1)
+
+typedef struct _UVCBufferSlot {
+    RTMediaBuffer *buffer;
+    int32_t        uniqueId;
+    int32_t        seq;
+    uint32_t       generation;
+    int32_t        nextFree;
+    int64_t        sendTimeUs;
+} UVCBufferSlot;
+
+typedef struct _UVCBufferTableStats {
+    int32_t inFlight;
+    int32_t maxInFlight;
+    int64_t staleReturns;  // duplicate, late or unknown cookie
+    int64_t expired;       // never returned within the deadline
+    int64_t overflow;      // no free slot at send time
+    int64_t returned;
+    int64_t returnTimeSumUs;  // send to return, for the average
+    int64_t returnTimeMaxUs;
+} UVCBufferTableStats;
+
+/*
+ * in-flight table for buffers lent to uvc_app.
+ * the cookie handed out with a buffer encodes slot index and generation,
+ * so returns are O(1) and a cookie is only honoured once. not thread safe,
+ * callers serialize with their own lock.
+ */
+class UVCBufferTable {
+  public:
+    explicit UVCBufferTable(int32_t capacity = UVC_BUFFER_SLOT_COUNT);
+   ~UVCBufferTable();
+
+    int64_t        acquire(RTMediaBuffer *buffer, int32_t seq, int64_t nowUs);
+    RTMediaBuffer *release(int64_t cookie, int32_t uniqueId, int64_t nowUs);
+    int32_t        expire(int64_t nowUs, int64_t deadlineUs,
+                          std::vector<RTMediaBuffer *> *expiredBuffers);
+    int32_t        clear(std::vector<RTMediaBuffer *> *buffers);
+
+    int32_t        capacity() const { return slotCount; }
+    int32_t        inFlight() const { return stats.inFlight; }
+    const UVCBufferTableStats &getStats() const { return stats; }
+
+  private:
+    void           freeSlot(int32_t index);
+
+  private:
+    UVCBufferSlot      *slots;
+    int32_t             slotCount;
+    int32_t             freeHead;
+    UVCBufferTableStats stats;
+};
+
+} // namespace aiserver
+} // namespace rockchip
+
+#endif // UVC_BUFFER_TABLE_H_
@@ -0,0 +1,338 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "uvc_fd_channel.h"
+#include "logger/log.h"
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "uvc_fd_channel"
+
+namespace rockchip {
+namespace aiserver {
+
+static socklen_t makeAbstractAddr(const char *name, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    // leading '\0' selects the abstract namespace, nothing left on disk
+    size_t len = strlen(name);
+    if (len > sizeof(addr->sun_path) - 1) {
+        len = sizeof(addr->sun_path) - 1;
+    }
+    memcpy(addr->sun_path + 1, name, len);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+UVCFdExporter::UVCFdExporter() {
+    listenFd = -1;
+    peerFd = -1;
+    channelEpoch = 0;
+}
+
+UVCFdExporter::~UVCFdExporter() {
+    release();
+}
+
+bool UVCFdExporter::initialize(const char *name) {
+    if (listenFd >= 0) {
+        return true;
+    }
+
+    struct sockaddr_un addr;
+    socklen_t addrLen = makeAbstractAddr(name, &addr);
+    listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) {
+        LOG_ERROR("create fd channel socket failed, errno %d\n", errno);
+        return false;
+    }
+    if (bind(listenFd, (struct sockaddr *)&addr, addrLen) < 0
+            || listen(listenFd, 1) < 0) {
+        LOG_ERROR("bind fd channel(%s) failed, errno %d\n", name, errno);
+        close(listenFd);
+        listenFd = -1;
+        return false;
+    }
+
+    // differs on every aiserver start, importers key their cache on it
+    struct timespec now = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    channelEpoch = ((uint32_t)getpid() << 16) ^ (uint32_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+    if (channelEpoch == 0) {
+        channelEpoch = 1;
+    }
+    LOG_INFO("fd channel(%s) listening, epoch 0x%x\n", name, channelEpoch);
+    return true;
+}
+
+void UVCFdExporter::release() {
+    dropPeer();
+    if (listenFd >= 0) {
+        close(listenFd);
+        listenFd = -1;
+    }
+}
+
+bool UVCFdExporter::acceptPeer() {
+    if (listenFd < 0) {
+        return false;
+    }
+
+    int32_t fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    // one uvc_app at a time, a reconnect replaces the old peer
+    dropPeer();
+    peerFd = fd;
+    if (!sendMessage(UVC_FD_MSG_HELLO, -1, 0, -1)) {
+        dropPeer();
+        return false;
+    }
+    LOG_INFO("fd channel peer connected\n");
+    return true;
+}
+
+bool UVCFdExporter::exportBuffer(int32_t id, int32_t fd, int32_t size) {
+    if (peerFd < 0 || fd < 0) {
+        return false;
+    }
+
+    std::map<int32_t, int32_t>::iterator it = exported.find(id);
+    if (it != exported.end() && it->second == fd) {
+        return true;
+    }
+
+    if (!sendMessage(UVC_FD_MSG_IMPORT, id, size, fd)) {
+        // peer is gone or not draining, fall back to the legacy fields
+        dropPeer();
+        return false;
+    }
+    exported[id] = fd;
+    return true;
+}
+
+void UVCFdExporter::flush() {
+    if (peerFd < 0 || exported.empty()) {
+        return;
+    }
+    if (!sendMessage(UVC_FD_MSG_FLUSH, -1, 0, -1)) {
+        dropPeer();
+        return;
+    }
+    exported.clear();
+}
+
+bool UVCFdExporter::sendMessage(uint16_t type, int32_t id, int32_t size, int32_t fd) {
+    UVCFdMessage message;
+    memset(&message, 0, sizeof(message));
+    message.magic   = UVC_FD_CHANNEL_MAGIC;
+    message.version = UVC_FD_CHANNEL_VERSION;
+    message.type    = type;
+    message.epoch   = channelEpoch;
+    message.id      = id;
+    message.size    = size;
+
+    struct iovec iov;
+    iov.iov_base = &message;
+    iov.iov_len  = sizeof(message);
+
+    char control[CMSG_SPACE(sizeof(int32_t))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(int32_t));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int32_t));
+    }
+
+    ssize_t ret = sendmsg(peerFd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (ret != (ssize_t)sizeof(message)) {
+        LOG_ERROR("fd channel send type %d id %d failed, errno %d\n", type, id, errno);
+        return false;
+    }
+    return true;
+}
+
+void UVCFdExporter::dropPeer() {
+    if (peerFd >= 0) {
+        close(peerFd);
+        peerFd = -1;
+        LOG_INFO("fd channel peer dropped\n");
+    }
+    exported.clear();
+}
+
+UVCFdImporter::UVCFdImporter() {
+    sockFd = -1;
+    channelEpoch = 0;
+}
+
+UVCFdImporter::~UVCFdImporter() {
+    disconnect();
+}
+
+bool UVCFdImporter::connect(const char *name) {
+    if (sockFd >= 0) {
+        return true;
+    }
+
+    struct sockaddr_un addr;
+    socklen_t addrLen = makeAbstractAddr(name, &addr);
+    sockFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sockFd < 0) {
+        return false;
+    }
+    if (::connect(sockFd, (struct sockaddr *)&addr, addrLen) < 0) {
+        close(sockFd);
+        sockFd = -1;
+        return false;
+    }
+    return true;
+}
+
+void UVCFdImporter::disconnect() {
+    dropImports();
+    if (sockFd >= 0) {
+        close(sockFd);
+        sockFd = -1;
+    }
+    channelEpoch = 0;
+}
+
+int32_t UVCFdImporter::poll(int32_t timeoutMs) {
+    if (sockFd < 0) {
+        return -1;
+    }
+
+    int32_t count = 0;
+    while (true) {
+        struct pollfd pfd;
+        pfd.fd = sockFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int ret = ::poll(&pfd, 1, count == 0 ? timeoutMs : 0);
+        if (ret <= 0) {
+            return (ret < 0 && errno != EINTR) ? -1 : count;
+        }
+
+        UVCFdMessage message;
+        char control[CMSG_SPACE(sizeof(int32_t))];
+        struct iovec iov;
+        iov.iov_base = &message;
+        iov.iov_len  = sizeof(message);
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t len = recvmsg(sockFd, &msg, MSG_CMSG_CLOEXEC);
+        if (len <= 0) {
+            // exporter restarted or exited, nothing it handed out is valid
+            disconnect();
+            return -1;
+        }
+
+        int32_t fd = -1;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET
+                && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int32_t));
+        }
+
+        if (len != (ssize_t)sizeof(message) || message.magic != UVC_FD_CHANNEL_MAGIC) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            continue;
+        }
+
+        switch (message.type) {
+          case UVC_FD_MSG_HELLO:
+            dropImports();
+            channelEpoch = message.epoch;
+            break;
+          case UVC_FD_MSG_IMPORT: {
+            if (fd < 0) {
+                break;
+            }
+            std::map<int32_t, UVCFdImport>::iterator it = imports.find(message.id);
+            if (it != imports.end()) {
+                munmap(it->second.addr, it->second.size);
+                close(it->second.fd);
+                imports.erase(it);
+            }
+            void *addr = mmap(NULL, message.size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED) {
+                close(fd);
+                break;
+            }
+            UVCFdImport import;
+            import.fd   = fd;
+            import.size = message.size;
+            import.addr = addr;
+            imports[message.id] = import;
+            fd = -1;
+            break;
+          }
+          case UVC_FD_MSG_FLUSH:
+            dropImports();
+            break;
+          default:
+            break;
+        }
+
+        if (fd >= 0) {
+            close(fd);
+        }
+        count++;
+    }
+}
+
+const UVCFdImport *UVCFdImporter::lookup(uint32_t epoch, int32_t id) {
+    if (sockFd < 0 || epoch != channelEpoch) {
+        return nullptr;
+    }
+
+    std::map<int32_t, UVCFdImport>::iterator it = imports.find(id);
+    if (it == imports.end()) {
+        return nullptr;
+    }
+    return &it->second;
+}
+
+void UVCFdImporter::dropImports() {
+    std::map<int32_t, UVCFdImport>::iterator it;
+    for (it = imports.begin(); it != imports.end(); ++it) {
+        munmap(it->second.addr, it->second.size);
+        close(it->second.fd);
+    }
+    imports.clear();
+}
+
+} // namespace aiserver
+} // namespace rockchip
@@ -0,0 +1,116 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef UVC_FD_CHANNEL_H_
+#define UVC_FD_CHANNEL_H_
+
+#include <stdint.h>
+
+/*
+ * dma-buf hand-off to uvc_app. fds are passed with SCM_RIGHTS over an
+ * abstract SOCK_SEQPACKET socket, once per buffer and connection; frames
+ * then only carry the buffer id and the channel epoch. the importer keeps
+ * one mapping per buffer id until the exporter flushes or goes away, so an
+ * aiserver restart shows up as a new epoch plus a hangup, never as a
+ * dangling address.
+ */
+#define UVC_FD_CHANNEL_NAME     "rockchip.aiserver.uvc_fd"
+#define UVC_FD_CHANNEL_MAGIC    0x55464443  // "UFDC"
+#define UVC_FD_CHANNEL_VERSION  1
+
+enum UVCFdMessageType {
+    UVC_FD_MSG_HELLO  = 1,  // exporter -> importer, carries the epoch
+    UVC_FD_MSG_IMPORT = 2,  // exporter -> importer, carries one dma-buf fd
+    UVC_FD_MSG_FLUSH  = 3,  // exporter -> importer, drop every import
+};
+
+typedef struct _UVCFdMessage {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t type;
+    uint32_t epoch;
+    int32_t  id;      // RTMediaBuffer unique id
+    int32_t  size;
+    int32_t  reserved;
+} UVCFdMessage;
+
+#ifdef __cplusplus
+
+#include <map>
+
+namespace rockchip {
+namespace aiserver {
+
+/*
+ * aiserver side, not thread safe, callers serialize with their own lock.
+ */
+class UVCFdExporter {
+  public:
+    UVCFdExporter();
+   ~UVCFdExporter();
+
+    bool     initialize(const char *name);
+    void     release();
+    uint32_t epoch() const { return channelEpoch; }
+    bool     isConnected() const { return peerFd >= 0; }
+
+    // non blocking, takes over a newly connected importer if any
+    bool     acceptPeer();
+    // makes sure the importer holds the dma-buf of this buffer id
+    bool     exportBuffer(int32_t id, int32_t fd, int32_t size);
+    // tell the importer that every buffer id seen so far is gone
+    void     flush();
+
+  private:
+    bool     sendMessage(uint16_t type, int32_t id, int32_t size, int32_t fd);
+    void     dropPeer();
+
+  private:
+    int32_t  listenFd;
+    int32_t  peerFd;
+    uint32_t channelEpoch;
+    // buffer id -> exported fd, per connection
+    std::map<int32_t, int32_t> exported;
+};
+
+typedef struct _UVCFdImport {
+    int32_t  fd;      // local dup of the dma-buf
+    int32_t  size;
+    void    *addr;    // mapped once, reused for every frame
+} UVCFdImport;
+
+/*
+ * uvc_app side, import cache keyed by buffer id.
+ */
+class UVCFdImporter {
+  public:
+    UVCFdImporter();
+   ~UVCFdImporter();
+
+    bool     connect(const char *name);
+    void     disconnect();
+    bool     isConnected() const { return sockFd >= 0; }
+    uint32_t epoch() const { return channelEpoch; }
+
+    // handles pending HELLO/IMPORT/FLUSH, timeoutMs < 0 waits forever.
+    // returns messages handled, -1 once the exporter has gone away.
+    int32_t  poll(int32_t timeoutMs);
+    // nullptr if the epoch is stale or the id was never imported
+    const UVCFdImport *lookup(uint32_t epoch, int32_t id);
+
+  private:
+    void     dropImports();
+
+  private:
+    int32_t  sockFd;
+    uint32_t channelEpoch;
+    std::map<int32_t, UVCFdImport> imports;
+};
+
+} // namespace aiserver
+} // namespace rockchip
+
+#endif // __cplusplus
+
+#endif // UVC_FD_CHANNEL_H_
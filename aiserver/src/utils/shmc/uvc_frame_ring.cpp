@@ -0,0 +1,174 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <unistd.h>
+
+#include "uvc_frame_ring.h"
+#include "logger/log.h"
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "uvc_frame_ring"
+
+namespace rockchip {
+namespace aiserver {
+
+UVCFrameRing::UVCFrameRing() {
+    ringRole = UVC_FRAME_RING_PRODUCER;
+    shmId = -1;
+    header = nullptr;
+    descs = nullptr;
+    mask = 0;
+}
+
+UVCFrameRing::~UVCFrameRing() {
+    release();
+}
+
+bool UVCFrameRing::initialize(const char *key, UVCFrameRingRole role) {
+    if (header != nullptr) {
+        return true;
+    }
+
+    size_t shmSize = sizeof(UVCFrameRingHeader)
+                   + sizeof(UVCFrameDesc) * UVC_FRAME_RING_CAPACITY;
+    key_t shmKey = (key_t)strtol(key, NULL, 0);
+    shmId = shmget(shmKey, shmSize, IPC_CREAT | 0666);
+    if (shmId < 0) {
+        LOG_ERROR("shmget frame ring(%s) failed, errno %d\n", key, errno);
+        return false;
+    }
+
+    void *addr = shmat(shmId, NULL, 0);
+    if (addr == (void *)-1) {
+        LOG_ERROR("shmat frame ring(%s) failed, errno %d\n", key, errno);
+        shmId = -1;
+        return false;
+    }
+
+    header = (UVCFrameRingHeader *)addr;
+    if (__sync_bool_compare_and_swap(&header->magic, 0, UVC_FRAME_RING_MAGIC)) {
+        header->version  = UVC_FRAME_RING_VERSION;
+        header->capacity = UVC_FRAME_RING_CAPACITY;
+        header->descSize = sizeof(UVCFrameDesc);
+    } else if (header->magic != UVC_FRAME_RING_MAGIC
+            || header->capacity != UVC_FRAME_RING_CAPACITY
+            || header->descSize != sizeof(UVCFrameDesc)) {
+        LOG_ERROR("frame ring(%s) layout mismatch(magic 0x%x cap %u desc %u)\n",
+                  key, header->magic, header->capacity, header->descSize);
+        shmdt(addr);
+        header = nullptr;
+        shmId = -1;
+        return false;
+    }
+
+    ringRole = role;
+    descs = (UVCFrameDesc *)((uint8_t *)addr + sizeof(UVCFrameRingHeader));
+    mask = UVC_FRAME_RING_CAPACITY - 1;
+    if (ringRole == UVC_FRAME_RING_CONSUMER) {
+        // whatever the previous consumer left behind is stale
+        __atomic_store_n(&header->tail, __atomic_load_n(&header->head, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELEASE);
+        __atomic_store_n(&header->consumerPid, getpid(), __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&header->producerPid, getpid(), __ATOMIC_RELEASE);
+    }
+
+    LOG_INFO("frame ring(%s) attached as %s\n", key,
+             ringRole == UVC_FRAME_RING_CONSUMER ? "consumer" : "producer");
+    return true;
+}
+
+void UVCFrameRing::release() {
+    if (header != nullptr) {
+        if (ringRole == UVC_FRAME_RING_CONSUMER) {
+            __atomic_store_n(&header->consumerPid, 0, __ATOMIC_RELEASE);
+        } else {
+            __atomic_store_n(&header->producerPid, 0, __ATOMIC_RELEASE);
+        }
+        shmdt((void *)header);
+        header = nullptr;
+        descs = nullptr;
+    }
+    shmId = -1;
+}
+
+bool UVCFrameRing::peerReady() {
+    if (header == nullptr) {
+        return false;
+    }
+    return __atomic_load_n(&header->consumerPid, __ATOMIC_ACQUIRE) != 0;
+}
+
+bool UVCFrameRing::push(const UVCFrameDesc &desc) {
+    if (header == nullptr) {
+        return false;
+    }
+
+    uint32_t head = header->head;
+    uint32_t tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= UVC_FRAME_RING_CAPACITY) {
+        // full, make sure the consumer did not just die with its flag set
+        int32_t pid = __atomic_load_n(&header->consumerPid, __ATOMIC_ACQUIRE);
+        if (pid != 0 && kill(pid, 0) != 0 && errno == ESRCH) {
+            LOG_ERROR("frame ring consumer(%d) is gone\n", pid);
+            __atomic_store_n(&header->consumerPid, 0, __ATOMIC_RELEASE);
+        }
+        return false;
+    }
+
+    descs[head & mask] = desc;
+    __atomic_store_n(&header->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// a slot is only rewritten after tail passed it, so the copy is consistent
+// whenever the compare and swap succeeds
+static bool takeTail(UVCFrameRingHeader *header, UVCFrameDesc *descs, uint32_t mask,
+                     UVCFrameDesc *desc) {
+    uint32_t tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint32_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            return false;
+        }
+        *desc = descs[tail & mask];
+        if (__atomic_compare_exchange_n(&header->tail, &tail, tail + 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+}
+
+bool UVCFrameRing::pop(UVCFrameDesc *desc) {
+    if (header == nullptr || desc == nullptr) {
+        return false;
+    }
+    return takeTail(header, descs, mask, desc);
+}
+
+bool UVCFrameRing::dropOldest(UVCFrameDesc *desc) {
+    if (header == nullptr || desc == nullptr || ringRole != UVC_FRAME_RING_PRODUCER) {
+        return false;
+    }
+    return takeTail(header, descs, mask, desc);
+}
+
+uint32_t UVCFrameRing::size() const {
+    if (header == nullptr) {
+        return 0;
+    }
+    return __atomic_load_n(&header->head, __ATOMIC_ACQUIRE)
+         - __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+}
+
+} // namespace aiserver
+} // namespace rockchip
@@ -0,0 +1,96 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef UVC_FRAME_RING_H_
+#define UVC_FRAME_RING_H_
+
+#include <stdint.h>
+
+/*
+ * fixed layout shared with uvc_app, keep it plain C and only append fields.
+ * one segment holds one single-producer/single-consumer ring:
+ *   aiserver -> uvc_app  frames lent to the consumer
+ *   uvc_app  -> aiserver frames given back
+ * head is written by the producer only. tail is moved by the consumer, and
+ * by the producer taking back a frame nobody has read yet, both with a
+ * compare and swap so a descriptor is never taken twice.
+ */
+#define UVC_FRAME_RING_MAGIC     0x55465247  // "UFRG"
+#define UVC_FRAME_RING_VERSION   3
+#define UVC_FRAME_RING_CAPACITY  64          // power of two
+
+#define UVC_FRAME_RING_CACHELINE 64
+
+// fd is not set, the dma-buf went through the fd channel under epoch
+#define UVC_FRAME_FLAG_FD_CHANNEL  (1u << 0)
+
+typedef struct _UVCFrameDesc {
+    int32_t  id;        // RTMediaBuffer unique id
+    int32_t  fd;        // dma-buf fd in the producer process
+    int32_t  size;
+    int32_t  seq;
+    int64_t  pts;
+    int64_t  cookie;    // in-flight table cookie, echoed back unchanged
+    int32_t  handle;
+    uint32_t flags;
+    uint32_t epoch;     // fd channel epoch, see uvc_fd_channel.h
+    uint32_t reserved;
+} UVCFrameDesc;
+
+typedef struct _UVCFrameRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t descSize;
+    volatile int32_t consumerPid;  // 0 while no consumer is attached
+    volatile int32_t producerPid;
+    uint8_t  pad0[UVC_FRAME_RING_CACHELINE - 6 * sizeof(uint32_t)];
+    volatile uint32_t head;
+    uint8_t  pad1[UVC_FRAME_RING_CACHELINE - sizeof(uint32_t)];
+    volatile uint32_t tail;
+    uint8_t  pad2[UVC_FRAME_RING_CACHELINE - sizeof(uint32_t)];
+} UVCFrameRingHeader;
+
+#ifdef __cplusplus
+
+namespace rockchip {
+namespace aiserver {
+
+enum UVCFrameRingRole {
+    UVC_FRAME_RING_PRODUCER = 0,
+    UVC_FRAME_RING_CONSUMER = 1,
+};
+
+class UVCFrameRing {
+  public:
+    UVCFrameRing();
+   ~UVCFrameRing();
+
+    bool     initialize(const char *key, UVCFrameRingRole role);
+    void     release();
+    bool     isValid() const { return header != nullptr; }
+
+    // producer side, true once a live consumer has attached
+    bool     peerReady();
+    bool     push(const UVCFrameDesc &desc);
+    // the oldest descriptor the consumer has not picked up, false if none
+    bool     dropOldest(UVCFrameDesc *desc);
+    // consumer side
+    bool     pop(UVCFrameDesc *desc);
+    uint32_t size() const;
+
+  private:
+    UVCFrameRingRole    ringRole;
+    int32_t             shmId;
+    UVCFrameRingHeader *header;
+    UVCFrameDesc       *descs;
+    uint32_t            mask;
+};
+
+} // namespace aiserver
+} // namespace rockchip
+
+#endif // __cplusplus
+
+#endif // UVC_FRAME_RING_H_
@@ -0,0 +1,183 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <time.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "frame_tracer.h"
+#include "logger/log.h"
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "frame_tracer"
+
+namespace rockchip {
+namespace aiserver {
+
+FrameTraceHeader *FrameTracer::sHeader = nullptr;
+static pthread_once_t sAttachOnce = PTHREAD_ONCE_INIT;
+
+static FrameTraceRecord *getRecords(FrameTraceHeader *header) {
+    return (FrameTraceRecord *)((uint8_t *)header + sizeof(FrameTraceHeader));
+}
+
+static int64_t getMonotonicUs() {
+    struct timespec now = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+void FrameTracer::attachOnce() {
+    size_t shmSize = sizeof(FrameTraceHeader)
+                   + sizeof(FrameTraceRecord) * FRAME_TRACE_CAPACITY;
+    key_t shmKey = (key_t)strtol(FRAME_TRACE_SHM_KEY, NULL, 0);
+    int shmId = shmget(shmKey, shmSize, IPC_CREAT | 0666);
+    if (shmId < 0) {
+        LOG_ERROR("shmget frame trace failed, errno %d\n", errno);
+        return;
+    }
+
+    void *addr = shmat(shmId, NULL, 0);
+    if (addr == (void *)-1) {
+        LOG_ERROR("shmat frame trace failed, errno %d\n", errno);
+        return;
+    }
+
+    FrameTraceHeader *header = (FrameTraceHeader *)addr;
+    if (__sync_bool_compare_and_swap(&header->magic, 0, FRAME_TRACE_MAGIC)) {
+        header->version  = FRAME_TRACE_VERSION;
+        header->capacity = FRAME_TRACE_CAPACITY;
+    } else if (header->magic != FRAME_TRACE_MAGIC
+            || header->capacity != FRAME_TRACE_CAPACITY) {
+        LOG_ERROR("frame trace layout mismatch(magic 0x%x cap %u)\n",
+                  header->magic, header->capacity);
+        shmdt(addr);
+        return;
+    }
+    __atomic_store_n(&sHeader, header, __ATOMIC_RELEASE);
+}
+
+FrameTraceHeader *FrameTracer::attach() {
+    pthread_once(&sAttachOnce, attachOnce);
+    return __atomic_load_n(&sHeader, __ATOMIC_ACQUIRE);
+}
+
+void FrameTracer::mark(int32_t stage, int32_t seq, int64_t ptsUs) {
+    if (!isEnabled(FRAME_TRACE_LATENCY)) {
+        return;
+    }
+
+    FrameTraceHeader *header = sHeader;
+    uint32_t index = __atomic_fetch_add(&header->head, 1, __ATOMIC_RELAXED);
+    FrameTraceRecord *record = &getRecords(header)[index & (FRAME_TRACE_CAPACITY - 1)];
+    __atomic_store_n(&record->stamp, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    record->stage  = stage;
+    record->seq    = seq;
+    record->ptsUs  = ptsUs;
+    record->timeUs = getMonotonicUs();
+    __atomic_store_n(&record->stamp, index + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t FrameTracer::getMask() {
+    FrameTraceHeader *header = attach();
+    return header != nullptr ? __atomic_load_n(&header->mask, __ATOMIC_ACQUIRE) : 0;
+}
+
+void FrameTracer::setMask(uint32_t mask) {
+    FrameTraceHeader *header = attach();
+    if (header != nullptr) {
+        __atomic_store_n(&header->mask, mask, __ATOMIC_RELEASE);
+    }
+}
+
+static const char *getStageName(int32_t stage) {
+    switch (stage) {
+      case FRAME_TRACE_ISP:        return "isp";
+      case FRAME_TRACE_EPTZ:       return "eptz";
+      case FRAME_TRACE_RGA:        return "rga";
+      case FRAME_TRACE_ZOOM:       return "zoom";
+      case FRAME_TRACE_UVC_SEND:   return "uvc_send";
+      case FRAME_TRACE_UVC_RETURN: return "uvc_return";
+      default:                     return "unknown";
+    }
+}
+
+static int64_t getPercentile(std::vector<int64_t> &values, int32_t percent) {
+    if (values.empty()) {
+        return 0;
+    }
+    size_t index = (values.size() - 1) * percent / 100;
+    return values[index];
+}
+
+int32_t FrameTracer::dump(FILE *fp) {
+    FrameTraceHeader *header = attach();
+    if (header == nullptr) {
+        return -1;
+    }
+
+    // copy out first, writers keep going while we compute
+    std::vector<FrameTraceRecord> records;
+    records.reserve(FRAME_TRACE_CAPACITY);
+    FrameTraceRecord *ring = getRecords(header);
+    for (int32_t i = 0; i < FRAME_TRACE_CAPACITY; i++) {
+        uint32_t stamp = __atomic_load_n(&ring[i].stamp, __ATOMIC_ACQUIRE);
+        if (stamp == 0) {
+            continue;
+        }
+        FrameTraceRecord record = ring[i];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&ring[i].stamp, __ATOMIC_RELAXED) != stamp) {
+            continue;
+        }
+        records.push_back(record);
+    }
+
+    // stages that do not see the pts borrow it from the same seq
+    std::map<int32_t, int64_t> basePts;
+    for (size_t i = 0; i < records.size(); i++) {
+        if (records[i].ptsUs > 0) {
+            basePts[records[i].seq] = records[i].ptsUs;
+        }
+    }
+
+    std::vector<int64_t> latency[FRAME_TRACE_STAGE_MAX];
+    for (size_t i = 0; i < records.size(); i++) {
+        FrameTraceRecord &record = records[i];
+        if (record.stage <= FRAME_TRACE_ISP || record.stage >= FRAME_TRACE_STAGE_MAX) {
+            continue;
+        }
+        std::map<int32_t, int64_t>::iterator it = basePts.find(record.seq);
+        if (it == basePts.end() || record.timeUs < it->second) {
+            continue;
+        }
+        latency[record.stage].push_back(record.timeUs - it->second);
+    }
+
+    fprintf(fp, "frame trace mask 0x%x, %zu records, latency since isp(us)\n",
+            __atomic_load_n(&header->mask, __ATOMIC_ACQUIRE), records.size());
+    fprintf(fp, "%-12s %8s %10s %10s %10s\n", "stage", "count", "p50", "p99", "max");
+    for (int32_t stage = FRAME_TRACE_EPTZ; stage < FRAME_TRACE_STAGE_MAX; stage++) {
+        std::vector<int64_t> &values = latency[stage];
+        std::sort(values.begin(), values.end());
+        fprintf(fp, "%-12s %8zu %10lld %10lld %10lld\n", getStageName(stage), values.size(),
+                (long long)getPercentile(values, 50), (long long)getPercentile(values, 99),
+                (long long)(values.empty() ? 0 : values.back()));
+    }
+    return (int32_t)records.size();
+}
+
+} // namespace aiserver
+} // namespace rockchip
@@ -0,0 +1,89 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef FRAME_TRACER_H_
+#define FRAME_TRACER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * per-frame stage timestamps in a SysV segment. the enable mask lives in
+ * the same segment, so tracing is switched at runtime from another process
+ * (aiserver --trace) and costs one load per frame while it is off. records
+ * go to a lock-free ring, writers claim a slot with fetch_add and publish
+ * it with a stamp, readers drop slots whose stamp moved under them.
+ */
+#define FRAME_TRACE_SHM_KEY      "0x20031"
+#define FRAME_TRACE_MAGIC        0x46545243  // "FTRC"
+#define FRAME_TRACE_VERSION      1
+#define FRAME_TRACE_CAPACITY     4096        // power of two
+
+// enable mask bits
+#define FRAME_TRACE_LATENCY      (1u << 0)   // stage timestamps
+#define FRAME_TRACE_IPC_LOG      (1u << 1)   // per buffer ipc logs
+
+enum FrameTraceStage {
+    FRAME_TRACE_ISP        = 0,  // kKeyFramePts, the base of every frame
+    FRAME_TRACE_EPTZ       = 1,
+    FRAME_TRACE_RGA        = 2,  // face line overlay
+    FRAME_TRACE_ZOOM       = 3,
+    FRAME_TRACE_UVC_SEND   = 4,
+    FRAME_TRACE_UVC_RETURN = 5,
+    FRAME_TRACE_STAGE_MAX,
+};
+
+typedef struct _FrameTraceRecord {
+    volatile uint32_t stamp;  // claim index + 1 once complete, 0 while written
+    int32_t  stage;
+    int32_t  seq;
+    int32_t  reserved;
+    int64_t  ptsUs;           // ISP timestamp, 0 if the stage does not know it
+    int64_t  timeUs;          // CLOCK_MONOTONIC when the stage was reached
+} FrameTraceRecord;
+
+typedef struct _FrameTraceHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    volatile uint32_t mask;   // FRAME_TRACE_* bits
+    volatile uint32_t head;   // total records claimed
+    uint32_t reserved[11];
+} FrameTraceHeader;
+
+#ifdef __cplusplus
+
+namespace rockchip {
+namespace aiserver {
+
+class FrameTracer {
+  public:
+    static bool     isEnabled(uint32_t bit) {
+        FrameTraceHeader *header = __atomic_load_n(&sHeader, __ATOMIC_ACQUIRE);
+        if (header == nullptr) {
+            header = attach();
+        }
+        return header != nullptr
+            && (__atomic_load_n(&header->mask, __ATOMIC_RELAXED) & bit) != 0;
+    }
+    static void     mark(int32_t stage, int32_t seq, int64_t ptsUs);
+    static uint32_t getMask();
+    static void     setMask(uint32_t mask);
+    // p50/p99 per stage over what is left in the ring
+    static int32_t  dump(FILE *fp);
+
+  private:
+    static FrameTraceHeader *attach();
+    static void              attachOnce();
+
+  private:
+    static FrameTraceHeader *sHeader;
+};
+
+} // namespace aiserver
+} // namespace rockchip
+
+#endif // __cplusplus
+
+#endif // FRAME_TRACER_H_
@@ -0,0 +1,193 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+/*
+ * feature ingest throughput with a stand-in recognizer. the recognizer is
+ * one worker that holds every image for a fixed inference time, the way
+ * the npu serializes them, and hands it back like the feature callback.
+ *
+ *   serial: a fresh buffer per image, recognize and wait, the path
+ *           runTaskOnce() took before the ingest thread
+ *   pooled: AIFeaturePool images, the next copy overlaps the inference
+ *
+ * usage: feature_ingest_bench [images] [infer_ms] [width] [height]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "ai_feature_pool.h"
+
+#define BENCH_POOL_DEPTH    4     // FEATURE_POOL_DEPTH of the retriver
+#define BENCH_POOL_WAIT_MS  5000
+
+using rockchip::aiserver::AIFeaturePool;
+
+static int64_t getNowUs() {
+    struct timespec now = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+class StandInRecognizer {
+ public:
+    explicit StandInRecognizer(int32_t inferUs)
+            : mInferUs(inferUs), mRunning(true), mDone(0), mBadImages(0) {
+        mThread = std::thread(&StandInRecognizer::loop, this);
+    }
+
+    ~StandInRecognizer() {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mRunning = false;
+        }
+        mCond.notify_all();
+        mThread.join();
+    }
+
+    // done runs on the recognizer thread once the image is consumed
+    void recognize(uint8_t *image, int32_t index, std::function<void(uint8_t *)> done) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        Job job = { image, index, done };
+        mJobs.push_back(job);
+        mCond.notify_all();
+    }
+
+    void waitDone(int32_t count) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCond.wait(lock, [this, count] { return mDone >= count; });
+    }
+
+    int32_t done() { std::lock_guard<std::mutex> lock(mMutex); return mDone; }
+    int32_t badImages() { std::lock_guard<std::mutex> lock(mMutex); return mBadImages; }
+
+ private:
+    typedef struct {
+        uint8_t *image;
+        int32_t  index;
+        std::function<void(uint8_t *)> done;
+    } Job;
+
+    void loop() {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCond.wait(lock, [this] { return !mRunning || !mJobs.empty(); });
+                if (mJobs.empty()) {
+                    return;
+                }
+                job = mJobs.front();
+                mJobs.pop_front();
+            }
+            // the copy must be complete and not reused while in flight
+            bool bad = job.image[0] != (uint8_t)job.index;
+            std::this_thread::sleep_for(std::chrono::microseconds(mInferUs));
+            bad = bad || job.image[0] != (uint8_t)job.index;
+            job.done(job.image);
+            std::lock_guard<std::mutex> lock(mMutex);
+            mDone++;
+            mBadImages += bad ? 1 : 0;
+            mCond.notify_all();
+        }
+    }
+
+    int32_t     mInferUs;
+    bool        mRunning;
+    int32_t     mDone;
+    int32_t     mBadImages;
+    std::mutex  mMutex;
+    std::condition_variable mCond;
+    std::deque<Job> mJobs;
+    std::thread mThread;
+};
+
+// the parsed RTImage of a batch, every image tagged with its index
+static void fillBatch(std::string *batch, int32_t images, int32_t imgSize) {
+    batch->assign((size_t)images * imgSize, 0x80);
+    for (int32_t i = 0; i < images; i++) {
+        (*batch)[(size_t)i * imgSize] = (char)i;
+    }
+}
+
+static int32_t runSerial(const std::string &batch, int32_t images, int32_t imgSize,
+                         int32_t inferUs, int64_t *costUs) {
+    StandInRecognizer recognizer(inferUs);
+    int64_t startUs = getNowUs();
+    for (int32_t i = 0; i < images; i++) {
+        uint8_t *image = reinterpret_cast<uint8_t *>(malloc(imgSize));
+        memcpy(image, batch.data() + (size_t)i * imgSize, imgSize);
+        recognizer.recognize(image, i, [](uint8_t *data) { free(data); });
+        recognizer.waitDone(i + 1);
+    }
+    *costUs = getNowUs() - startUs;
+    return recognizer.badImages();
+}
+
+static int32_t runPooled(const std::string &batch, int32_t images, int32_t imgSize,
+                         int32_t inferUs, int64_t *costUs) {
+    AIFeaturePool pool(BENCH_POOL_DEPTH);
+    pool.open();
+    int32_t missed = 0;
+    int32_t bad = 0;
+    {
+        StandInRecognizer recognizer(inferUs);
+        int64_t startUs = getNowUs();
+        for (int32_t i = 0; i < images; i++) {
+            uint8_t *image = reinterpret_cast<uint8_t *>(pool.acquire(imgSize, BENCH_POOL_WAIT_MS));
+            if (image == nullptr) {
+                missed++;
+                continue;
+            }
+            memcpy(image, batch.data() + (size_t)i * imgSize, imgSize);
+            recognizer.recognize(image, i, [&pool](uint8_t *data) { pool.release(data); });
+        }
+        recognizer.waitDone(images - missed);
+        *costUs = getNowUs() - startUs;
+        bad = recognizer.badImages();
+    }
+    pool.close();
+    return bad + missed;
+}
+
+int main(int argc, char **argv) {
+    int32_t images  = argc > 1 ? atoi(argv[1]) : 64;
+    int32_t inferMs = argc > 2 ? atoi(argv[2]) : 10;
+    int32_t width   = argc > 3 ? atoi(argv[3]) : 1280;
+    int32_t height  = argc > 4 ? atoi(argv[4]) : 720;
+    int32_t imgSize = width * height * 3 / 2;
+    if (images <= 0 || inferMs < 0 || imgSize <= 0) {
+        fprintf(stderr, "usage: %s [images] [infer_ms] [width] [height]\n", argv[0]);
+        return 2;
+    }
+
+    std::string batch;
+    fillBatch(&batch, images, imgSize);
+
+    int64_t serialUs = 0;
+    int64_t pooledUs = 0;
+    int32_t serialBad = runSerial(batch, images, imgSize, inferMs * 1000, &serialUs);
+    int32_t pooledBad = runPooled(batch, images, imgSize, inferMs * 1000, &pooledUs);
+
+    printf("%d images %dx%d, stand-in inference %d ms\n", images, width, height, inferMs);
+    printf("serial: %8.1f images/s(%lld ms)\n",
+           images * 1000000.0 / (serialUs > 0 ? serialUs : 1), (long long)serialUs / 1000);
+    printf("pooled: %8.1f images/s(%lld ms), pool depth %d\n",
+           images * 1000000.0 / (pooledUs > 0 ? pooledUs : 1), (long long)pooledUs / 1000,
+           BENCH_POOL_DEPTH);
+    if (serialBad != 0 || pooledBad != 0) {
+        fprintf(stderr, "images lost or reused in flight: serial %d pooled %d\n", serialBad, pooledBad);
+        return 1;
+    }
+    return 0;
+}
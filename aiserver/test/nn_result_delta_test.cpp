@@ -0,0 +1,330 @@
+// Copyright 2019 Fuzhou Rockchip Electronics Co., Ltd. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+/*
+ * round trip of recorded result sequences through NNDeltaEncoder and
+ * NNDeltaDecoder. every decoded record must hold the tracks of the source
+ * record, boxes and points within the move threshold, exact on key frames.
+ *
+ * usage: nn_result_delta_test [random frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#include "nn_result_delta.h"
+
+#define TEST_MOVE_THRESHOLD   2
+#define TEST_KEY_INTERVAL     30
+#define TEST_TYPE_FACE        2
+#define TEST_TYPE_HAND        5
+
+using rockchip::aiserver::NNDeltaEncoder;
+using rockchip::aiserver::NNDeltaDecoder;
+
+static int32_t sFailures = 0;
+
+#define TEST_CHECK(cond, ...)                                       \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            fprintf(stderr, "%s:%d: %s: ", __FILE__, __LINE__, #cond); \
+            fprintf(stderr, __VA_ARGS__);                           \
+            fprintf(stderr, "\n");                                  \
+            sFailures++;                                            \
+        }                                                           \
+    } while (0)
+
+static NNResultRecord sSource;
+static NNResultRecord sDecoded;
+
+static void resetRecord(NNResultRecord *record, uint32_t index) {
+    memset(record, 0, sizeof(NNResultRecord));
+    record->index     = index;
+    record->pts       = 1000LL * index;
+    record->modelType = TEST_TYPE_FACE;
+    record->nnWidth   = 1280;
+    record->nnHeight  = 720;
+    strncpy(record->modelName, "test", NN_RESULT_MODEL_NAME_LEN - 1);
+}
+
+static NNResultObject *addObject(NNResultRecord *record, int32_t type, int32_t trackId,
+                                 int16_t left, int16_t top, int16_t size) {
+    NNResultObject *object = &record->objects[record->objectCount++];
+    object->type    = type;
+    object->trackId = trackId;
+    object->left    = left;
+    object->top     = top;
+    object->right   = left + size;
+    object->bottom  = top + size;
+    object->score   = 0.9f;
+    return object;
+}
+
+static void addAttr(NNResultObject *object, const char *name, const char *value, float score) {
+    NNResultAttr *attr = &object->attrs[object->attrCount++];
+    strncpy(attr->name, name, NN_RESULT_ATTR_LEN - 1);
+    strncpy(attr->value, value, NN_RESULT_ATTR_LEN - 1);
+    attr->score = score;
+}
+
+static const NNResultObject *findTrack(const NNResultRecord *record, int32_t type, int32_t trackId) {
+    for (uint32_t i = 0; i < record->objectCount; i++) {
+        if (record->objects[i].type == type && record->objects[i].trackId == trackId) {
+            return &record->objects[i];
+        }
+    }
+    return nullptr;
+}
+
+static bool near(int32_t a, int32_t b, int32_t tolerance) {
+    return abs(a - b) <= tolerance;
+}
+
+// exact is set for key frames, otherwise changes below the thresholds may lag
+static void compareRecords(const NNResultRecord *source, const NNResultRecord *decoded, bool exact) {
+    int32_t moveTolerance  = exact ? 0 : TEST_MOVE_THRESHOLD - 1;
+    float   scoreTolerance = exact ? 0.0015f : 0.021f;
+
+    TEST_CHECK(decoded->index == source->index, "index %u != %u", decoded->index, source->index);
+    TEST_CHECK(decoded->pts == source->pts, "frame %u pts", source->index);
+    TEST_CHECK(decoded->modelType == source->modelType, "frame %u model type", source->index);
+    TEST_CHECK(decoded->nnWidth == source->nnWidth && decoded->nnHeight == source->nnHeight,
+               "frame %u nn size", source->index);
+    TEST_CHECK(strcmp(decoded->modelName, source->modelName) == 0, "frame %u model name", source->index);
+    TEST_CHECK(decoded->objectCount == source->objectCount, "frame %u objects %u != %u",
+               source->index, decoded->objectCount, source->objectCount);
+
+    for (uint32_t i = 0; i < source->objectCount; i++) {
+        const NNResultObject *want = &source->objects[i];
+        const NNResultObject *got  = findTrack(decoded, want->type, want->trackId);
+        TEST_CHECK(got != nullptr, "frame %u lost track %d:%d", source->index, want->type, want->trackId);
+        if (got == nullptr) {
+            continue;
+        }
+        TEST_CHECK(near(got->left, want->left, moveTolerance) && near(got->top, want->top, moveTolerance)
+                   && near(got->right, want->right, moveTolerance)
+                   && near(got->bottom, want->bottom, moveTolerance),
+                   "frame %u track %d box (%d %d %d %d) != (%d %d %d %d)", source->index, want->trackId,
+                   got->left, got->top, got->right, got->bottom,
+                   want->left, want->top, want->right, want->bottom);
+        TEST_CHECK(got->score > want->score - scoreTolerance && got->score < want->score + scoreTolerance,
+                   "frame %u track %d score %f != %f", source->index, want->trackId, got->score, want->score);
+        TEST_CHECK(got->pointCount == want->pointCount, "frame %u track %d points", source->index, want->trackId);
+        for (uint32_t j = 0; j < want->pointCount && j < got->pointCount; j++) {
+            TEST_CHECK(near(got->points[j].x, want->points[j].x, moveTolerance)
+                       && near(got->points[j].y, want->points[j].y, moveTolerance),
+                       "frame %u track %d point %u", source->index, want->trackId, j);
+        }
+        // labels are always sent when they change
+        TEST_CHECK(got->attrCount == want->attrCount, "frame %u track %d attrs", source->index, want->trackId);
+        for (uint32_t j = 0; j < want->attrCount && j < got->attrCount; j++) {
+            TEST_CHECK(strcmp(got->attrs[j].name, want->attrs[j].name) == 0
+                       && strcmp(got->attrs[j].value, want->attrs[j].value) == 0,
+                       "frame %u track %d attr %s=%s", source->index, want->trackId,
+                       got->attrs[j].name, got->attrs[j].value);
+        }
+    }
+}
+
+static int32_t roundTrip(NNDeltaEncoder *encoder, NNDeltaDecoder *decoder, std::string *buf) {
+    int32_t frameType = encoder->encode(&sSource, buf);
+    int32_t ret = decoder->decode(reinterpret_cast<const uint8_t *>(buf->data()), buf->size(), &sDecoded);
+    TEST_CHECK(ret == NN_DELTA_OK, "frame %u decode %d", sSource.index, ret);
+    if (ret == NN_DELTA_OK) {
+        compareRecords(&sSource, &sDecoded, frameType == NN_DELTA_FRAME_KEY);
+    }
+    return frameType;
+}
+
+// tracks come and go, move below and above the threshold, change labels
+static void testScripted() {
+    NNDeltaEncoder encoder;
+    NNDeltaDecoder decoder;
+    std::string buf;
+    encoder.setKeyInterval(TEST_KEY_INTERVAL);
+    encoder.setMoveThreshold(TEST_MOVE_THRESHOLD);
+    uint32_t index = 0;
+
+    resetRecord(&sSource, index++);
+    addObject(&sSource, TEST_TYPE_FACE, 1, 100, 100, 50);
+    TEST_CHECK(roundTrip(&encoder, &decoder, &buf) == NN_DELTA_FRAME_KEY, "first frame is not a key");
+
+    // moved by one, nothing to send for it
+    resetRecord(&sSource, index++);
+    addObject(&sSource, TEST_TYPE_FACE, 1, 101, 100, 50);
+    TEST_CHECK(roundTrip(&encoder, &decoder, &buf) == NN_DELTA_FRAME_DELTA, "small move is a key");
+
+    // a new face and a hand with the same track id, which are other tracks
+    resetRecord(&sSource, index++);
+    addObject(&sSource, TEST_TYPE_FACE, 1, 110, 104, 52);
+    addObject(&sSource, TEST_TYPE_FACE, 2, 400, 300, 80);
+    NNResultObject *hand = addObject(&sSource, TEST_TYPE_HAND, 1, 600, 300, 40);
+    hand->pointCount = 2;
+    hand->points[0].x = 605;
+    hand->points[0].y = 310;
+    hand->points[1].x = 630;
+    hand->points[1].y = 335;
+    roundTrip(&encoder, &decoder, &buf);
+
+    // a far jump, a label and a score change
+    resetRecord(&sSource, index++);
+    addObject(&sSource, TEST_TYPE_FACE, 1, 700, 500, 52);
+    NNResultObject *face = addObject(&sSource, TEST_TYPE_FACE, 2, 400, 300, 80);
+    face->score = 0.5f;
+    addAttr(face, "identity", "1042", 0.83f);
+    hand = addObject(&sSource, TEST_TYPE_HAND, 1, 600, 300, 40);
+    hand->pointCount = 1;
+    hand->points[0].x = 640;
+    hand->points[0].y = 340;
+    roundTrip(&encoder, &decoder, &buf);
+
+    // the first face leaves
+    resetRecord(&sSource, index++);
+    face = addObject(&sSource, TEST_TYPE_FACE, 2, 400, 300, 80);
+    face->score = 0.5f;
+    addAttr(face, "identity", "1042", 0.83f);
+    addObject(&sSource, TEST_TYPE_HAND, 1, 600, 300, 40);
+    TEST_CHECK(roundTrip(&encoder, &decoder, &buf) == NN_DELTA_FRAME_DELTA, "remove is a key");
+
+    // nothing left, the consumers must drop every track
+    resetRecord(&sSource, index++);
+    TEST_CHECK(roundTrip(&encoder, &decoder, &buf) == NN_DELTA_FRAME_DELTA, "empty frame is a key");
+    TEST_CHECK(sDecoded.objectCount == 0, "empty frame kept %u objects", sDecoded.objectCount);
+
+    // a track id seen before comes back as a new track
+    resetRecord(&sSource, index++);
+    addObject(&sSource, TEST_TYPE_FACE, 1, 50, 60, 30);
+    roundTrip(&encoder, &decoder, &buf);
+
+    // untracked objects can not be diffed
+    resetRecord(&sSource, index++);
+    addObject(&sSource, TEST_TYPE_FACE, -1, 50, 60, 30);
+    TEST_CHECK(roundTrip(&encoder, &decoder, &buf) == NN_DELTA_FRAME_KEY, "untracked frame is a delta");
+
+    // a model change restarts the stream
+    resetRecord(&sSource, index++);
+    sSource.modelType = TEST_TYPE_HAND;
+    TEST_CHECK(roundTrip(&encoder, &decoder, &buf) == NN_DELTA_FRAME_KEY, "model change is a delta");
+}
+
+// a consumer that misses a frame waits for the next key frame
+static void testDroppedFrame() {
+    NNDeltaEncoder encoder;
+    NNDeltaDecoder decoder;
+    std::string buf;
+    encoder.setKeyInterval(TEST_KEY_INTERVAL);
+    encoder.setMoveThreshold(TEST_MOVE_THRESHOLD);
+
+    for (uint32_t index = 0; index < 3; index++) {
+        resetRecord(&sSource, index);
+        addObject(&sSource, TEST_TYPE_FACE, 1, 100 + 10 * index, 100, 50);
+        roundTrip(&encoder, &decoder, &buf);
+    }
+
+    // frame 3 never reaches the consumer
+    resetRecord(&sSource, 3);
+    encoder.encode(&sSource, &buf);
+
+    resetRecord(&sSource, 4);
+    addObject(&sSource, TEST_TYPE_FACE, 2, 300, 100, 50);
+    encoder.encode(&sSource, &buf);
+    int32_t ret = decoder.decode(reinterpret_cast<const uint8_t *>(buf.data()), buf.size(), &sDecoded);
+    TEST_CHECK(ret == NN_DELTA_NEED_KEY, "delta after a gap decoded %d", ret);
+
+    // what ShmNNController does when a push fails
+    encoder.requestKey();
+    resetRecord(&sSource, 5);
+    addObject(&sSource, TEST_TYPE_FACE, 2, 305, 100, 50);
+    TEST_CHECK(roundTrip(&encoder, &decoder, &buf) == NN_DELTA_FRAME_KEY, "requested key is a delta");
+
+    resetRecord(&sSource, 6);
+    addObject(&sSource, TEST_TYPE_FACE, 2, 310, 100, 50);
+    TEST_CHECK(roundTrip(&encoder, &decoder, &buf) == NN_DELTA_FRAME_DELTA, "stream did not recover");
+}
+
+static void testMalformed() {
+    NNDeltaEncoder encoder;
+    NNDeltaDecoder decoder;
+    std::string buf;
+
+    resetRecord(&sSource, 0);
+    NNResultObject *face = addObject(&sSource, TEST_TYPE_FACE, 1, 100, 100, 50);
+    addAttr(face, "identity", "7", 0.9f);
+    encoder.encode(&sSource, &buf);
+    for (size_t size = 0; size < buf.size(); size++) {
+        int32_t ret = decoder.decode(reinterpret_cast<const uint8_t *>(buf.data()), size, &sDecoded);
+        TEST_CHECK(ret == NN_DELTA_MALFORMED, "%zu of %zu bytes decoded %d", size, buf.size(), ret);
+    }
+    int32_t ret = decoder.decode(reinterpret_cast<const uint8_t *>(buf.data()), buf.size(), &sDecoded);
+    TEST_CHECK(ret == NN_DELTA_OK, "whole frame decoded %d", ret);
+}
+
+// random walks with tracks entering and leaving, key frames every interval
+static void testRandom(int32_t frames) {
+    NNDeltaEncoder encoder;
+    NNDeltaDecoder decoder;
+    std::string buf;
+    encoder.setKeyInterval(TEST_KEY_INTERVAL);
+    encoder.setMoveThreshold(TEST_MOVE_THRESHOLD);
+    srand(1);
+
+    NNResultRecord tracks;
+    resetRecord(&tracks, 0);
+    int32_t nextTrack = 0;
+    int32_t keys = 0;
+    for (int32_t index = 0; index < frames; index++) {
+        // leave
+        for (uint32_t i = 0; i < tracks.objectCount; i++) {
+            if (rand() % 40 == 0) {
+                tracks.objects[i] = tracks.objects[--tracks.objectCount];
+            }
+        }
+        // enter, with every tenth frame left empty
+        if (tracks.objectCount < NN_RESULT_MAX_OBJECTS && rand() % 8 == 0) {
+            addObject(&tracks, rand() % 2 ? TEST_TYPE_FACE : TEST_TYPE_HAND, nextTrack++,
+                      rand() % 1000, rand() % 600, 20 + rand() % 100);
+        }
+        for (uint32_t i = 0; i < tracks.objectCount; i++) {
+            NNResultObject *object = &tracks.objects[i];
+            int16_t dx = rand() % 7 - 3;
+            int16_t dy = rand() % 7 - 3;
+            object->left += dx;
+            object->right += dx;
+            object->top += dy;
+            object->bottom += dy;
+            object->score = (rand() % 1000) / 1000.0f;
+            if (rand() % 30 == 0) {
+                object->attrCount = 0;
+                addAttr(object, "identity", rand() % 2 ? "1" : "2", 0.5f);
+            }
+        }
+
+        resetRecord(&sSource, index);
+        if (index % 10 != 9) {
+            sSource.objectCount = tracks.objectCount;
+            memcpy(sSource.objects, tracks.objects, sizeof(NNResultObject) * tracks.objectCount);
+        }
+        keys += roundTrip(&encoder, &decoder, &buf) == NN_DELTA_FRAME_KEY ? 1 : 0;
+    }
+    TEST_CHECK(keys >= frames / TEST_KEY_INTERVAL, "%d key frames in %d frames", keys, frames);
+}
+
+int main(int argc, char **argv) {
+    int32_t frames = argc > 1 ? atoi(argv[1]) : 1000;
+
+    testScripted();
+    testDroppedFrame();
+    testMalformed();
+    testRandom(frames);
+
+    if (sFailures != 0) {
+        fprintf(stderr, "%d checks failed\n", sFailures);
+        return 1;
+    }
+    printf("nn result delta round trip ok\n");
+    return 0;
+}